@@ -17,6 +17,10 @@
 #include "input.h"
 #include "entity.h"
 #include "exec.h"
+#include "texload.h"
+#include "texcache.h"
+#include "pacer.h"
+#include "jobs.h"
 #include <memory>
 
 using std::auto_ptr;
@@ -81,11 +85,20 @@ app_t::create(const char* cmd_line)
 	ui_camera.mat_proj.ortho_rh(0.0f, UI_WIDTH, 0.0f, UI_HEIGHT, 1.0f, 500.0f);
 
 	timer.init();
+	pacer.init();
 
+	console.print("Initializing job threads:\n");
+	if (!jobs.init())
+		return result_t::last;
+	console.print(DIVIDER);
 	console.print("Initializing PAK manager:\n");
 	if (!pak.init())
 		return result_t::last;
 	console.print(DIVIDER);
+	console.print("Initializing texture loader:\n");
+	if (!texcache.init() || !texloader.init())
+		return result_t::last;
+	console.print(DIVIDER);
 	console.print("Initializing Audio manager:\n");
 	if (!daudio.create())
 		return result_t::last;
@@ -118,6 +131,9 @@ app_t::destroy()
 	console.print("Cleaning Up Direct3D ... ");
 	d3d.destroy();
 	daudio.destroy();
+	texloader.destroy();
+	jobs.destroy();
+	pacer.destroy();
 	console.print("done\n");
 }
 
@@ -141,9 +157,13 @@ app_t::frame()
 	static int frames;
 	static char framerate[10] = "FPS: ---";
 	static render_stats_t total_stats;
+	static bool idle = false;	// Nothing changed in the last frame drawn
 
 	char temptext[1024];	// Buffer for temporary text
 
+	if (!pacer.wait(idle))
+		return;
+
 	timer.mark(TID_APP);
 	if (m_floor(time) == m_floor(timer.time(TID_APP))) {
 		frames++;
@@ -153,8 +173,12 @@ app_t::frame()
 		frames = 0;
 	}
 
+	vec3_t position(player.position);
+	vec3_t look(player.look);
+	vec3_t up(player.up);
 	if (!console.is_showing())
 		controls.update_player(player);
+	idle = player.position == position && player.look == look && player.up == up && !console.is_showing();
 
 	static bool tildestate;
 	if (tildestate != keyboard.is_key_down(223)) {
@@ -174,11 +198,12 @@ app_t::frame()
 
 		// Set the world camera
 		if (d3d.resources_to_load()) {
+			idle = false;
 			d3d.load_resource();
 		} else if (world.resources_to_load()) {
+			idle = false;
 			world.load_resource();
 		} else if (world.is_valid()) {
-			dl.clear();
 			RECT rect;
 			GetClientRect(hwnd, &rect);
 			float aspect = m_itof(rect.bottom - rect.top) / m_itof(rect.right - rect.left);
@@ -188,20 +213,35 @@ app_t::frame()
 			world_cam.mat_proj.perspective_fov_rh(m_deg2rad(*fov), aspect, 4.0f, 8000.0f);
 			d3d.set_camera(world_cam);
 
-			// Render the world
-			world.tesselate(dl, player.position, frustum_t(world_cam.mat_view * world_cam.mat_proj));
+			// Render the world, last frame's display list is drawn again if the
+			// view hasn't changed. Deformed faces change every frame so a list
+			// with any in it is never reused
+			frustum_t frustum(world_cam.mat_view * world_cam.mat_proj);
+			if (!world.view_unchanged(player.position, frustum)) {
+				dl.clear();
+				world.tesselate(dl, player.position, frustum);
+				if (d3d.deform_list(dl)) {
+					world.invalidate_view();
+					idle = false;
+				}
+			}
 			stats += d3d.render_list(dl);
+			// Deforms, waves, tcmods and animMaps move whether or not the view
+			// does, a frame drawing any of them isn't idle
+			if (d3d.is_animating())
+				idle = false;
+			d3d.load_prefetched();
 		}
 		// Render the console and overlay text
 		d3d.set_camera(ui_camera);
 	
-		dl.clear();
-		console.tesselate(dl);
+		ui_dl.clear();
+		console.tesselate(ui_dl);
 
 		// Show framerate if required
 		if (*showfps) {
 			font.set_color(color_t::red);
-			font.write_text(dl, 69.5f, 60.0f, framerate);
+			font.write_text(ui_dl, 69.5f, 60.0f, framerate);
 		}
 
 		float overlay_text_line = 0.0f;
@@ -210,7 +250,7 @@ app_t::frame()
 		if (world.is_valid()) {
 			font.set_color(color_t::yellow);
 			u_snprintf(temptext, 1024, "%s (%s)", world.level_name.c_str(), world.map_name.c_str());
-			font.write_text(dl, 0.5f, 60.0f - overlay_text_line, temptext);
+			font.write_text(ui_dl, 0.5f, 60.0f - overlay_text_line, temptext);
 			overlay_text_line += 2.0f;
 		}
 
@@ -221,26 +261,26 @@ app_t::frame()
 			u_snprintf(temptext, 1024, "Position (%.2f, %.2f, %.2f) Facing (%.2f, %.2f, %.2f)", 
 				player.position.x, player.position.y, player.position.z, 
 				player.look.x, player.look.y, player.look.z);
-			font.write_text(dl, 0.5f, 60.0f - overlay_text_line, temptext);
+			font.write_text(ui_dl, 0.5f, 60.0f - overlay_text_line, temptext);
 			overlay_text_line += 1.0f;
 		}
-		stats += d3d.render_list(dl);
-		dl.clear();
+		stats += d3d.render_list(ui_dl);
+		ui_dl.clear();
 		total_stats += stats;
 
 		// Show rendering stats if required (the stats for these lines themselves are omitted
 		// since it is a bit of a chicken and egg problem).
 		if (*showrenderstats) {
-			u_snprintf(temptext, 1024, "Frame render stats: %d faces, %d vertices, %d indices",
-				stats.num_faces, stats.num_verts, stats.num_inds);
-			font.write_text(dl, 0.5f, 60.0f - overlay_text_line, temptext);
+			u_snprintf(temptext, 1024, "Frame render stats: %d faces, %d vertices, %d indices, %d state changes filtered",
+				stats.num_faces, stats.num_verts, stats.num_inds, stats.num_filtered);
+			font.write_text(ui_dl, 0.5f, 60.0f - overlay_text_line, temptext);
 			overlay_text_line += 1.0f;
-			u_snprintf(temptext, 1024, "Total render stats: %d faces, %d vertices, %d indices",
-				total_stats.num_faces, total_stats.num_verts, total_stats.num_inds);
-			font.write_text(dl, 0.5f, 60.0f - overlay_text_line, temptext);
+			u_snprintf(temptext, 1024, "Total render stats: %d faces, %d vertices, %d indices, %d state changes filtered",
+				total_stats.num_faces, total_stats.num_verts, total_stats.num_inds, total_stats.num_filtered);
+			font.write_text(ui_dl, 0.5f, 60.0f - overlay_text_line, temptext);
 			overlay_text_line += 1.0f;
 		}
-		d3d.render_list(dl);
+		d3d.render_list(ui_dl);
 
 		d3d.end();
 	}
@@ -29,6 +29,7 @@ private:
 
 	camera_t ui_camera;
 	display_list_t dl;
+	ui_display_list_t ui_dl;
 };
 
 #define app (app_t::get_instance())
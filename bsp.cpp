@@ -10,7 +10,11 @@
 #include "console.h"
 #include "exec.h"
 #include "pak.h"
+#include "timer.h"
 #include <memory>
+#include <string.h>
+#include <limits.h>
+#include <float.h>
 
 #include "mem.h"
 #define new mem_new
@@ -65,6 +69,14 @@ namespace {
 cvar_int_t freezepvs("freezepvs", 0, 0, 1);
 cvar_int_t showbspmodels("showbspmodels", 1, 0, 1);
 cvar_int_t showbspcurves("showbspcurves", 1, 0, 1);
+cvar_int_t view_cache("view_cache", 1, CVF_NONE, 0, 1);
+	// 0 = tesselate the world every frame
+	// 1 = draw the last frame's display list again while the view is unchanged
+cvar_int_t prefetch("prefetch", 1, CVF_NONE, 0, 1);
+	// 0 = textures are loaded when they are first drawn
+	// 1 = textures in the potentially visible set are queued on the texture loader
+cvar_int_t prefetch_radius("prefetch_radius", 384, CVF_NONE, 0);
+	// Leaves within this distance of the eye add their PVS to the prefetch set
 
 int
 bsp_t::resources_to_load()
@@ -75,17 +87,26 @@ bsp_t::resources_to_load()
 void
 bsp_t::load_resource()
 {
+	view_valid = false;
 	if (load_lightmap < num_lightmaps) {
-		// Upload the next lightmap to the graphics card
-		str_t<64> name = "lightmap";
-		name += str_t<64>(load_lightmap);
-		lightmaps[load_lightmap].handle = d3d.upload_lightmap_rgb(
-			lightmaps[load_lightmap].data,
-			lightmap_t::WIDTH,
-			lightmap_t::HEIGHT,
-			name
-		);
-		++load_lightmap;
+		// Upload the remaining lightmaps as one batch, they are converted on
+		// the job threads
+		int count = num_lightmaps - load_lightmap;
+		const ubyte** data = new const ubyte*[count];
+		htexture_t* handles = new htexture_t[count];
+		for (int i = 0; i < count; ++i)
+			data[i] = lightmaps[load_lightmap + i].data;
+		d3d.upload_lightmaps_rgb(data, handles, count, lightmap_t::WIDTH, lightmap_t::HEIGHT, load_lightmap);
+		for (int j = 0; j < count; ++j) {
+			// The managed texture keeps its own copy
+			lightmap_t& lightmap = lightmaps[load_lightmap + j];
+			lightmap.handle = handles[j];
+			delete [] lightmap.data;
+			lightmap.data = 0;
+		}
+		delete [] data;
+		delete [] handles;
+		load_lightmap = num_lightmaps;
 	}
 }
 
@@ -112,6 +133,8 @@ bsp_t::destroy()
 	visvec_size = 0;
 	delete [] visdata;
 	visdata = 0;
+	prefetch_cluster = -2;
+	view_valid = false;
 
 	num_textures = 0;
 	delete [] textures;
@@ -128,6 +151,12 @@ bsp_t::destroy()
 	num_leaves = 0;
 	delete [] leaves;
 	leaves = 0;
+
+	num_vis_leaves = 0;
+	delete [] vis_leaves;
+	vis_leaves = 0;
+	delete [] vis_leaffaces;
+	vis_leaffaces = 0;
 	
 	num_leaffaces = 0;
 	delete [] leaffaces;
@@ -157,6 +186,10 @@ bsp_t::destroy()
 	delete [] meshverts;
 	meshverts = 0;
 	
+	num_static_inds = 0;
+	delete [] static_inds;
+	static_inds = 0;
+	
 	num_faces = 0;
 	delete [] faces;
 	faces = 0;
@@ -164,10 +197,73 @@ bsp_t::destroy()
 
 frustum_t _frustum;
 vec3_t _eye;
-display_list_t* _dl;
 int in_cluster;
 int in_area;
 
+inline float
+view_depth(const vec3_t& point)
+	// Distance of point in front of the near plane
+{
+	return dot(point, _frustum.znear.normal) + _frustum.znear.distance;
+}
+
+cvar_int_t tess_threads("tess_threads", 0, CVF_NONE, 0, MAX_TESS_CHUNKS);
+	// 0 = split the visible leaves into one chunk per job thread
+	// n = split the visible leaves into n chunks
+
+namespace {
+
+	// Job context for tesselating the visible leaves in chunks
+	struct tess_job_t {
+		bsp_t* bsp;
+	};
+
+	void
+	claim_job(void* context, int job)
+	{
+		static_cast<tess_job_t*>(context)->bsp->claim_faces(job);
+	}
+
+	void
+	tesselate_job(void* context, int job)
+	{
+		bsp_t* bsp = static_cast<tess_job_t*>(context)->bsp;
+		bsp->tesselate_chunk(*bsp->segments[job], job);
+	}
+
+	bool
+	same_display_list(const display_list_t& a, const display_list_t& b)
+		// Check that two display lists hold exactly the same faces, with the
+		// same vertices and indices for any that have their own
+	{
+		if (a.num_faces() != b.num_faces() || a.num_verts() != b.num_verts() || a.num_inds() != b.num_inds())
+			return false;
+		for (int i = 0; i < a.num_faces(); ++i) {
+			const face_t& fa = a.face(i);
+			const face_t& fb = b.face(i);
+			if (fa.sort_key != fb.sort_key || fa.shader != fb.shader || fa.lightmap != fb.lightmap ||
+					fa.num_verts != fb.num_verts || fa.num_inds != fb.num_inds ||
+					fa.base_vert != fb.base_vert || fa.base_ind != fb.base_ind)
+				return false;
+			if ((fa.verts == 0) != (fb.verts == 0) || (fa.inds == 0) != (fb.inds == 0))
+				return false;
+			if (fa.verts && memcmp(fa.verts, fb.verts, fa.num_verts * sizeof(vertex_t)) != 0)
+				return false;
+			if (fa.inds && memcmp(fa.inds, fb.inds, fa.num_inds * sizeof(index_t)) != 0)
+				return false;
+		}
+		return true;
+	}
+}
+
+namespace {
+	inline int
+	view_cvar_flags()
+	{
+		return (*freezepvs ? 1 : 0) | (*showbspmodels ? 2 : 0) | (*showbspcurves ? 4 : 0);
+	}
+}
+
 void
 bsp_t::tesselate(display_list_t &dl, const vec3_t& eye, const frustum_t& frustum)
 	// Tesselate the world into dl
@@ -176,7 +272,6 @@ bsp_t::tesselate(display_list_t &dl, const vec3_t& eye, const frustum_t& frustum
 	if (!*freezepvs) {
 		_frustum = frustum;
 		_eye = eye;
-		_dl = &dl;
 	}
 	
 	for (int node = 0; node >= 0; ) {
@@ -192,12 +287,165 @@ bsp_t::tesselate(display_list_t &dl, const vec3_t& eye, const frustum_t& frustum
 		in_area = leaves[~node].area;
 	}
 
+	if (*prefetch && in_cluster != prefetch_cluster) {
+		prefetch_cluster = in_cluster;
+		prefetch_visible(eye);
+	}
+
+	tesselate_view(dl, *tess_threads ? *tess_threads : jobs.num_threads());
+
+	view_valid = true;
+	view_eye = eye;
+	view_frustum = frustum;
+	view_flags = view_cvar_flags();
+}
+
+bool
+bsp_t::view_unchanged(const vec3_t& eye, const frustum_t& frustum) const
+	// The cluster and area come from the eye, so an identical eye, frustum and
+	// set of cvars is an identical list. Comparing the floats exactly means
+	// any movement at all is a new view
+{
+	return *view_cache && view_valid && view_flags == view_cvar_flags() && view_eye == eye &&
+		memcmp(&view_frustum, &frustum, sizeof(frustum_t)) == 0;
+}
+
+namespace {
+	struct prefetch_t {
+		float		distance;	// Closest the shader's faces come to the eye
+		hshader_t	shader;
+	};
+
+	int
+	compare_prefetch(const void* a, const void* b)
+	{
+		float da = static_cast<const prefetch_t*>(a)->distance;
+		float db = static_cast<const prefetch_t*>(b)->distance;
+		return da < db ? -1 : (da > db ? 1 : 0);
+	}
+}
+
+void
+bsp_t::find_near_clusters(int index, const bsphere_t& sphere, ubyte* clusters)
+	// Set the bit of every cluster with a leaf touching sphere
+{
+	while (index >= 0) {
+		const node_t& node = nodes[index];
+		const plane_t& plane = planes[node.plane];
+		float d = dot(sphere.midpoint, plane.normal) - plane.distance;
+		if (d > -sphere.radius && d < sphere.radius)
+			find_near_clusters(node.children[1], sphere, clusters);
+		index = d > -sphere.radius ? node.children[0] : node.children[1];
+	}
+	int cluster = leaves[~index].cluster;
+	if (cluster >= 0)
+		clusters[cluster >> 3] |= 1 << (cluster & 7);
+}
+
+void
+bsp_t::prefetch_visible(const vec3_t& eye)
+	// Pass the shaders of every face that can be seen from the clusters near
+	// the eye to the renderer, nearest first, so their textures are loaded
+	// before they come into view
+{
+	if (in_cluster < 0 || !visdata || !num_textures)
+		return;
+
+	// The clusters the eye could move into soon, then everything they see
+	ubyte* near_clusters = new ubyte[visvec_size];
+	ubyte* pvs = new ubyte[visvec_size];
+	u_memset(near_clusters, 0, visvec_size);
+	u_memset(pvs, 0, visvec_size);
+	near_clusters[in_cluster >> 3] |= 1 << (in_cluster & 7);
+	find_near_clusters(0, bsphere_t(eye, m_itof(*prefetch_radius)), near_clusters);
+	for (int c = 0; c < num_visvecs; ++c) {
+		if (near_clusters[c >> 3] & (1 << (c & 7))) {
+			const ubyte* row = visdata + c * visvec_size;
+			for (int b = 0; b < visvec_size; ++b)
+				pvs[b] |= row[b];
+		}
+	}
+
+	prefetch_t* list = new prefetch_t[num_textures];
+	for (int t = 0; t < num_textures; ++t) {
+		list[t].distance = FLT_MAX;
+		list[t].shader = textures[t].shader;
+	}
+	for (int l = 0; l < num_leaves; ++l) {
+		const leaf_t& leaf = leaves[l];
+		if (leaf.cluster < 0 || !(pvs[leaf.cluster >> 3] & (1 << (leaf.cluster & 7))))
+			continue;
+		float distance = u_max((leaf.bsphere.midpoint - eye).length() - leaf.bsphere.radius, 0.0f);
+		for (int f = 0; f < leaf.num_leaffaces; ++f) {
+			prefetch_t& entry = list[faces[leaffaces[leaf.leafface + f]].texture];
+			entry.distance = u_min(entry.distance, distance);
+		}
+	}
+	qsort(list, num_textures, sizeof(prefetch_t), compare_prefetch);
+
+	// Shaders of faces that can't be seen sort to the end, leave them off
+	int count = 0;
+	hshader_t* shaders = new hshader_t[num_textures];
+	for (int i = 0; i < num_textures && list[i].distance < FLT_MAX; ++i)
+		shaders[count++] = list[i].shader;
+	d3d.prefetch_shaders(shaders, count);
+
+	delete [] shaders;
+	delete [] list;
+	delete [] pvs;
+	delete [] near_clusters;
+}
+
+void
+bsp_t::tesselate_view(display_list_t& dl, int chunks)
+	// Tesselate the current view into dl, the visible leaves are collected in
+	// tree order then split into chunks that are tesselated in parallel. Each
+	// face belongs to the first visible leaf that contains it, and the chunks
+	// are appended to dl in leaf order, so the result is identical regardless
+	// of the number of chunks used
+{
 	// Mark all faces as invisible
-	for (int face = 0; face < num_faces; ++face)
+	for (int face = 0; face < num_faces; ++face) {
 		faces[face].drawn = false;
+		faces[face].vis_leaf = LONG_MAX;
+	}
 
+	num_vis_leaves = 0;
+	vis_leaffaces[0] = 0;
 	walk_tree(0);
 
+	// Split the visible leaves into chunks with roughly equal numbers of faces
+	chunks = u_max(1, u_min(chunks, MAX_TESS_CHUNKS));
+	int total = vis_leaffaces[num_vis_leaves];
+	chunk_start[0] = 0;
+	for (int chunk = 1, seq = 0; chunk < chunks; ++chunk) {
+		int target = static_cast<int>(static_cast<__int64>(total) * chunk / chunks);
+		while (seq < num_vis_leaves && vis_leaffaces[seq] < target)
+			++seq;
+		chunk_start[chunk] = seq;
+	}
+	chunk_start[chunks] = num_vis_leaves;
+
+	tess_job_t context;
+	context.bsp = this;
+	jobs.run(claim_job, &context, chunks);
+
+	if (chunks == 1) {
+		// Single chunk goes straight into the display list
+		tesselate_chunk(dl, 0);
+	} else {
+		for (int chunk = 0; chunk < chunks; ++chunk) {
+			if (segments[chunk] == 0)
+				segments[chunk] = new display_list_t;
+			segments[chunk]->clear();
+		}
+		jobs.run(tesselate_job, &context, chunks);
+		for (int chunk = 0; chunk < chunks; ++chunk) {
+			dl.append(*segments[chunk]);
+			segments[chunk]->clear();
+		}
+	}
+
 	if (*showbspmodels == 0)
 		return;
 
@@ -207,41 +455,8 @@ bsp_t::tesselate(display_list_t &dl, const vec3_t& eye, const frustum_t& frustum
 		if (_frustum.intersect_sphere(model.bsphere)) {
 			for (int modelface = model.face; modelface < model.face + model.num_faces; ++modelface) {
 				face_t& face = faces[modelface];
-				hshader_t shader = textures[face.texture].shader;
-				htexture_t lightmap = face.lightmap == -1 ? 0 : lightmaps[face.lightmap].handle;
-
-				if (face.drawn == false && (face.type == FACE_TYPE_POLY || face.type == FACE_TYPE_MESH)) {
-					::face_t* dlface = _dl->get_face(shader, lightmap, 0, 0);
-					if (dlface == 0) {
-						console.print("Unable to allocate face for bsp model\n");
-						return;
-					}
-					dlface->base_ind = face.meshvert;
-					dlface->num_inds = face.num_meshverts;
-					dlface->base_vert = face.vertex;
-					dlface->num_verts = face.num_vertices;
-					face.drawn = true;
-				} else if (face.drawn == false && (face.type == FACE_TYPE_PATCH)) {
-					::face_t* dlface = _dl->get_face(shader, lightmap, 0, (face.patch_size_x - 1) * (face.patch_size_y - 1) * 6);
-					if (dlface == 0) {
-						console.print("Unable to allocate face for bsp model patch\n");
-						return;
-					}
-					dlface->base_vert = face.vertex; 
-					dlface->num_verts = face.num_vertices;
-					index_t* ind = dlface->inds;
-					int w = face.patch_size_x;
-					for (int x = 0; x < face.patch_size_y - 1; ++x)
-						for (int y = 0; y < w - 1; ++y) {
-							*ind++ = x * w + y;
-							*ind++ = (x + 1) * w + y;
-							*ind++ = x * w + y + 1;
-							*ind++ = x * w + y + 1;
-							*ind++ = (x + 1) * w + y;
-							*ind++ = (x + 1) * w + y + 1;
-						}
-					face.drawn = true;
-				}
+				if (face.drawn == false && (face.type == FACE_TYPE_POLY || face.type == FACE_TYPE_MESH || face.type == FACE_TYPE_PATCH))
+					add_face(dl, face);
 			}
 		}
 	}
@@ -249,6 +464,7 @@ bsp_t::tesselate(display_list_t &dl, const vec3_t& eye, const frustum_t& frustum
 
 void
 bsp_t::walk_tree(int index)
+	// Collect the visible leaves in front to back order
 {
 	if (index >= 0) {
 		// This is a node
@@ -270,64 +486,235 @@ bsp_t::walk_tree(int index)
 		if (!_frustum.intersect_sphere(leaf.bsphere) || leaf.area != in_area)
 			return;
 		if (in_cluster < 0 || check_vis(in_cluster, leaf.cluster)) {
-			int last_leafface = leaf.leafface + leaf.num_leaffaces;
-			for (int leafface = leaf.leafface; leafface < last_leafface; ++leafface) {
-				face_t& face = faces[leaffaces[leafface]];
-				hshader_t shader = textures[face.texture].shader;
-				htexture_t lightmap = face.lightmap == -1 ? 0 : lightmaps[face.lightmap].handle;
-
-				if (face.drawn == false && (face.type == FACE_TYPE_POLY || face.type == FACE_TYPE_MESH)) {
-					if (face.type == FACE_TYPE_POLY) {
-						if (textures[face.texture].shader_flags & (SF_CULLBACK | SF_CULLFRONT)) {
-							if (dot(_eye, face.normal) < face.distance) {
-								if (textures[face.texture].shader_flags & SF_CULLBACK) {
-									face.drawn = true;
-									continue;
-								}
-							} else if (textures[face.texture].shader_flags & SF_CULLFRONT) {
-								face.drawn = true;
-								continue;
-							}
+			vis_leaves[num_vis_leaves] = ~index;
+			vis_leaffaces[num_vis_leaves + 1] = vis_leaffaces[num_vis_leaves] + leaf.num_leaffaces;
+			++num_vis_leaves;
+		}
+	}
+}
+
+void
+bsp_t::claim_faces(int chunk)
+	// Give each face in the chunk to the earliest visible leaf containing it,
+	// chunks run concurrently so the minimum is taken atomically
+{
+	for (int seq = chunk_start[chunk]; seq < chunk_start[chunk + 1]; ++seq) {
+		const leaf_t& leaf = leaves[vis_leaves[seq]];
+		int last_leafface = leaf.leafface + leaf.num_leaffaces;
+		for (int leafface = leaf.leafface; leafface < last_leafface; ++leafface) {
+			volatile LONG* owner = reinterpret_cast<volatile LONG*>(&faces[leaffaces[leafface]].vis_leaf);
+			for (LONG current = *owner; seq < current; current = *owner)
+				if (InterlockedCompareExchange(const_cast<LONG*>(owner), seq, current) == current)
+					break;
+		}
+	}
+}
+
+void
+bsp_t::tesselate_chunk(display_list_t& dl, int chunk)
+	// Tesselate the faces owned by the leaves in the chunk into dl
+{
+	for (int seq = chunk_start[chunk]; seq < chunk_start[chunk + 1]; ++seq)
+		tesselate_leaf(dl, seq);
+}
+
+void
+bsp_t::tesselate_leaf(display_list_t& dl, int seq)
+	// Tesselate the faces owned by a visible leaf
+{
+	const leaf_t& leaf = leaves[vis_leaves[seq]];
+	int last_leafface = leaf.leafface + leaf.num_leaffaces;
+	for (int leafface = leaf.leafface; leafface < last_leafface; ++leafface) {
+		face_t& face = faces[leaffaces[leafface]];
+		if (face.vis_leaf != seq)
+			continue;
+
+		if (face.drawn == false && (face.type == FACE_TYPE_POLY || face.type == FACE_TYPE_MESH)) {
+			if (face.type == FACE_TYPE_POLY) {
+				if (textures[face.texture].shader_flags & (SF_CULLBACK | SF_CULLFRONT)) {
+					if (dot(_eye, face.normal) < face.distance) {
+						if (textures[face.texture].shader_flags & SF_CULLBACK) {
+							face.drawn = true;
+							continue;
 						}
-					}
-					::face_t* dlface = _dl->get_face(shader, lightmap, 0, 0);
-					if (dlface == 0) {
-						console.print("Unable to allocate face for bsp leaf\n");
-						return;
-					}
-					dlface->base_ind = face.meshvert;
-					dlface->num_inds = face.num_meshverts;
-					dlface->base_vert = face.vertex;
-					dlface->num_verts = face.num_vertices;
-					face.drawn = true;
-				} else if (face.drawn == false && (face.type == FACE_TYPE_PATCH)) {
-					if (*showbspcurves == 0)
+					} else if (textures[face.texture].shader_flags & SF_CULLFRONT) {
+						face.drawn = true;
 						continue;
-					::face_t* dlface = _dl->get_face(shader, lightmap, 0, (face.patch_size_x - 1) * (face.patch_size_y - 1) * 6);
-					if (dlface == 0) {
-						console.print("Unable to allocate face for bsp patch\n");
-						return;
 					}
-					dlface->base_vert = face.vertex; 
-					dlface->num_verts = face.num_vertices;
-					index_t* ind = dlface->inds;
-					int w = face.patch_size_x;
-					for (int x = 0; x < face.patch_size_y - 1; ++x)
-						for (int y = 0; y < w - 1; ++y) {
-							*ind++ = x * w + y;
-							*ind++ = (x + 1) * w + y;
-							*ind++ = x * w + y + 1;
-							*ind++ = x * w + y + 1;
-							*ind++ = (x + 1) * w + y;
-							*ind++ = (x + 1) * w + y + 1;
-						}
-					face.drawn = true;
 				}
 			}
+			add_face(dl, face);
+		} else if (face.drawn == false && (face.type == FACE_TYPE_PATCH)) {
+			if (*showbspcurves == 0)
+				continue;
+			add_face(dl, face);
 		}
 	}
 }
 
+void
+bsp_t::add_face(display_list_t& dl, face_t& face)
+	// Add a poly, mesh or patch to dl. These draw from the static buffers
+	// unless their shader deforms them or generates texture co-ords, in which
+	// case they get their own copy of the vertices for the CPU to work on
+{
+	hshader_t shader = textures[face.texture].shader;
+	htexture_t lightmap = face.lightmap == -1 ? 0 : lightmaps[face.lightmap].handle;
+	bool deformed = (textures[face.texture].shader_flags & (SF_DEFORM | SF_TCGEN)) != 0;
+	int num_verts = deformed ? face.num_vertices : 0;
+
+	::face_t* dlface;
+	if (face.type == FACE_TYPE_PATCH) {
+		dlface = dl.get_face(shader, lightmap, num_verts, (face.patch_size_x - 1) * (face.patch_size_y - 1) * 6);
+		index_t* ind = dlface->inds;
+		int w = face.patch_size_x;
+		for (int x = 0; x < face.patch_size_y - 1; ++x)
+			for (int y = 0; y < w - 1; ++y) {
+				*ind++ = x * w + y;
+				*ind++ = (x + 1) * w + y;
+				*ind++ = x * w + y + 1;
+				*ind++ = x * w + y + 1;
+				*ind++ = (x + 1) * w + y;
+				*ind++ = (x + 1) * w + y + 1;
+			}
+	} else if (deformed) {
+		// Own indices are relative to the face's first vertex
+		dlface = dl.get_face(shader, lightmap, num_verts, face.num_meshverts);
+		for (int i = 0; i < face.num_meshverts; ++i)
+			dlface->inds[i] = static_cast<index_t>(meshverts[face.meshvert + i]);
+	} else {
+		dlface = dl.get_face(shader, lightmap, 0, 0);
+		dlface->base_ind = face.static_ind;
+		dlface->num_inds = face.num_meshverts;
+	}
+
+	if (deformed)
+		u_memcpy(dlface->verts, vertices + face.vertex, face.num_vertices * sizeof(vertex_t));
+	else
+		dlface->base_vert = face.vertex;
+	dlface->num_verts = face.num_vertices;
+	dl.set_depth(dlface, view_depth(face.centre));
+	face.drawn = true;
+}
+
+void
+bsp_t::benchmark_tesselate(int frames)
+	// Tesselate the last view frames times using from 1 chunk up to one chunk
+	// per job thread, printing the time taken for each and checking that every
+	// chunk count produces exactly the same display list as a single chunk
+{
+	if (num_leaves == 0) {
+		console.print("No map loaded\n");
+		return;
+	}
+
+	auto_ptr<display_list_t> reference(new display_list_t);
+	auto_ptr<display_list_t> test(new display_list_t);
+	float base_time = 0.0f;
+
+	console.printf("Tesselating %d frames:\n", frames);
+	for (int chunks = 1; chunks <= jobs.num_threads(); ++chunks) {
+		display_list_t& dl = chunks == 1 ? *reference : *test;
+		timer.start(TID_PROFILE0);
+		for (int frame = 0; frame < frames; ++frame) {
+			dl.clear();
+			tesselate_view(dl, chunks);
+		}
+		timer.mark(TID_PROFILE0);
+		float ms = timer.elapsed(TID_PROFILE0) * 1000.0f / m_itof(frames);
+		if (chunks == 1)
+			base_time = ms;
+		console.printf("%2d chunks: %7.3fms per frame, %5.2fx, %d faces%s\n",
+			chunks,
+			ms,
+			ms > 0.0f ? base_time / ms : 0.0f,
+			dl.num_faces(),
+			chunks == 1 || same_display_list(*reference, dl) ? "" : " MISMATCH"
+		);
+	}
+}
+
+void
+bsp_t::benchmark_render(int frames)
+	// Draw the last view frames times without a GPU, printing the time taken
+	// and the render commands generated per frame. One more frame is drawn
+	// with collapse_passes changed to compare the number of draws
+{
+	if (num_leaves == 0) {
+		console.print("No map loaded\n");
+		return;
+	}
+
+	auto_ptr<display_list_t> dl(new display_list_t);
+	tesselate_view(*dl, 1);
+
+	null_backend_t null;
+	render_backend_t* previous = d3d.set_backend(&null);
+	render_stats_t stats;
+	timer.start(TID_PROFILE0);
+	for (int frame = 0; frame < frames; ++frame)
+		stats += d3d.render_list(*dl);
+	timer.mark(TID_PROFILE0);
+	d3d.set_backend(previous);
+
+	console.printf("Rendering %d frames of %d faces: %.3fms per frame\n",
+		frames, dl->num_faces(), timer.elapsed(TID_PROFILE0) * 1000.0f / m_itof(frames));
+	float scale = 1.0f / m_itof(frames);
+	for (int i = 0; i < NUM_RENDER_COMMANDS; ++i)
+		console.printf("%-16s %9.1f per frame\n", render_command_name(static_cast<render_command_type_t>(i)),
+			m_itof(null.count(static_cast<render_command_type_t>(i))) * scale);
+	console.printf("%-16s %9.1f per frame\n", "redundant states", m_itof(null.redundant_changes()) * scale);
+	console.printf("%-16s %9.1f per frame\n", "triangles", m_itof(null.num_tris()) * scale);
+	console.printf("%-16s %9.1f per frame\n", "bytes uploaded", m_itof(null.uploaded_bytes()) * scale);
+	console.printf("%-16s %9.1f per frame\n", "filtered states", m_itof(stats.num_filtered) * scale);
+
+	// One more frame with collapse_passes the other way, for comparison
+	null_backend_t other;
+	d3d.set_backend(&other);
+	bool collapsing = d3d.set_pass_collapsing(false);
+	d3d.set_pass_collapsing(!collapsing);
+	d3d.render_list(*dl);
+	d3d.set_pass_collapsing(collapsing);
+	d3d.set_backend(previous);
+	console.printf("Draws per frame: %d with collapse_passes %d, %d with it %d\n",
+		null.count(RCMD_DRAW) / frames, collapsing ? 1 : 0, other.count(RCMD_DRAW), collapsing ? 0 : 1);
+}
+
+void
+bsp_t::record_render(const char* filename)
+	// Draw the last view once into the null backend with the state filter off,
+	// so the recording holds every command d3d_t generates
+{
+	if (num_leaves == 0) {
+		console.print("No map loaded\n");
+		return;
+	}
+
+	auto_ptr<display_list_t> dl(new display_list_t);
+	tesselate_view(*dl, 1);
+
+	null_backend_t null;
+	render_backend_t* previous = d3d.set_backend(&null);
+	bool filtering = d3d.set_state_filtering(false);
+	d3d.render_list(*dl);
+	d3d.set_state_filtering(filtering);
+	d3d.set_backend(previous);
+
+	if (save_recording(filename, null.commands(), null.num_commands()))
+		console.printf("Recorded %d commands for %d faces to %s\n", null.num_commands(), dl->num_faces(), filename);
+	else
+		console.printf("Unable to write %s\n", filename);
+}
+
+void
+bsp_t::destroy_segments()
+{
+	for (int i = 0; i < MAX_TESS_CHUNKS; ++i) {
+		delete segments[i];
+		segments[i] = 0;
+	}
+}
+
 bool
 bsp_t::load_textures(const void* data, uint length)
 	// Retrieve the textures information from the textures block of the file
@@ -425,6 +812,8 @@ bsp_t::load_leaves(const void* data, uint length)
 	// Get the leaf information
 	num_leaves = length / sizeof(bspleaf_t);
 	leaves = new leaf_t[num_leaves];
+	vis_leaves = new int[num_leaves];
+	vis_leaffaces = new int[num_leaves + 1];
 	const bspleaf_t* bspleaves = static_cast<const bspleaf_t*>(data);
 	for (int i = 0; i < num_leaves; ++i) {
 		leaves[i].cluster = bspleaves[i].cluster;
@@ -566,7 +955,7 @@ bsp_t::load_vertices(const void* data, uint length)
 		vertices[i].pos = bspvertices[i].pos;
 		vertices[i].tc0 = bspvertices[i].tc0;
 		vertices[i].tc1 = bspvertices[i].tc1;
-		vertices[i].normal = bspvertices[i].normal;
+		vertices[i].set_normal(bspvertices[i].normal);
 		vertices[i].diffuse = bspvertices[i].color;
 	}
 	return true;
@@ -582,7 +971,7 @@ bsp_t::load_meshverts(const void* data, uint length)
 	meshverts = new meshvert_t[num_meshverts];
 	const bspmeshvert_t* bspmeshverts = static_cast<const bspmeshvert_t*>(data);
 	for (int i = 0; i < num_meshverts; ++i)
-		meshverts[i] = bspmeshverts[i];
+		meshverts[i] = static_cast<meshvert_t>(bspmeshverts[i]);
 	return true;
 }
 
@@ -618,6 +1007,7 @@ bsp_t::load_faces(const void* data, uint length)
 	#pragma pack (pop)
 
 	num_faces = length / sizeof(bspface_t);
+	num_static_inds = 0;
 	faces = new face_t[num_faces];
 	const bspface_t* bspfaces = static_cast<const bspface_t*>(data);
 	for (int i = 0; i < num_faces; ++i) {
@@ -637,6 +1027,30 @@ bsp_t::load_faces(const void* data, uint length)
 		faces[i].patch_size_x = bspfaces[i].patch_size_x;
 		faces[i].patch_size_y = bspfaces[i].patch_size_y;
 		faces[i].distance = dot(faces[i].normal, faces[i].origin);
+		faces[i].centre = vec3_t(0.0f, 0.0f, 0.0f);
+		if (faces[i].num_vertices > 0 && faces[i].vertex + faces[i].num_vertices <= num_vertices) {
+			for (int v = faces[i].vertex; v < faces[i].vertex + faces[i].num_vertices; ++v)
+				faces[i].centre += vertices[v].pos;
+			faces[i].centre /= m_itof(faces[i].num_vertices);
+		}
+		faces[i].static_ind = 0;
+		if ((faces[i].type == FACE_TYPE_POLY || faces[i].type == FACE_TYPE_MESH) &&
+				faces[i].meshvert >= 0 && faces[i].meshvert + faces[i].num_meshverts <= num_meshverts)
+			num_static_inds += faces[i].num_meshverts;
+	}
+
+	// Meshverts are relative to the face's first vertex and faces can share
+	// them, so each face gets its own absolute copy for the static index
+	// buffer to be drawn without rebasing
+	static_inds = new uint[num_static_inds];
+	int next_ind = 0;
+	for (int f = 0; f < num_faces; ++f) {
+		if ((faces[f].type == FACE_TYPE_POLY || faces[f].type == FACE_TYPE_MESH) &&
+				faces[f].meshvert >= 0 && faces[f].meshvert + faces[f].num_meshverts <= num_meshverts) {
+			faces[f].static_ind = next_ind;
+			for (int m = faces[f].meshvert; m < faces[f].meshvert + faces[f].num_meshverts; ++m)
+				static_inds[next_ind++] = meshverts[m] + faces[f].vertex;
+		}
 	}
 	return true;
 }
@@ -655,8 +1069,10 @@ bsp_t::load_lightmaps(const void* data, uint length)
 	num_lightmaps = length / sizeof(bsplightmap_t);
 	lightmaps = new lightmap_t[num_lightmaps];
 	const bsplightmap_t* bsplightmaps = static_cast<const bsplightmap_t*>(data);
-	for (int i = 0; i < num_lightmaps; ++i)
-		u_memcpy(lightmaps[i].data, bsplightmaps[i].data, 128 * 128 * 3);
+	for (int i = 0; i < num_lightmaps; ++i) {
+		lightmaps[i].data = new ubyte[sizeof(bsplightmap_t)];
+		u_memcpy(lightmaps[i].data, bsplightmaps[i].data, sizeof(bsplightmap_t));
+	}
 	return true;
 }
 
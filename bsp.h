@@ -8,15 +8,19 @@
 #define BSP_H
 
 #include "displaylist.h"
+#include "jobs.h"
 #include "maths.h"
 #include "str.h"
 
+// Most pieces the visible leaves can be split into for tesselation
+#define MAX_TESS_CHUNKS		MAX_JOB_THREADS
+
 class bsp_t {
 	// Binary space partition tree
 public:
 	typedef int leafface_t;
 	typedef int leafbrush_t;
-	typedef index_t meshvert_t;
+	typedef uint meshvert_t;	// Vertex number relative to the face's first vertex
 
 	struct lightmap_t {
 	public:
@@ -24,10 +28,15 @@ public:
 		enum { HEIGHT = 128 };
 		enum { CHANNELS = 3 };
 		
-		lightmap_t() : handle(0) {}
+		lightmap_t() : data(0), handle(0) {}
+		~lightmap_t() { delete [] data; }
 
-		ubyte data[HEIGHT * WIDTH * CHANNELS];
+		ubyte* data;		// HEIGHT * WIDTH * CHANNELS, freed once uploaded
 		htexture_t handle;
+
+	private:
+		lightmap_t(const lightmap_t&);
+		void operator=(const lightmap_t&);
 	};
 
 	class texture_t {
@@ -99,15 +108,18 @@ public:
 		int num_vertices;	// Number of vertices
 		int meshvert;		// Index of first meshvert
 		int num_meshverts;	// Number of meshverts
+		int static_ind;		// First index in static_inds, polygons and meshes only
 		int lightmap;		// Lightmap index
 		vec2_t lm_start;	// Lightmap start
 		vec2_t lm_size;		// Lightmap size
 		vec3_t origin;		// Face origin
 		bbox_t bbox;		// Face bounds
 		vec3_t normal;		// Surface normal
+		vec3_t centre;		// Average of the face vertices, used for depth sorting
 		int	 patch_size_x;	// Patch x size;
 		int	 patch_size_y;	// Patch y size;
 		bool drawn;
+		long vis_leaf;		// First visible leaf containing the face this frame
 		float distance;		// distance to face
 //		uint flags;
 	};
@@ -124,11 +136,15 @@ public:
 		num_brushsides(0),
 		num_vertices(0),
 		num_meshverts(0),
+		num_static_inds(0),
 		num_faces(0),
 		num_lightmaps(0),
 		num_lightvols(0),
 		num_visvecs(0),
 		load_lightmap(0),
+		prefetch_cluster(-2),
+		view_valid(false),
+		view_flags(0),
 		visvec_size(0),
 		textures(0),
 		planes(0),
@@ -141,12 +157,19 @@ public:
 		brushsides(0),
 		vertices(0),
 		meshverts(0),
+		static_inds(0),
 		faces(0),
 		lightmaps(0),
 		lightvols(0),
-		visdata(0)
-	{}
-	~bsp_t() { destroy(); }
+		visdata(0),
+		num_vis_leaves(0),
+		vis_leaves(0),
+		vis_leaffaces(0)
+	{
+		for (int i = 0; i < MAX_TESS_CHUNKS; ++i)
+			segments[i] = 0;
+	}
+	~bsp_t() { destroy(); destroy_segments(); }
 
 	int		resources_to_load();
 	void	load_resource();
@@ -155,6 +178,22 @@ public:
 	void	destroy();
 	void	tesselate(display_list_t& dl, const vec3_t& eye, const frustum_t& frustum);
 
+	// True if tesselating this view would give the same display list as the
+	// last one tesselated, so that list can be drawn again. Call
+	// invalidate_view if the last list was changed after tesselation
+	bool	view_unchanged(const vec3_t& eye, const frustum_t& frustum) const;
+	void	invalidate_view() { view_valid = false; }
+
+	// Time tesselation of the last view using 1 up to n chunks
+	void	benchmark_tesselate(int frames);
+
+	// Draw the last view n times through the null render backend
+	void	benchmark_render(int frames);
+
+	// Save the unfiltered render commands for the last view, to be replayed
+	// by tools/replay.cpp
+	void	record_render(const char* filename);
+
 	// Load the various parts of the bsp
 //	bool load_entities(const void* data, uint length);
 	bool load_textures(const void* data, uint length);
@@ -187,6 +226,7 @@ public:
 	int num_brushsides;
 	int num_vertices;
 	int num_meshverts;
+	int num_static_inds;
 	int num_faces;
 	int num_lightmaps;
 	int num_lightvols;
@@ -194,6 +234,13 @@ public:
 	int visvec_size;
 
 	int load_lightmap;
+	int prefetch_cluster;	// Cluster the last prefetch was made from, -2 for none
+
+	// Everything the last display list tesselated depended on
+	bool view_valid;
+	vec3_t view_eye;
+	frustum_t view_frustum;
+	int view_flags;			// Cvars changing what is tesselated
 
 	lightvol_t* lightvols;
 	lightmap_t* lightmaps;
@@ -208,10 +255,31 @@ public:
 	brushside_t* brushsides;
 	vertex_t* vertices;
 	meshvert_t* meshverts;
+	uint* static_inds;		// Absolute indices of each polygon and mesh face in turn
 	face_t* faces;
 	ubyte* visdata;
 
+	// Visible leaves in the order walk_tree reached them, along with the
+	// running total of leaffaces before each one (used to balance chunks)
+	int num_vis_leaves;
+	int* vis_leaves;
+	int* vis_leaffaces;
+
+	// Display lists the chunks of visible leaves are tesselated into before
+	// being appended to the main list in order, they are cleared straight
+	// after so their pages go back to the pool for the next frame
+	display_list_t* segments[MAX_TESS_CHUNKS];
+	int chunk_start[MAX_TESS_CHUNKS + 1];
+
 	void walk_tree(int index);
+	void tesselate_view(display_list_t& dl, int chunks);
+	void claim_faces(int chunk);
+	void tesselate_chunk(display_list_t& dl, int chunk);
+	void tesselate_leaf(display_list_t& dl, int seq);
+	void add_face(display_list_t& dl, face_t& face);
+	void destroy_segments();
+	void find_near_clusters(int index, const bsphere_t& sphere, ubyte* clusters);
+	void prefetch_visible(const vec3_t& eye);
 	
 	bool check_vis(int from_cluster, int to_cluster) {
 		return (visdata[from_cluster * visvec_size + (to_cluster >> 3)] >> (to_cluster & 0x7)) & 0x1;
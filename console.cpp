@@ -318,7 +318,7 @@ console_t::get_line(int line)
 }
 
 void
-console_t::tesselate(display_list_t& dl) 
+console_t::tesselate(ui_display_list_t& dl) 
 	// Add all the faces nescessary to render the console to the display list
 {
 	// Update position if nescessary
@@ -333,7 +333,7 @@ console_t::tesselate(display_list_t& dl)
 	}
 	if (visibility != 0.0f) {
 		// Add the background
-		face_t* face = dl.get_face(shader, 0, 4, 6);
+		ui_face_t* face = dl.get_face(shader, 0, 4, 6);
 		if (face == 0) {
 			console.print("Unable to allocate face for console background\n");
 			return;
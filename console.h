@@ -16,7 +16,7 @@
 #define DEBUG_CONSOLE
 #endif
 
-class display_list_t;
+#include "displaylist.h"
 
 // Always ensure that CONSOLE_BUFFER_SIZE > CONSOLE_LINES
 // Always ensure that CONSOLE_BUFFER_SIZE > CONSOLE_MAX_LINE_LENGTH
@@ -67,7 +67,7 @@ public:
 	bool is_showing() const { return showing; }
 
 	void set_shader(hshader_t s) { shader = s; }
-	void tesselate(display_list_t& dl);
+	void tesselate(ui_display_list_t& dl);
 
 	static console_t& get_instance();
 
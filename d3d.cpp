@@ -16,9 +16,13 @@
 #include "util.h"
 #include "timer.h"
 #include "ui.h"
+#include "wave.h"
 #include <memory>
 #include "win.h"
 #include "exec.h"
+#include "texload.h"
+#include "jobs.h"
+#include "simd.h"
 #include "mem.h"
 #include <d3dx8.h>
 
@@ -36,8 +40,43 @@ shaders_callback(int argc, cvstr_t* args)
 
 cfunc_t cf_shaders("shaders", shaders_callback);
 
+cvstr_t
+texbench_callback(int argc, cvstr_t* args)
+	// Time decoding every defined texture, usage: texbench
+{
+	d3d_t::get_instance().benchmark_textures();
+	return cvstr_t();
+}
+
+cfunc_t cf_texbench("texbench", texbench_callback);
+
+cvstr_t
+texstats_callback(int argc, cvstr_t* args)
+	// Show texture memory use and evictions, usage: texstats
+{
+	d3d_t::get_instance().print_texture_stats();
+	return cvstr_t();
+}
+
+cfunc_t cf_texstats("texstats", texstats_callback);
+
 // General Purpose cvars
 cvar_int_t showtris("showtris", 0, CVF_NONE, 0, 2);
+cvar_int_t filter_states("filter_states", 1, CVF_NONE, 0, 1);
+	// 0 = send every render state change to the device
+	// 1 = drop changes that leave a state as it was
+cvar_int_t merge_draws("merge_draws", 1, CVF_NONE, 0, 1);
+	// 0 = draw each face of a display list by itself
+	// 1 = draw neighbouring faces with the same shader and buffers together
+cvar_int_t texture_budget("texture_budget", 96, CVF_NONE, 0, 1024);
+	// 0 = keep every texture loaded until the map changes
+	// n = evict the least recently used textures to stay under n megabytes,
+	//     at most 1024 so the budget in bytes fits in an int
+cvar_int_t prefetch_uploads("prefetch_uploads", 4, CVF_NONE, 1, 64);
+	// Most prefetched textures copied into the device each frame
+cvar_int_t collapse_passes("collapse_passes", 1, CVF_NONE, 0, 1);
+	// 0 = draw every shader pass separately
+	// 1 = draw a pass blended onto an opaque pass with texture stage 1
 cvar_int_t display_width("display_width", 640, CVF_CONST);
 cvar_int_t display_height("display_height", 480, CVF_CONST);
 cvar_int_t display_color_depth("display_color_depth", 32, CVF_CONST);
@@ -55,8 +94,10 @@ cvar_int_t d3d_device("d3d_device", 0, CVF_CONST, 0, 1);
 // some nasty behaviour
 cvar_int_t max_shaders("max_shaders", 4096, CVF_CONST);
 cvar_int_t max_shader_passes("max_shader_passes", 4096, CVF_CONST);
-cvar_int_t max_static_verts("max_static_verts", 60000, CVF_CONST);
-cvar_int_t max_static_inds("max_static_inds", 120000, CVF_CONST);
+cvar_int_t max_shader_deforms("max_shader_deforms", 256, CVF_CONST);
+cvar_int_t max_shader_waves("max_shader_waves", 2048, CVF_CONST);
+cvar_int_t max_static_verts("max_static_verts", 60000, CVF_CONST);	// Initial size only, the static
+cvar_int_t max_static_inds("max_static_inds", 120000, CVF_CONST);	// buffers grow to fit each map
 cvar_int_t max_dynamic_verts("max_dynamic_verts", 20000, CVF_CONST);
 cvar_int_t max_dynamic_inds("max_dynamic_inds", 20000, CVF_CONST);
 
@@ -68,6 +109,20 @@ const uint SF_NOMIPMAPS	= 0x08;	// No mipmaps for this shader
 const uint SF_NOPICMIP	= 0x10;	// Never picmip this shader
 const uint SF_CULLFRONT	= 0x20;	// Cull front faces
 const uint SF_CULLBACK	= 0x40;	// Cull back faces (default)
+const uint SF_DEFORM	= 0x80;	// Vertices are deformed on the CPU
+const uint SF_TCGEN		= 0x100;// A pass generates texture co-ords on the CPU
+const uint SF_LOADING	= 0x200;// Texture has been requested from the texture loader
+const uint SF_EVICTED	= 0x400;// Texture was released to keep under texture_budget
+const uint SF_PREFETCH	= 0x800;// Texture is on the prefetch list
+
+// Sort orders
+const int SORT_PORTAL		= 1;
+const int SORT_SKY			= 2;
+const int SORT_OPAQUE		= 3;
+const int SORT_BANNER		= 6;
+const int SORT_UNDERWATER	= 8;
+const int SORT_ADDITIVE		= 9;
+const int SORT_NEAREST		= 16;
 
 namespace {
 	// Most textures for an anim map
@@ -75,22 +130,6 @@ namespace {
 	// Most texture coordinate mods for a pass
 	const int MAX_PASS_TCMODS = 3;
 
-	const DWORD FIXED_VERTEX_FORMAT = D3DFVF_XYZ
-									| D3DFVF_DIFFUSE
-									| D3DFVF_NORMAL
-									| D3DFVF_TEX2
-									| D3DFVF_TEXCOORDSIZE2(0)
-									| D3DFVF_TEXCOORDSIZE2(1);
-
-	// Sort orders
-	const int SORT_PORTAL		= 1;
-	const int SORT_SKY			= 2;
-	const int SORT_OPAQUE		= 3;
-	const int SORT_BANNER		= 6;
-	const int SORT_UNDERWATER	= 8;
-	const int SORT_ADDITIVE		= 9;
-	const int SORT_NEAREST		= 16;
-
 	// 0 = null shader, just use 0, no define
 	const htexture_t HT_NOSHADER = 1;	// Texture handle to refer to the whiteimage
 	const htexture_t HT_WHITEIMAGE = 2;	// Texture handle to refer to the whiteimage
@@ -120,9 +159,11 @@ namespace {
 	const int PF_ALPHABLEND	= 0x01;	// Alpha blending enabled
 	const int PF_ALPHATEST	= 0x02;	// Pass requires that alpha test be enabled
 	const int PF_CLAMP		= 0x04;	// Clamp texture co-ords for this pass
-	const int PF_ENVIRONMENT= 0x08;	// Environment map
+	const int PF_TCGEN		= 0x08;	// Texture co-ords generated on the CPU
 	const int PF_NOZWRITE	= 0x10;	// Z write should be disabled for this pass
 	const int PF_USETC1		= 0x20;	// Use the lightmap texture co-ords
+	const int PF_MULTITEXTURE=0x40;	// Next pass is drawn by texture stage 1
+	const int PF_STAGE1TC1	= 0x80;	// Stage 1 uses the lightmap texture co-ords
 
 	inline bool
 	shader_name_cmp(const char* name1, const char* name2)
@@ -158,64 +199,91 @@ namespace {
 		}
 		return false;
 	}
-}
 
-enum wave_type_t {
-	WAVE_INVERSESAWTOOTH,
-	WAVE_NOISE,
-	WAVE_SAWTOOTH,
-	WAVE_SIN,
-	WAVE_SQUARE,
-	WAVE_TRIANGLE,
-};
+	inline uint
+	shader_name_hash(const char* name)
+		// Hash a shader name so that names shader_name_cmp finds equal hash
+		// the same
+	{
+		return u_image_name_hash(name, u_strlen(name));
+	}
 
-struct wavefunc_t {
-	wave_type_t	type;
-	float		base;
-	float		amplitude;
-	float		phase;
-	float		frequency;
-
-	float clamp_value(float time) const {
-		float pos = time * frequency + phase;
-		switch (type) {
-		case WAVE_INVERSESAWTOOTH:
-			return m_clamp(base + amplitude * m_inversesawtooth_wave(pos));
-		case WAVE_SAWTOOTH:
-			return m_clamp(base + amplitude * m_sawtooth_wave(pos));
-		case WAVE_SIN:
-			return m_clamp(base + amplitude * m_sin_wave(pos));
-		case WAVE_SQUARE:
-			return m_clamp(base + amplitude * m_square_wave(pos));
-		case WAVE_TRIANGLE:
-			return m_clamp(base + amplitude * m_triangle_wave(pos));
+	void
+	read_wavefunc(const token_t* t, wavefunc_t& wave)
+		// Read an SE_WAVEFUNC starting at t
+	{
+		switch (t[0].type) {
+		case SK_INVERSESAWTOOTH:
+			wave.type = WAVE_INVERSESAWTOOTH;
+			break;
+		case SK_NOISE:
+			wave.type = WAVE_NOISE;
+			break;
+		case SK_SAWTOOTH:
+			wave.type = WAVE_SAWTOOTH;
+			break;
+		case SK_SIN:
+			wave.type = WAVE_SIN;
+			break;
+		case SK_SQUARE:
+			wave.type = WAVE_SQUARE;
+			break;
+		case SK_TRIANGLE:
+			wave.type = WAVE_TRIANGLE;
 		}
-		return 0.5f;	// keep the compiler happy
-	}
-
-	float value(float time) const {
-		float pos = time * frequency + phase;
-		switch (type) {
-		case WAVE_INVERSESAWTOOTH:
-			return base + amplitude * m_inversesawtooth_wave(pos);
-		case WAVE_SAWTOOTH:
-			return base + amplitude * m_sawtooth_wave(pos);
-		case WAVE_SIN:
-			return base + amplitude * m_sin_wave(pos);
-		case WAVE_SQUARE:
-			return base + amplitude * m_square_wave(pos);
-		case WAVE_TRIANGLE:
-			return base + amplitude * m_triangle_wave(pos);
+		wave.base		= t[1].float_value;
+		wave.amplitude	= t[2].float_value;
+		wave.phase		= t[3].float_value;
+		wave.frequency	= t[4].float_value;
+	}
+
+	deform_t
+	read_deform(const token_t* t)
+		// Read an SE_DEFORMVERTEXES, t is the deformvertexes keyword
+	{
+		deform_t deform;
+		u_zeromem(&deform, sizeof(deform));
+		switch (t[1].type) {
+		case SK_AUTOSPRITE:
+			deform.type = DEFORM_AUTOSPRITE;
+			break;
+		case SK_AUTOSPRITE2:
+			deform.type = DEFORM_AUTOSPRITE2;
+			break;
+		case SK_BULGE:		// SL_FLOAT, SL_FLOAT, SL_FLOAT
+			deform.type = DEFORM_BULGE;
+			deform.width = t[2].float_value;
+			deform.height = t[3].float_value;
+			deform.speed = t[4].float_value;
+			break;
+		case SK_MOVE:		// SL_FLOAT, SL_FLOAT, SL_FLOAT, SE_WAVEFUNC
+			deform.type = DEFORM_MOVE;
+			// Swap to the same axes the bsp vertices are converted to
+			deform.move = vec3_t(t[2].float_value, t[4].float_value, -t[3].float_value);
+			read_wavefunc(t + 5, deform.wave);
+			break;
+		case SK_NORMAL:		// SL_FLOAT, SL_FLOAT
+			deform.type = DEFORM_NORMAL;
+			deform.wave.amplitude = t[2].float_value;
+			deform.wave.frequency = t[3].float_value;
+			break;
+		case SK_WAVE:		// SL_FLOAT, SE_WAVEFUNC
+			deform.type = DEFORM_WAVE;
+			// A spread of 0 is invalid, quake 3 uses 100 in its place
+			deform.spread = 1.0f / (t[2].float_value != 0.0f ? t[2].float_value : 100.0f);
+			read_wavefunc(t + 3, deform.wave);
+			break;
 		}
-		return 0.5f;	// keep the compiler happy
+		return deform;
 	}
-};
+}
 
 enum tcmod_type_t {
 	TCMOD_ROTATE,
 	TCMOD_SCALE,
 	TCMOD_SCROLL,
 	TCMOD_STRETCH,
+	TCMOD_TURB,
 };
 
 enum rgbgen_type_t {
@@ -239,8 +307,9 @@ struct tcmod_t {
 			float	x;		// used for scale and scroll
 			float	y;		// used for scale and scroll
 		};
-		wavefunc_t	wave;	// used for stretch
+		wavefunc_t	wave;	// used for stretch and turb
 	};
+	int	value;			// stretch, index of the wave's value in d3d_t::wave_values
 };
 
 enum shader_type_t {
@@ -249,13 +318,26 @@ enum shader_type_t {
 };
 
 struct d3d_t::shader_t {
+	shader_t() : texture_size(0), last_used(0) {}
+
 	int			type;			// Shader type
 	str_t<64>	name;			// Shader name
 	int			flags;			// Shader flags
 	int			sort;			// Sort order
 	com_ptr_t<IDirect3DTexture8> texture;	// D3D texture, STYPE_TEXTURE only
 											// not in union to ensure destructor
+	pak_location_t	location;	// Image file, STYPE_TEXTURE only
+	int			texture_size;	// Bytes used by texture, 0 if it isn't loaded
+	int			last_used;		// frame_number texture was last set
 	int	num_passes;		// Number of passes for STYPE_SHADER
+	int	num_deforms;	// Number of vertex deforms
+	int	deforms[MAX_SHADER_DEFORMS];	// Indices into d3d_t::deforms
+	int	deform_values[MAX_SHADER_DEFORMS];	// move, index into d3d_t::wave_values
+	int	first_wave;		// This shader's waves in d3d_t::waves, STYPE_SHADER only
+	int	num_waves;
+	int	wave_frame;		// frame_number the waves were last evaluated
+	int	collapsed_pass;	// First of the passes drawn when collapse_passes is set
+	int	num_collapsed_passes;
 	union {
 		int	first_pass;		// First pass for STYPE_SHADER
 		hshader_t	texture;		// Texture index for STYPE_TEXTURE
@@ -268,6 +350,8 @@ struct d3d_t::shader_pass_t {
 	wavefunc_t		alphagen_wave;
 	rgbgen_type_t	rgbgen;
 	wavefunc_t		rgbgen_wave;
+	int				alphagen_value;	// Index into d3d_t::wave_values for the waves
+	int				rgbgen_value;
 	int				flags;
 	D3DCMPFUNC		alpha_func;
 	uint			alpha_ref;
@@ -279,25 +363,239 @@ struct d3d_t::shader_pass_t {
 	htexture_t		maps[MAX_PASS_MAPS];
 	int				num_tcmods;
 	tcmod_t			tcmods[MAX_PASS_TCMODS];
+	tcgen_type_t	tcgen;
+	vec3_t			tcgen_s;		// tcgen vector
+	vec3_t			tcgen_t;		// tcgen vector
+	D3DTEXTUREOP	stage1_op;		// PF_MULTITEXTURE, combines the passes
+	htexture_t		stage1_map;		// PF_MULTITEXTURE, map of the collapsed pass
 
-	htexture_t	map() const
+	htexture_t	map(float time) const
 	{ 
 		if (num_maps == 0)
 			return 0;
 		else if (num_maps == 1)
 			return maps[0];
 		else
-			return maps[m_ftoi(timer.time(TID_APP) * anim_freq) % num_maps];
+			return maps[m_ftoi(time * anim_freq) % num_maps];
 	}
 };
 
+struct d3d_t::pass_frame_t {
+	// The time dependent parameters of a pass for the current frame
+	int			frame;			// Frame these were worked out for
+	color_t		modulate;		// Texture factor from rgbgen and alphagen
+	matrix_t	tcmod;			// Texture matrix from the tcmods
+	tcgen_t		tcgen;			// Texture co-ord generation, PF_TCGEN only
+	htexture_t	map;			// Current animation frame
+};
+
+namespace {
+	matrix_t
+	tcmod_matrix(const tcmod_t& tcmod, float time, const float* values)
+		// Texture matrix for one of the affine tcmods, values holds the
+		// evaluated waves of the shader
+	{
+		matrix_t temp(matrix_t::identity);
+		float magnitude;
+		matrix_t m1(matrix_t::identity), m2(matrix_t::identity), m3(matrix_t::identity);
+		switch (tcmod.type) {
+		case TCMOD_ROTATE:
+			// translate(-0.5, -0.5) * rotate(angle) * translate(0.5, 0.5)
+			temp._00 = m_cos(m_deg2rad(tcmod.angle * time));
+			temp._01 = m_sin(m_deg2rad(tcmod.angle * time));
+			temp._10 = -temp._01;
+			temp._11 = temp._00;
+			temp._20 = 0.5f * (temp._01 - temp._00 + 1.0f);
+			temp._21 = 0.5f * (temp._10 - temp._00 + 1.0f);
+			break;
+		case TCMOD_SCALE:
+			temp._00 = tcmod.x;
+			temp._11 = tcmod.y;
+			break;
+		case TCMOD_SCROLL:
+			temp._20 = tcmod.x * time;
+			temp._21 = tcmod.y * time;
+			break;
+		case TCMOD_STRETCH:
+			magnitude = values[tcmod.value];
+			m1._20 = -0.5;
+			m1._21 = -0.5;
+			m2._00 = magnitude;
+			m2._11 = magnitude;
+			m3._20 = 0.5;
+			m3._21 = 0.5;
+			temp = m1 * m2 * m3;
+			break;
+		}
+		return temp;
+	}
+
+	void
+	add_affine_step(tcgen_t& tcgen, const matrix_t& mat)
+	{
+		tcgen_step_t& step = tcgen.steps[tcgen.num_steps++];
+		step.turb = false;
+		step.m00 = mat._00;
+		step.m01 = mat._01;
+		step.m10 = mat._10;
+		step.m11 = mat._11;
+		step.m20 = mat._20;
+		step.m21 = mat._21;
+	}
+
+	bool
+	collapse_pass(d3d_t::shader_pass_t& first, const d3d_t::shader_pass_t& second)
+		// Fold second into first as texture stage 1 if one pass would give the
+		// same result as drawing both, returns false if it wouldn't
+	{
+		if (first.flags & (PF_ALPHABLEND | PF_MULTITEXTURE))
+			return false;
+
+		// The second pass can only blend a single texture
+		if (!(second.flags & PF_ALPHABLEND) || (second.flags & ~(PF_ALPHABLEND | PF_NOZWRITE | PF_USETC1)))
+			return false;
+		if (second.num_maps != 1 || second.num_tcmods != 0 ||
+			second.rgbgen != RGBGEN_IDENTITY || second.alphagen != ALPHAGEN_IDENTITY)
+			return false;
+
+		// Generated co-ords are written over tc0
+		if ((first.flags & PF_TCGEN) && !(second.flags & PF_USETC1))
+			return false;
+
+		D3DTEXTUREOP op;
+		if ((second.src_blend == D3DBLEND_DESTCOLOR && second.dest_blend == D3DBLEND_ZERO) ||
+			(second.src_blend == D3DBLEND_ZERO && second.dest_blend == D3DBLEND_SRCCOLOR))
+			op = D3DTOP_MODULATE;
+		else if (second.src_blend == D3DBLEND_ONE && second.dest_blend == D3DBLEND_ONE)
+			op = D3DTOP_ADD;
+		else
+			return false;
+
+		// The second pass must draw exactly the pixels the first one did
+		bool same_pixels;
+		if (second.depth_func == D3DCMP_EQUAL)
+			same_pixels = !(first.flags & PF_NOZWRITE);
+		else
+			same_pixels = second.depth_func == first.depth_func && !(first.flags & PF_ALPHATEST);
+		if (!same_pixels)
+			return false;
+
+		first.flags |= PF_MULTITEXTURE;
+		if (second.flags & PF_USETC1)
+			first.flags |= PF_STAGE1TC1;
+		first.stage1_op = op;
+		first.stage1_map = second.maps[0];
+		return true;
+	}
+}
+
+class d3d_backend_t : public render_backend_t {
+	// Passes the render commands straight on to the device
+public:
+	d3d_backend_t(d3d_t& o) : owner(o) {}
+
+	void set_render_state(uint state, uint value)
+	{
+		owner.d3ddev->SetRenderState(static_cast<D3DRENDERSTATETYPE>(state), value);
+	}
+
+	void set_stage_state(uint stage, uint state, uint value)
+	{
+		owner.d3ddev->SetTextureStageState(stage, static_cast<D3DTEXTURESTAGESTATETYPE>(state), value);
+	}
+
+	void set_texture(uint stage, htexture_t texture)
+	{
+		owner.d3ddev->SetTexture(stage, owner.shaders[texture].texture);
+	}
+
+	void set_transform(uint transform, const matrix_t& mat)
+	{
+		owner.d3ddev->SetTransform(static_cast<D3DTRANSFORMSTATETYPE>(transform), reinterpret_cast<const D3DMATRIX*>(&mat));
+	}
+
+	void set_vertex_format(uint fvf)
+	{
+		owner.d3ddev->SetVertexShader(fvf);
+	}
+
+	int upload_verts(const void* verts, int count, int stride)
+	{
+		return owner.upload_dynamic_verts(verts, count, stride);
+	}
+
+	int upload_inds(const index_t* inds, int count)
+	{
+		return owner.upload_dynamic_inds(inds, count);
+	}
+
+	void draw(render_buffer_t vb, render_buffer_t ib, int stride, int base_vertex,
+		int min_index, int num_verts, int base_index, int num_tris)
+	{
+		owner.d3ddev->SetStreamSource(0, vb == RB_DYNAMIC ? owner.vbuf : owner.svbuf, stride);
+		owner.d3ddev->SetIndices(ib == RB_DYNAMIC ? owner.ibuf : owner.sibuf, base_vertex);
+		HRESULT hr = owner.d3ddev->DrawIndexedPrimitive(D3DPT_TRIANGLELIST, min_index, num_verts, base_index, num_tris);
+		u_assert(SUCCEEDED(hr));
+	}
+
+private:
+	d3d_t& owner;
+};
+
 d3d_t::d3d_t() : 
 	num_shaders(0),
 	num_passes(0),
 	shaders(0),
 	passes(0),
+	shader_sorts(0),
+	shader_hash_size(0),
+	shader_hash(0),
+	shader_hash_next(0),
+	prefetch_list(0),
+	eviction_keys(0),
+	num_prefetch(0),
+	next_prefetch(0),
 	num_static_verts(0),
-	num_static_inds(0)
+	num_static_inds(0),
+	static_vert_capacity(0),
+	static_ind_capacity(0),
+	static_index_size(0),
+	vertex_stride(sizeof(vertex_t)),
+	pass_frames(0),
+	num_deforms(0),
+	deforms(0),
+	deform_frames(0),
+	num_waves(0),
+	waves(0),
+	wave_values(0),
+	tcgen_verts(0),
+	pass_tcgen(0),
+	frame_number(0),
+	frame_time(0.0f),
+	animating(false),
+	resident_bytes(0),
+	num_evictions(0),
+	num_reloads(0),
+	num_demand_loads(0),
+	dynamic_verts(0),
+	dynamic_inds(0),
+	dynamic_bytes(0),
+	dynamic_count(0),
+	dynamic_bases(0),
+	dynamic_faces(0),
+	batch_vertex(0),
+	batch_index(0),
+	vertex_wraps(0),
+	index_wraps(0),
+	merge_faces(0),
+	merge_buffer(RB_DYNAMIC),
+	merge_base_vertex(0),
+	merge_min_index(0),
+	merge_max_index(0),
+	merge_base_index(0),
+	merge_num_inds(0),
+	backend(&state_filter),
+	device_backend(0)
 { 
 	u_zeromem(&d3dpp, sizeof(d3dpp)); 
 }
@@ -323,6 +621,30 @@ d3d_t::init()
 {
 	shaders = new shader_t[*max_shaders];
 	passes = new shader_pass_t[*max_shader_passes];
+	pass_frames = new pass_frame_t[*max_shader_passes];
+	for (int i = 0; i < *max_shader_passes; ++i)
+		pass_frames[i].frame = -1;
+	deforms = new deform_t[*max_shader_deforms];
+	deform_frames = new deform_frame_t[*max_shader_deforms];
+	for (int d = 0; d < *max_shader_deforms; ++d)
+		deform_frames[d].frame = -1;
+	waves = new wavefunc_t[*max_shader_waves];
+	wave_values = new float[*max_shader_waves];
+	tcgen_verts = new vertex_t[*max_dynamic_verts];
+	dynamic_verts = new ubyte[*max_dynamic_verts * sizeof(vertex_t)];
+	dynamic_inds = new index_t[*max_dynamic_inds];
+	shader_sorts = new ubyte[*max_shaders];
+	u_memset(shader_sorts, SORT_OPAQUE, *max_shaders);
+	for (shader_hash_size = 1; shader_hash_size < *max_shaders; shader_hash_size <<= 1)
+		;
+	shader_hash = new int[shader_hash_size];
+	for (int b = 0; b < shader_hash_size; ++b)
+		shader_hash[b] = -1;
+	shader_hash_next = new int[*max_shaders];
+	prefetch_list = new htexture_t[*max_shaders];
+	eviction_keys = new uint64[*max_shaders];
+	num_prefetch = 0;
+	next_prefetch = 0;
 
 	// Declare some programatically generated shaders
 
@@ -331,24 +653,30 @@ d3d_t::init()
 	shaders[0].name = "<null>";
 	shaders[0].type = STYPE_TEXTURE;
 	shaders[0].flags = SF_RETAIN;
+	shaders[0].num_deforms = 0;
 	
 
 	// Specific noshader shader
 	shaders[1].name = "noshader";
 	shaders[1].type = STYPE_TEXTURE;
 	shaders[1].flags = SF_RETAIN;
+	shaders[1].num_deforms = 0;
 
 	// A plain white texture, generated in create
 	shaders[2].name = "$whiteimage";
 	shaders[2].type = STYPE_TEXTURE;
 	shaders[2].flags = SF_RETAIN;
+	shaders[2].num_deforms = 0;
 
 	// Shader handle set asside for lightmap textures
 	shaders[3].name = "$lightmap";
 	shaders[3].type = STYPE_TEXTURE;
 	shaders[3].flags = SF_RETAIN;
+	shaders[3].num_deforms = 0;
 
 	num_shaders = NUM_RESERVED_SHADERS;
+	for (int r = 0; r < NUM_RESERVED_SHADERS; ++r)
+		hash_shader(r);
 
 	return info.create();
 }
@@ -380,6 +708,25 @@ d3d_t::create()
 	if (FAILED(hr))
 		return "IDirect3D8->CreateDevice() failed";
 
+	// Textures are compressed by the loader only if both dxt formats can be used
+	bool dxt = true;
+	for (int f = 0; f < 2; ++f) {
+		hr = info->CheckDeviceFormat(
+			back_buffer_format->format->device->adapter->ordinal,
+			back_buffer_format->format->device->type,
+			back_buffer_format->format->format,
+			0,
+			D3DRTYPE_TEXTURE,
+			f == 0 ? D3DFMT_DXT1 : D3DFMT_DXT5
+		);
+		dxt = dxt && SUCCEEDED(hr);
+	}
+	texloader.set_compression(dxt);
+
+	// Render commands go to the device unless set_backend says otherwise
+	device_backend = new d3d_backend_t(*this);
+	state_filter.set_target(device_backend);
+
 	// Create the dynamic usage index buffer
 	hr = d3ddev->CreateIndexBuffer(
 		*max_dynamic_inds * sizeof(index_t),
@@ -391,38 +738,22 @@ d3d_t::create()
 	if (FAILED(hr))
 		return "IDirect3D8->CreateIndexBuffer() failed for dynamic index buffer";
 
-	// Create the dynamic usage vertex buffer
+	// Create the dynamic usage vertex buffer, every vertex layout shares it
+	// so it has no fixed format and is sized in world vertices
 	hr = d3ddev->CreateVertexBuffer(
 		*max_dynamic_verts * sizeof(vertex_t),
 		D3DUSAGE_DYNAMIC | D3DUSAGE_WRITEONLY,
-		FIXED_VERTEX_FORMAT,
+		0,
 		D3DPOOL_DEFAULT,
 		&vbuf
 	);
 	if (FAILED(hr))
 		return "IDirect3D8->CreateVertexBuffer() failed for dynamic vertex buffer";
 
-	// Create the static usage index buffer
-	d3ddev->CreateIndexBuffer(
-		*max_static_inds * sizeof(index_t),
-		D3DUSAGE_WRITEONLY,
-		D3DFMT_INDEX16,
-		D3DPOOL_DEFAULT,
-		&sibuf
-	);
-	if (FAILED(hr))
-		return "IDirect3D8->CreateIndexBuffer() failed for static index buffer";
-
-	// Create the static usage vertex buffer
-	d3ddev->CreateVertexBuffer(
-		*max_static_verts * sizeof(vertex_t),
-		D3DUSAGE_WRITEONLY,
-		FIXED_VERTEX_FORMAT,
-		D3DPOOL_DEFAULT,
-		&svbuf
-	);
-	if (FAILED(hr))
-		return "IDirect3D8->CreateVertexBuffer() failed for static vertex buffer";
+	// Create the static buffers, these are recreated by reserve_static if a
+	// map needs them larger
+	if (!create_static_buffers(*max_static_verts, *max_static_inds, sizeof(ushort)))
+		return "IDirect3D8 failed to create the static vertex and index buffers";
 
 	// One time state changes
 //	d3ddev->SetRenderState(D3DRS_DITHERENABLE, TRUE);
@@ -456,7 +787,7 @@ d3d_t::create()
 	d3ddev->SetTextureStageState(1, D3DTSS_COLORARG2, D3DTA_CURRENT);
 
 	d3ddev->SetStreamSource(0, vbuf, sizeof(vertex_t));
-	d3ddev->SetVertexShader(FIXED_VERTEX_FORMAT);
+	set_vertex_format(vertex_format_t<vertex_t>::FVF, sizeof(vertex_t));
 
 	// Create $whiteimage here
 
@@ -526,17 +857,65 @@ d3d_t::destroy()
 	delete [] shaders;
 	num_shaders = 0;
 	shaders = 0;
+	resident_bytes = 0;
 
 	delete [] passes;
 	num_passes = 0;
 	passes = 0;
 
+	delete [] pass_frames;
+	pass_frames = 0;
+
+	delete [] deforms;
+	delete [] deform_frames;
+	num_deforms = 0;
+	deforms = 0;
+	deform_frames = 0;
+
+	delete [] waves;
+	delete [] wave_values;
+	num_waves = 0;
+	waves = 0;
+	wave_values = 0;
+
+	delete [] tcgen_verts;
+	tcgen_verts = 0;
+	pass_tcgen = 0;
+
+	delete [] dynamic_verts;
+	delete [] dynamic_inds;
+	delete [] dynamic_bases;
+	dynamic_verts = 0;
+	dynamic_inds = 0;
+	dynamic_bases = 0;
+	dynamic_faces = 0;
+
+	delete [] shader_sorts;
+	shader_sorts = 0;
+
+	delete [] shader_hash;
+	delete [] shader_hash_next;
+	shader_hash_size = 0;
+	shader_hash = 0;
+	shader_hash_next = 0;
+
+	delete [] prefetch_list;
+	prefetch_list = 0;
+	delete [] eviction_keys;
+	eviction_keys = 0;
+	num_prefetch = 0;
+	next_prefetch = 0;
+
 	if (d3ddev) {
 		d3ddev->SetIndices(NULL, 0);
 		d3ddev->SetStreamSource(0, NULL, 0);
 		d3ddev->SetTexture(0, NULL);
 		d3ddev->SetTexture(1, NULL);
 	}
+	state_filter.set_target(0);
+	delete device_backend;
+	device_backend = 0;
+
 	ibuf = 0;
 	sibuf = 0;
 	vbuf = 0;
@@ -568,12 +947,19 @@ d3d_t::begin()
 //	d3ddev->SetTransform(D3DTS_PROJECTION, NULL);
 	next_vertex = 0;
 	next_index = 0;
+	++frame_number;
+	frame_time = timer.time(TID_APP);
+	animating = false;
+	if (*texture_budget)
+		evict_textures(*texture_budget * 1024 * 1024);
+	state_filter.set_enabled(*filter_states != 0);
 	return SUCCEEDED(d3ddev->BeginScene());
 }
 
 void
 d3d_t::end()
 {
+	state_filter.flush();	// Leave the device in the state it was asked for
 	d3ddev->EndScene();
 	d3ddev->Present(NULL, NULL, NULL, NULL); 
 }
@@ -585,12 +971,27 @@ d3d_t::set_camera(const camera_t& camera)
 	// Set the camera to be used for upcoming rendering
 {
 
-	d3ddev->SetTransform(D3DTS_WORLD, reinterpret_cast<const D3DMATRIX*>(&camera.mat_world));
-	d3ddev->SetTransform(D3DTS_VIEW, reinterpret_cast<const D3DMATRIX*>(&camera.mat_view));
-	d3ddev->SetTransform(D3DTS_PROJECTION, reinterpret_cast<const D3DMATRIX*>(&camera.mat_proj));
+	backend->set_transform(D3DTS_WORLD, camera.mat_world);
+	backend->set_transform(D3DTS_VIEW, camera.mat_view);
+	backend->set_transform(D3DTS_PROJECTION, camera.mat_proj);
 
 	world_matrix = camera.mat_world;
 
+	// The columns of the world view rotation are the camera axes in world
+	// space, the camera looks down -z (see look_at_rh)
+	matrix_t world_view = camera.mat_world * camera.mat_view;
+	deform_view.right = normalize(vec3_t(world_view._00, world_view._10, world_view._20));
+	deform_view.up = normalize(vec3_t(world_view._01, world_view._11, world_view._21));
+	deform_view.forward = -normalize(vec3_t(world_view._02, world_view._12, world_view._22));
+
+	// The eye is at -translation * transpose(rotation)
+	const vec3_t translation(world_view._30, world_view._31, world_view._32);
+	deform_view.origin = -vec3_t(
+		dot(translation, vec3_t(world_view._00, world_view._01, world_view._02)),
+		dot(translation, vec3_t(world_view._10, world_view._11, world_view._12)),
+		dot(translation, vec3_t(world_view._20, world_view._21, world_view._22))
+	);
+
 //	matrix_t clip_mat = camera.mat_world * camera.mat_view * camera.mat_proj	;
 //	clip_mat.transpose();
 //	d3ddev->SetVertexShaderConstant(VSCONST_CLIP_MATRIX, &clip_mat, 4);
@@ -600,126 +1001,300 @@ d3d_t::set_camera(const camera_t& camera)
 }
 
 int
-compare_faces(const void* f1, const void* f2)
+d3d_t::deform_list(display_list_t& dl)
+	// Each distinct deform has its time dependent part worked out the first
+	// time it is used in a frame, then every face using it shares that
+{
+	int deformed = 0;
+	for (int i = 0; i < dl.num_faces(); ++i) {
+		face_t& face = dl.face(i);
+		const shader_t& shader = shaders[face.shader];
+		if (shader.num_deforms == 0 || face.verts == 0)
+			continue;
+		++deformed;
+		update_waves(face.shader);
+		for (int d = 0; d < shader.num_deforms; ++d) {
+			int deform = shader.deforms[d];
+			deform_frame_t& frame = deform_frames[deform];
+			if (frame.frame != frame_number) {
+				prepare_deform(deforms[deform], frame_time, frame);
+				if (shader.deform_values[d] >= 0)
+					frame.value = wave_values[shader.deform_values[d]];
+				frame.frame = frame_number;
+			}
+			apply_deform(deforms[deform], frame, deform_view, face.verts, face.num_verts, face.inds, face.num_inds);
+		}
+	}
+	return deformed;
+}
+
+void
+d3d_t::set_vertex_format(DWORD fvf, int stride)
+	// Select the vertex format for the faces about to be drawn
 {
-	const face_t* face1 = static_cast<const face_t*>(f1);
-	const face_t* face2 = static_cast<const face_t*>(f2);
+	backend->set_vertex_format(fvf);
+	vertex_stride = stride;
+}
 
-	const d3d_t& inst = d3d_t::get_instance();
+int
+d3d_t::num_shader_passes(hshader_t shader) const
+{
+	const shader_t& s = shaders[shader];
+	return s.type == STYPE_SHADER && *collapse_passes ? s.num_collapsed_passes : s.num_passes;
+}
 
-	// Sort by sort order, then shader, then lightmap
-	if (inst.shaders[face1->shader].sort != inst.shaders[face2->shader].sort)
-		return inst.shaders[face1->shader].sort - inst.shaders[face2->shader].sort;
-	else if (face1->shader != face2->shader)
-		return face1->shader - face2->shader;
-	else
-		return face1->lightmap - face2->lightmap;
+int
+d3d_t::draw_pass(hshader_t shader, int passno) const
+	// Index in passes of a pass numbered as num_shader_passes counts them
+{
+	const shader_t& s = shaders[shader];
+	return (*collapse_passes ? s.collapsed_pass : s.first_pass) + passno;
 }
 
-render_stats_t
-d3d_t::render_list(display_list_t& dl)
-	// Render the face in question
+bool
+d3d_t::set_pass_collapsing(bool enabled)
 {
-	qsort(dl.face_buffer(), dl.num_faces(), sizeof(face_t), compare_faces);
+	bool previous = *collapse_passes != 0;
+	*collapse_passes = enabled ? 1 : 0;
+	return previous;
+}
 
-	render_stats_t stats;
+void
+d3d_t::begin_dynamic(int count)
+	// Start collecting the dynamic geometry of a display list of count faces
+{
+	if (count > dynamic_faces) {
+		delete [] dynamic_bases;
+		dynamic_faces = u_max(count, dynamic_faces * 2);
+		dynamic_bases = new int[dynamic_faces * 2];
+	}
+	dynamic_bytes = 0;
+	dynamic_count = 0;
+}
 
-	const face_t* face;
-	for (const face_t* f = dl.face_buffer(); f != dl.face_buffer_end(); f = (face == f ? f + 1 : face)) {
-		face = f;
-		begin_shader(f->shader, f->lightmap);
-		for (int pass = 0; pass < shaders[f->shader].num_passes; ++pass) {
-			begin_pass(f->shader, f->lightmap, pass);
-			for (face = f; face->shader == f->shader && face->lightmap == f->lightmap && face != dl.face_buffer_end(); ++face) {
-				// Update render stats
-				stats += render_stats_t(1, face->num_verts, face->num_inds);
+void
+d3d_t::stage_face(int index, const face_base_t& face, const void* verts)
+	// Copy a face's vertices and indices into the batch. Faces that don't fit
+	// are left to draw_face to upload for each pass
+{
+	int* bases = dynamic_bases + index * 2;
+	bases[0] = -1;
+	bases[1] = -1;
+	if (verts) {
+		int size = face.num_verts * vertex_stride;
+		if (dynamic_bytes + size <= *max_dynamic_verts * static_cast<int>(sizeof(vertex_t))) {
+			u_memcpy(dynamic_verts + dynamic_bytes, verts, size);
+			bases[0] = dynamic_bytes / vertex_stride;
+			dynamic_bytes += size;
+		}
+	}
+	if (face.inds && dynamic_count + face.num_inds <= *max_dynamic_inds) {
+		index_t* inds = dynamic_inds + dynamic_count;
+		if (bases[0] < 0) {
+			u_memcpy(inds, face.inds, face.num_inds * sizeof(index_t));
+		} else if (bases[0] + face.num_verts <= 0x10000) {
+			// Indices of batched vertices count from the start of the batch,
+			// so faces next to each other in it can be drawn as one
+			for (int i = 0; i < face.num_inds; ++i)
+				inds[i] = static_cast<index_t>(face.inds[i] + bases[0]);
+		} else {
+			return;		// Past what 16 bit indices can reach
+		}
+		bases[1] = dynamic_count;
+		dynamic_count += face.num_inds;
+	}
+}
 
-				// Setup the vertex data
-				int base_vertex;
-				if (face->verts) {
-					base_vertex = upload_dynamic_verts(face->verts, face->num_verts);
-					d3ddev->SetStreamSource(0, vbuf, sizeof(vertex_t));
-				} else {
-					d3ddev->SetStreamSource(0, svbuf, sizeof(vertex_t));
-					base_vertex = face->base_vert;
-				}
+void
+d3d_t::end_dynamic()
+	// Upload the batch, one copy into each ring buffer
+{
+	if (dynamic_bytes)
+		batch_vertex = backend->upload_verts(dynamic_verts, dynamic_bytes / vertex_stride, vertex_stride);
+	if (dynamic_count)
+		batch_index = backend->upload_inds(dynamic_inds, dynamic_count);
+	// Anything uploaded after this that wraps the buffers loses the batch,
+	// draw_face then goes back to uploading each face itself
+	vertex_wraps = 0;
+	index_wraps = 0;
+}
 
-				// Setup the index data
-				int base_index;
-				if (face->inds) {
-					base_index = upload_dynamic_inds(face->inds, face->num_inds);
-					d3ddev->SetIndices(ibuf, base_vertex);
-				} else {
-					d3ddev->SetIndices(sibuf, base_vertex);
-					base_index = face->base_ind;
-				}
+void
+d3d_t::draw_face(int index, const face_base_t& face, const void* verts)
+	// Draw a single face with the current shader pass, verts are in the
+	// layout last passed to set_vertex_format. index is the face's number in
+	// the display list, for finding it in the batch
+{
+	const int* bases = dynamic_bases + index * 2;
+
+	// Setup the vertex data
+	render_buffer_t vb;
+	int stride;
+	int base_vertex;
+	if (verts) {
+		vb = RB_DYNAMIC;
+		stride = vertex_stride;
+		// Passes with PF_TCGEN draw a copy with the generated texture co-ords
+		if (pass_tcgen && vertex_stride == sizeof(vertex_t) && face.num_verts <= *max_dynamic_verts) {
+			generate_texcoords(*pass_tcgen, deform_view, static_cast<const vertex_t*>(verts), tcgen_verts, face.num_verts);
+			base_vertex = backend->upload_verts(tcgen_verts, face.num_verts, stride);
+		} else if (bases[0] >= 0 && vertex_wraps == 0) {
+			base_vertex = batch_vertex + bases[0];
+		} else {
+			base_vertex = backend->upload_verts(verts, face.num_verts, stride);
+		}
+	} else {
+		vb = RB_STATIC;
+		stride = sizeof(vertex_t);
+		base_vertex = face.base_vert;
+	}
 
-				// Now do the drawing
-				HRESULT hr = d3ddev->DrawIndexedPrimitive(D3DPT_TRIANGLELIST, 0, face->num_verts, base_index, face->num_inds / 3);
-				u_assert(SUCCEEDED(hr));
+	// Setup the index data, static indices are absolute so the face's
+	// vertices start at base_vertex rather than 0. Batched indices of batched
+	// vertices count from the start of the batch, so they can only be used
+	// if the vertices are still where the batch put them
+	render_buffer_t ib;
+	int base_index;
+	int min_index;
+	if (face.inds) {
+		ib = RB_DYNAMIC;
+		min_index = 0;
+		bool rebased = verts && bases[0] >= 0;
+		if (bases[1] >= 0 && index_wraps == 0 && (!rebased || base_vertex == batch_vertex + bases[0])) {
+			base_index = batch_index + bases[1];
+			if (rebased) {
+				min_index = bases[0];
+				base_vertex = batch_vertex;
 			}
-			end_pass(f->shader, f->lightmap, pass);
+		} else {
+			base_index = backend->upload_inds(face.inds, face.num_inds);
 		}
-		end_shader(f->shader, f->lightmap);
+	} else {
+		ib = RB_STATIC;
+		base_index = face.base_ind;
+		min_index = base_vertex;
+		base_vertex = 0;
 	}
 
-	if (*showtris)
-		show_tris(dl);
-
-	return stats;
+	// Now do the drawing
+	backend->draw(vb, ib, stride, base_vertex, min_index, face.num_verts, base_index, face.num_inds / 3);
 }
 
 void
-d3d_t::show_tris(display_list_t& dl)
-	// Render the face in question
-{
-	// Set up the render states for showtris
-	d3ddev->SetRenderState(D3DRS_ZENABLE, D3DZB_FALSE);
-	d3ddev->SetRenderState(D3DRS_FILLMODE, D3DFILL_WIREFRAME);
-	d3ddev->SetRenderState(D3DRS_CULLMODE, D3DCULL_NONE);
-	d3ddev->SetTextureStageState(0, D3DTSS_COLORARG1, D3DTA_TFACTOR);
-	if (*showtris == 1) {	// White lines
-		d3ddev->SetRenderState(D3DRS_TEXTUREFACTOR, color_t::white);
-	} else {	// Blend diffuse colour with white for lines
-		d3ddev->SetRenderState(D3DRS_TEXTUREFACTOR, 0x1fffffff);
-		d3ddev->SetTextureStageState(0, D3DTSS_COLORARG1, D3DTA_TFACTOR);
-		d3ddev->SetTextureStageState(0, D3DTSS_COLOROP, D3DTOP_BLENDFACTORALPHA);	// use diffuse color
+d3d_t::queue_face(int index, const face_base_t& face, const void* verts)
+	// Draw a face with the current shader pass, joining it to the faces
+	// before it where possible. Static faces join if their indices follow on
+	// in the static index buffer, batched dynamic faces if they follow on in
+	// the batch. Anything else is drawn by itself
+{
+	render_buffer_t buffer;
+	int base_vertex;
+	int min_index;
+	int base_index;
+	const int* bases = dynamic_bases + index * 2;
+	if (!*merge_draws) {
+		draw_face(index, face, verts);
+		return;
+	} else if (!verts && !face.inds) {
+		buffer = RB_STATIC;
+		base_vertex = 0;
+		min_index = face.base_vert;
+		base_index = face.base_ind;
+	} else if (verts && face.inds && bases[0] >= 0 && bases[1] >= 0 && vertex_wraps == 0 && index_wraps == 0 &&
+		!(pass_tcgen && vertex_stride == sizeof(vertex_t))) {
+		buffer = RB_DYNAMIC;
+		base_vertex = batch_vertex;
+		min_index = bases[0];
+		base_index = batch_index + bases[1];
+	} else {
+		flush_faces();
+		draw_face(index, face, verts);
+		return;
 	}
 
-	for (const face_t* face = dl.face_buffer(); face != dl.face_buffer_end(); ++face) {
-		// Setup the vertex data
-		int base_vertex;
-		if (face->verts) {
-			base_vertex = upload_dynamic_verts(face->verts, face->num_verts);
-			d3ddev->SetStreamSource(0, vbuf, sizeof(vertex_t));
-		} else {
-			d3ddev->SetStreamSource(0, svbuf, sizeof(vertex_t));
-			base_vertex = face->base_vert;
-		}
+	if (merge_faces && (buffer != merge_buffer || base_vertex != merge_base_vertex ||
+		base_index != merge_base_index + merge_num_inds))
+		flush_faces();
+
+	if (merge_faces == 0) {
+		merge_buffer = buffer;
+		merge_base_vertex = base_vertex;
+		merge_min_index = min_index;
+		merge_max_index = min_index + face.num_verts;
+		merge_base_index = base_index;
+		merge_num_inds = 0;
+	} else {
+		merge_min_index = u_min(merge_min_index, min_index);
+		merge_max_index = u_max(merge_max_index, min_index + face.num_verts);
+	}
+	merge_num_inds += face.num_inds;
+	++merge_faces;
+}
 
-		// Setup the index data
-		int base_index;
-		if (face->inds) {
-			base_index = upload_dynamic_inds(face->inds, face->num_inds);
-			d3ddev->SetIndices(ibuf, base_vertex);
-		} else {
-			d3ddev->SetIndices(sibuf, base_vertex);
-			base_index = face->base_ind;
-		}
+void
+d3d_t::flush_faces()
+	// Draw the faces queued by queue_face
+{
+	if (merge_faces == 0)
+		return;
+	int stride = merge_buffer == RB_STATIC ? sizeof(vertex_t) : vertex_stride;
+	backend->draw(merge_buffer, merge_buffer, stride, merge_base_vertex, merge_min_index,
+		merge_max_index - merge_min_index, merge_base_index, merge_num_inds / 3);
+	merge_faces = 0;
+}
 
-		// Now do the drawing
-		HRESULT hr = d3ddev->DrawIndexedPrimitive(D3DPT_TRIANGLELIST, 0, face->num_verts, base_index, face->num_inds / 3);
-		u_assert(SUCCEEDED(hr));
+render_backend_t*
+d3d_t::set_backend(render_backend_t* b)
+	// Send the commands for drawing to b instead of the device, or back to the
+	// device if b is 0. Returns the previous backend. Commands still pass
+	// through the state filter first
+{
+	render_backend_t* previous = state_filter.get_target();
+	state_filter.flush();
+	state_filter.set_target(b ? b : device_backend);
+	return previous;
+}
+
+bool
+d3d_t::set_state_filtering(bool enabled)
+{
+	bool previous = state_filter.is_enabled();
+	state_filter.set_enabled(enabled);
+	return previous;
+}
+
+bool
+d3d_t::begin_show_tris()
+	// Set up the render states for showtris, returns false if showtris is off
+{
+	if (*showtris == 0)
+		return false;
+
+	backend->set_render_state(D3DRS_ZENABLE, D3DZB_FALSE);
+	backend->set_render_state(D3DRS_FILLMODE, D3DFILL_WIREFRAME);
+	backend->set_render_state(D3DRS_CULLMODE, D3DCULL_NONE);
+	backend->set_stage_state(0, D3DTSS_COLORARG1, D3DTA_TFACTOR);
+	if (*showtris == 1) {	// White lines
+		backend->set_render_state(D3DRS_TEXTUREFACTOR, color_t::white);
+	} else {	// Blend diffuse colour with white for lines
+		backend->set_render_state(D3DRS_TEXTUREFACTOR, 0x1fffffff);
+		backend->set_stage_state(0, D3DTSS_COLORARG1, D3DTA_TFACTOR);
+		backend->set_stage_state(0, D3DTSS_COLOROP, D3DTOP_BLENDFACTORALPHA);	// use diffuse color
 	}
+	return true;
+}
 
+void
+d3d_t::end_show_tris()
 	// Reset the render states to defaults
+{
 	if (*showtris == 2)
-		d3ddev->SetTextureStageState(0, D3DTSS_COLOROP, D3DTOP_SELECTARG1);
-	d3ddev->SetTextureStageState(0, D3DTSS_COLORARG1, D3DTA_TEXTURE);
-	d3ddev->SetRenderState(D3DRS_TEXTUREFACTOR, 0xffffffff);
-	d3ddev->SetRenderState(D3DRS_CULLMODE, D3DCULL_CCW);
-	d3ddev->SetRenderState(D3DRS_FILLMODE, D3DFILL_SOLID);
-	d3ddev->SetRenderState(D3DRS_ZENABLE, D3DZB_TRUE);
+		backend->set_stage_state(0, D3DTSS_COLOROP, D3DTOP_SELECTARG1);
+	backend->set_stage_state(0, D3DTSS_COLORARG1, D3DTA_TEXTURE);
+	backend->set_render_state(D3DRS_TEXTUREFACTOR, 0xffffffff);
+	backend->set_render_state(D3DRS_CULLMODE, D3DCULL_CCW);
+	backend->set_render_state(D3DRS_FILLMODE, D3DFILL_SOLID);
+	backend->set_render_state(D3DRS_ZENABLE, D3DZB_TRUE);
 }
 
 
@@ -745,37 +1320,16 @@ d3d_t::define_texture(const char* name, bool parsing)
 	shader.sort = SORT_OPAQUE;
 	shader.texture = 0;
 	shader.num_passes = 1;
+	shader.num_deforms = 0;
 	shader.first_pass = -1;
 
-	if (pak.file_exists(shader.name))
-		return num_shaders++;
-
-	int length = shader.name.length();
-
-	if (length < 4)
-		return 0;
-
-	// If name ends in ".tga" try with a ".jpg" extension and vice versa
-	if (u_fncmp(&shader.name[length - 4], ".tga") == 0) {
-		u_strcpy(&shader.name[length - 3], "jpg");
-		if (pak.file_exists(shader.name))
-			return num_shaders++;
-	} else if (u_fncmp(&shader.name[length - 4], ".jpg") == 0) {
-		u_strcpy(&shader.name[length - 3], "tga");
-		if (pak.file_exists(shader.name))
-			return num_shaders++;
-	} 
-
-	// That didnt work, try just adding the tga extension
-	shader.name += ".tga";
-	if (pak.file_exists(shader.name))
-		return num_shaders++;
-
-	// That didnt work, try just adding the jpg extension
-	shader.name[length] = '\0';
-	shader.name += ".jpg";
-	if (pak.file_exists(shaders[num_shaders].name))
+	// The name is resolved to the image that will be loaded, which may have
+	// the other extension or one that name didn't have
+	if (pak.find_texture(name, shader.location)) {
+		shader.name = pak.file_name(shader.location);
+		hash_shader(num_shaders);
 		return num_shaders++;
+	}
 
 	// No such shader, just fail it
 	if (!parsing || *verbose_shader_parsing)
@@ -789,31 +1343,81 @@ d3d_t::get_texture(const char* name)
 	// Return the texture handle of 0 if the texture has not yet been defined. This
 	// is an internal method and only returns ST_TEXTURE shader handles
 {
-	// Check the exact name
-	for (int i = 0; i < num_shaders; ++i)
-		if ((shaders[i].type == STYPE_TEXTURE) && shader_name_cmp(name, shaders[i].name))
+	return find_shader(name, STYPE_TEXTURE);
+}
+
+int
+d3d_t::find_shader(const char* name, int type) const
+	// Look up a shader or texture by name, 0 if there is none
+{
+	for (int i = shader_hash[shader_name_hash(name) & (shader_hash_size - 1)]; i != -1; i = shader_hash_next[i])
+		if (shaders[i].type == type && shader_name_cmp(name, shaders[i].name))
 			return i;
 	return 0;
 }
 
+void
+d3d_t::hash_shader(int shader)
+	// Add a shader to the front of its bucket in the name index
+{
+	int bucket = shader_name_hash(shaders[shader].name) & (shader_hash_size - 1);
+	shader_hash_next[shader] = shader_hash[bucket];
+	shader_hash[bucket] = shader;
+}
+
+void
+d3d_t::unhash_shaders(int first)
+	// Take shaders first onwards out of the name index before they are
+	// discarded. Newer shaders are always nearer the front of a bucket, so
+	// working backwards each one is either at the front or was never added
+{
+	for (int i = num_shaders - 1; i >= first; --i) {
+		int bucket = shader_name_hash(shaders[i].name) & (shader_hash_size - 1);
+		if (shader_hash[bucket] == i)
+			shader_hash[bucket] = shader_hash_next[i];
+	}
+}
+
 void
 d3d_t::ensure_loaded(htexture_t texture)
+	// Evicted textures go back through the texture loader the way they were
+	// first loaded and are drawn without their texture until load_prefetched
+	// collects them. Only a full queue makes a reload wait here
 {
-	if (texture >= NUM_RESERVED_SHADERS && shaders[texture].texture == 0)
-		load_texture(texture);
+	shader_t& shader = shaders[texture];
+	shader.last_used = frame_number;
+	if (texture < NUM_RESERVED_SHADERS || shader.texture)
+		return;
+	if (shader.flags & SF_EVICTED) {
+		if (shader.flags & SF_LOADING)
+			return;
+		++num_reloads;
+		if (texloader.request(texture, shader.location, !(shader.flags & SF_NOMIPMAPS))) {
+			shader.flags |= SF_LOADING;
+			return;
+		}
+	}
+	++num_demand_loads;
+	demand_load(texture);
+}
+
+void
+d3d_t::bind_texture(uint stage, htexture_t texture)
+	// Mark the texture used this frame and load it if it isn't resident.
+	// This happens here rather than in the backend as the state filter drops
+	// the set when the texture is still bound from an earlier frame
+{
+	ensure_loaded(texture);
+	backend->set_texture(stage, texture);
 }
 
 hshader_t 
 d3d_t::get_shader(const char* name, bool retain)
 	// Return the handle to the named shader
 {
-	hshader_t handle = 0;
-
 	// Search for a shader with that name
-	for (int i  = 0; i < num_shaders && handle == 0; ++i)
-		if (shaders[i].type == STYPE_SHADER && shader_name_cmp(name, shaders[i].name))
-			handle = i;
-	
+	hshader_t handle = find_shader(name, STYPE_SHADER);
+
 	// Define a texture with that name if no texture found
 	if (handle == 0)
 		handle = define_texture(name, false);
@@ -849,143 +1453,164 @@ d3d_t::begin_shader(hshader_t shader, htexture_t lightmap)
 //	console.printf("begin_shader %s %s\n", shaders[shader].name.c_str(), shaders[lightmap].name.c_str());
 
 	if (shaders[shader].flags & SF_CULLFRONT)
-		d3ddev->SetRenderState(D3DRS_CULLMODE, D3DCULL_CW);
+		backend->set_render_state(D3DRS_CULLMODE, D3DCULL_CW);
 	else if (!(shaders[shader].flags & SF_CULLBACK))
-		d3ddev->SetRenderState(D3DRS_CULLMODE, D3DCULL_NONE);
+		backend->set_render_state(D3DRS_CULLMODE, D3DCULL_NONE);
 }
 
-void
-d3d_t::begin_pass(hshader_t shader, htexture_t lightmap, int passno)
+const d3d_t::pass_frame_t&
+d3d_t::evaluate_pass(int passno)
+	// Work out the time dependent parameters of a pass, waves, tcmods and the
+	// animation frame. This is only done the first time a pass is used in a
+	// frame, so passes of shaders that aren't visible are never evaluated
 {
+	pass_frame_t& frame = pass_frames[passno];
+	if (frame.frame == frame_number)
+		return frame;
+	frame.frame = frame_number;
+
+	const shader_pass_t& pass = passes[passno];
+	const float time = frame_time;
+
+	if (pass.alphagen == ALPHAGEN_WAVE || pass.rgbgen == RGBGEN_WAVE || pass.num_maps > 1)
+		animating = true;
+	for (int t = 0; t < pass.num_tcmods; ++t)
+		if (pass.tcmods[t].type != TCMOD_SCALE)
+			animating = true;
+
 	color_t modulate(color_t::identity);
+	if (pass.alphagen == ALPHAGEN_WAVE)
+		modulate.set_a(wave_values[pass.alphagen_value]);
+	if (pass.rgbgen == RGBGEN_WAVE) {
+		modulate.set_r(wave_values[pass.rgbgen_value]);
+		modulate.g = modulate.r;
+		modulate.b = modulate.r;
+	}
+	if (pass.rgbgen == RGBGEN_IDENTITYLIGHTING) {
+		modulate.r = 128;
+		modulate.g = modulate.r;
+		modulate.b = modulate.r;
+	}
+	frame.modulate = modulate;
+
+	if (pass.flags & PF_TCGEN) {
+		// Consecutive affine tcmods are combined into a single step
+		tcgen_t& tcgen = frame.tcgen;
+		tcgen.type = pass.tcgen;
+		tcgen.s = pass.tcgen_s;
+		tcgen.t = pass.tcgen_t;
+		tcgen.num_steps = 0;
+		matrix_t mat(matrix_t::identity);
+		bool affine = false;
+		for (int i = 0; i < pass.num_tcmods; ++i) {
+			const tcmod_t& tcmod = pass.tcmods[i];
+			if (tcmod.type != TCMOD_TURB) {
+				mat *= tcmod_matrix(tcmod, time, wave_values);
+				affine = true;
+				continue;
+			}
+			if (affine) {
+				add_affine_step(tcgen, mat);
+				mat = matrix_t::identity;
+				affine = false;
+			}
+			tcgen_step_t& step = tcgen.steps[tcgen.num_steps++];
+			step.turb = true;
+			step.amplitude = tcmod.wave.amplitude;
+			step.phase = tcmod.wave.phase + time * tcmod.wave.frequency;
+		}
+		if (affine)
+			add_affine_step(tcgen, mat);
+	} else {
+		matrix_t mat(matrix_t::identity);
+		for (int i = 0; i < pass.num_tcmods; ++i)
+			mat *= tcmod_matrix(pass.tcmods[i], time, wave_values);
+		frame.tcmod = mat;
+	}
 
+	frame.map = pass.map(time);
+	return frame;
+}
+
+void
+d3d_t::begin_pass(hshader_t shader, htexture_t lightmap, int passno)
+{
 //	console.printf("    begin_pass %s %s %d\n", shaders[shader].name.c_str(), shaders[lightmap].name.c_str(), passno);
 
 	if (shaders[shader].type == STYPE_SHADER) {
-		const shader_pass_t& pass = passes[shaders[shader].first_pass + passno];
+		const shader_pass_t& pass = passes[draw_pass(shader, passno)];
 
 		if (pass.flags & PF_ALPHABLEND) {
-			d3ddev->SetRenderState(D3DRS_ALPHABLENDENABLE, TRUE);
-			d3ddev->SetRenderState(D3DRS_SRCBLEND, pass.src_blend);
-			d3ddev->SetRenderState(D3DRS_DESTBLEND, pass.dest_blend);
+			backend->set_render_state(D3DRS_ALPHABLENDENABLE, TRUE);
+			backend->set_render_state(D3DRS_SRCBLEND, pass.src_blend);
+			backend->set_render_state(D3DRS_DESTBLEND, pass.dest_blend);
 		}
 
 		if (pass.flags & PF_ALPHATEST) {
-			d3ddev->SetRenderState(D3DRS_ALPHAFUNC, pass.alpha_func);
-			d3ddev->SetRenderState(D3DRS_ALPHAREF, pass.alpha_ref);
-			d3ddev->SetRenderState(D3DRS_ALPHATESTENABLE, TRUE);
+			backend->set_render_state(D3DRS_ALPHAFUNC, pass.alpha_func);
+			backend->set_render_state(D3DRS_ALPHAREF, pass.alpha_ref);
+			backend->set_render_state(D3DRS_ALPHATESTENABLE, TRUE);
 		}
 
 		if (pass.flags & PF_CLAMP) {
-			d3ddev->SetTextureStageState(0, D3DTSS_ADDRESSU, D3DTADDRESS_CLAMP);
-			d3ddev->SetTextureStageState(0, D3DTSS_ADDRESSV, D3DTADDRESS_CLAMP);
+			backend->set_stage_state(0, D3DTSS_ADDRESSU, D3DTADDRESS_CLAMP);
+			backend->set_stage_state(0, D3DTSS_ADDRESSV, D3DTADDRESS_CLAMP);
 		}
 
 		if (pass.flags & PF_NOZWRITE)
-			d3ddev->SetRenderState(D3DRS_ZWRITEENABLE, FALSE);
+			backend->set_render_state(D3DRS_ZWRITEENABLE, FALSE);
 
 		if (pass.flags & PF_USETC1)
-			d3ddev->SetTextureStageState(0, D3DTSS_TEXCOORDINDEX, 1);
+			backend->set_stage_state(0, D3DTSS_TEXCOORDINDEX, 1);
 
 		if (pass.depth_func != D3DCMP_LESSEQUAL)
-			d3ddev->SetRenderState(D3DRS_ZFUNC, pass.depth_func);
+			backend->set_render_state(D3DRS_ZFUNC, pass.depth_func);
+
+		update_waves(shader);
+		const pass_frame_t& frame = evaluate_pass(draw_pass(shader, passno));
 
 		if (pass.alphagen != ALPHAGEN_IDENTITY) {
-			d3ddev->SetTextureStageState(0, D3DTSS_ALPHAOP, D3DTOP_MODULATE);
-			if (pass.alphagen == ALPHAGEN_WAVE) {
-				d3ddev->SetTextureStageState(0, D3DTSS_ALPHAARG2, D3DTA_TFACTOR);
-				modulate.set_a(pass.alphagen_wave.clamp_value(timer.time(TID_APP)));
-			}
+			backend->set_stage_state(0, D3DTSS_ALPHAOP, D3DTOP_MODULATE);
+			if (pass.alphagen == ALPHAGEN_WAVE)
+				backend->set_stage_state(0, D3DTSS_ALPHAARG2, D3DTA_TFACTOR);
 		}
 
 		if (pass.rgbgen != RGBGEN_IDENTITY) {
-			d3ddev->SetTextureStageState(0, D3DTSS_COLOROP, D3DTOP_MODULATE);
-			if (pass.rgbgen == RGBGEN_WAVE) {
-				d3ddev->SetTextureStageState(0, D3DTSS_COLORARG2, D3DTA_TFACTOR);
-				modulate.set_r(pass.rgbgen_wave.clamp_value(timer.time(TID_APP)));
-				modulate.g = modulate.r;
-				modulate.b = modulate.r;
-			}
-			if (pass.rgbgen == RGBGEN_IDENTITYLIGHTING) {
-				d3ddev->SetTextureStageState(0, D3DTSS_COLORARG2, D3DTA_TFACTOR);
-				modulate.r = 128;
-				modulate.g = modulate.r;
-				modulate.b = modulate.r;
-			}
+			backend->set_stage_state(0, D3DTSS_COLOROP, D3DTOP_MODULATE);
+			if (pass.rgbgen == RGBGEN_WAVE || pass.rgbgen == RGBGEN_IDENTITYLIGHTING)
+				backend->set_stage_state(0, D3DTSS_COLORARG2, D3DTA_TFACTOR);
 		}
 		
 		if (pass.rgbgen == RGBGEN_WAVE || pass.rgbgen == RGBGEN_IDENTITYLIGHTING || pass.alphagen == ALPHAGEN_WAVE)
-			d3ddev->SetRenderState(D3DRS_TEXTUREFACTOR, modulate);
-
-		matrix_t mat(matrix_t::identity);
-		if (pass.num_tcmods) {
-			for (int i = 0; i < pass.num_tcmods; ++i) {
-				matrix_t temp(matrix_t::identity);
-				float magnitude;
-				matrix_t m1(matrix_t::identity), m2(matrix_t::identity), m3(matrix_t::identity);
-				switch (pass.tcmods[i].type) {
-				case TCMOD_ROTATE:
-					// translate(-0.5, -0.5) * rotate(angle) * translate(0.5, 0.5)
-					temp._00 = m_cos(m_deg2rad(pass.tcmods[i].angle * timer.time(TID_APP)));
-					temp._01 = m_sin(m_deg2rad(pass.tcmods[i].angle * timer.time(TID_APP)));
-					temp._10 = -temp._01;
-					temp._11 = temp._00;
-					temp._20 = 0.5f * (temp._01 - temp._00 + 1.0f);
-					temp._21 = 0.5f * (temp._10 - temp._00 + 1.0f);
-					break;
-				case TCMOD_SCALE:
-					temp._00 = pass.tcmods[i].x;
-					temp._11 = pass.tcmods[i].y;
-//					temp._20 = (pass.tcmods[i].x + 1.0f) * -0.5f;
-//					temp._21 = (pass.tcmods[i].y + 1.0f) * -0.5f;
-					break;
-				case TCMOD_SCROLL:
-					temp._20 = pass.tcmods[i].x * timer.time(TID_APP);
-					temp._21 = pass.tcmods[i].y * timer.time(TID_APP);
-					break;
-				case TCMOD_STRETCH:
-					magnitude = pass.tcmods[i].wave.value(timer.time(TID_APP));
-					m1._20 = -0.5;
-					m1._21 = -0.5;
-					m2._00 = magnitude;
-					m2._11 = magnitude;
-					m3._20 = 0.5;
-					m3._21 = 0.5;
-					temp = m1 * m2 * m3;
-					break;
-				}
-				mat *= temp;
-			}
-			d3ddev->SetTransform(D3DTS_TEXTURE0, reinterpret_cast<const D3DXMATRIX*>(&mat));
-			d3ddev->SetTextureStageState(0, D3DTSS_TEXTURETRANSFORMFLAGS, D3DTTFF_COUNT2);
-		} 
-		if (pass.flags & PF_ENVIRONMENT) {
-			mat._00 = 0.5f;
-			mat._01 = 0.0f;
-			mat._10 = 0.0f;
-			mat._11 = 0.5f;
-			mat[2] = vec4_t(0.0f, 0.0f, 1.0f, 0.0f);
-			mat[3] = vec4_t(0.0f, 0.0f, 0.0f, 1.0f);
-			d3ddev->SetTransform(D3DTS_TEXTURE0, reinterpret_cast<const D3DXMATRIX*>(&(mat)));
-			d3ddev->SetTextureStageState(0, D3DTSS_TEXTURETRANSFORMFLAGS, D3DTTFF_COUNT2);
-			d3ddev->SetTextureStageState(0, D3DTSS_TEXCOORDINDEX, D3DTSS_TCI_CAMERASPACEREFLECTIONVECTOR);
-		} 
+			backend->set_render_state(D3DRS_TEXTUREFACTOR, frame.modulate);
+
+		// Generated texture co-ords already include the tcmods, see draw_face
+		if (pass.flags & PF_TCGEN) {
+			pass_tcgen = &frame.tcgen;
+		} else if (pass.num_tcmods) {
+			backend->set_transform(D3DTS_TEXTURE0, frame.tcmod);
+			backend->set_stage_state(0, D3DTSS_TEXTURETRANSFORMFLAGS, D3DTTFF_COUNT2);
+		}
 
 		// Set the texture
-		htexture_t map = pass.map();
-		ensure_loaded(map);
-		if (map == HT_LIGHTMAP)
-			d3ddev->SetTexture(0, shaders[lightmap].texture);
-		else
-			d3ddev->SetTexture(0, shaders[map].texture);
+		bind_texture(0, frame.map == HT_LIGHTMAP ? lightmap : frame.map);
+
+		// The collapsed pass, stage 1 keeps the alpha from stage 0 for the
+		// alpha test
+		if (pass.flags & PF_MULTITEXTURE) {
+			bind_texture(1, pass.stage1_map == HT_LIGHTMAP ? lightmap : pass.stage1_map);
+			if (!(pass.flags & PF_STAGE1TC1))
+				backend->set_stage_state(1, D3DTSS_TEXCOORDINDEX, 0);
+			backend->set_stage_state(1, D3DTSS_ALPHAOP, D3DTOP_SELECTARG2);
+			backend->set_stage_state(1, D3DTSS_COLOROP, pass.stage1_op);
+		}
 
 	} else {	// (shaders[shader].type == STYPE_TEXTURE)
 		// The one and only pass for textures
-		ensure_loaded(shader);
-		d3ddev->SetTexture(0, shaders[shader].texture);
+		bind_texture(0, shader);
 		if (lightmap) {
-			d3ddev->SetTexture(1, shaders[lightmap].texture);
-			d3ddev->SetTextureStageState(1, D3DTSS_COLOROP, D3DTOP_MODULATE);
+			bind_texture(1, lightmap);
+			backend->set_stage_state(1, D3DTSS_COLOROP, D3DTOP_MODULATE);
 		}
 	}
 }
@@ -996,51 +1621,55 @@ d3d_t::end_pass(hshader_t shader, htexture_t lightmap, int passno)
 //	console.printf("    end_pass %s %s %d\n", shaders[shader].name.c_str(), shaders[lightmap].name.c_str(), passno);
 
 	if (shaders[shader].type == STYPE_SHADER) {
-		const shader_pass_t& pass = passes[shaders[shader].first_pass + passno];
+		const shader_pass_t& pass = passes[draw_pass(shader, passno)];
 
 		if (pass.flags & PF_ALPHABLEND)
-			d3ddev->SetRenderState(D3DRS_ALPHABLENDENABLE, FALSE);
+			backend->set_render_state(D3DRS_ALPHABLENDENABLE, FALSE);
 
 		if (pass.flags & PF_ALPHATEST)
-			d3ddev->SetRenderState(D3DRS_ALPHATESTENABLE, FALSE);
+			backend->set_render_state(D3DRS_ALPHATESTENABLE, FALSE);
 
 		if (pass.flags & PF_CLAMP) {
-			d3ddev->SetTextureStageState(0, D3DTSS_ADDRESSU, D3DTADDRESS_WRAP);
-			d3ddev->SetTextureStageState(0, D3DTSS_ADDRESSV, D3DTADDRESS_WRAP);
-		}
-
-		if (pass.flags & PF_ENVIRONMENT) {
-			d3ddev->SetTextureStageState(0, D3DTSS_TEXTURETRANSFORMFLAGS, D3DTTFF_DISABLE);
-			d3ddev->SetTextureStageState(0, D3DTSS_TEXCOORDINDEX, 0);
+			backend->set_stage_state(0, D3DTSS_ADDRESSU, D3DTADDRESS_WRAP);
+			backend->set_stage_state(0, D3DTSS_ADDRESSV, D3DTADDRESS_WRAP);
 		}
 
 		if (pass.flags & PF_NOZWRITE)
-			d3ddev->SetRenderState(D3DRS_ZWRITEENABLE, TRUE);
+			backend->set_render_state(D3DRS_ZWRITEENABLE, TRUE);
 
 		if (pass.flags & PF_USETC1)
-			d3ddev->SetTextureStageState(0, D3DTSS_TEXCOORDINDEX, 0);
+			backend->set_stage_state(0, D3DTSS_TEXCOORDINDEX, 0);
 
 		if (pass.alphagen != ALPHAGEN_IDENTITY) {
-			d3ddev->SetTextureStageState(0, D3DTSS_ALPHAOP, D3DTOP_SELECTARG1);
+			backend->set_stage_state(0, D3DTSS_ALPHAOP, D3DTOP_SELECTARG1);
 			if (pass.alphagen == ALPHAGEN_WAVE)
-				d3ddev->SetTextureStageState(0, D3DTSS_ALPHAARG2, D3DTA_DIFFUSE);
+				backend->set_stage_state(0, D3DTSS_ALPHAARG2, D3DTA_DIFFUSE);
 		}
 
 		if (pass.rgbgen != RGBGEN_IDENTITY) {
-			d3ddev->SetTextureStageState(0, D3DTSS_COLOROP, D3DTOP_SELECTARG1);
+			backend->set_stage_state(0, D3DTSS_COLOROP, D3DTOP_SELECTARG1);
 			if (pass.rgbgen == RGBGEN_WAVE || pass.rgbgen == RGBGEN_IDENTITYLIGHTING)
-				d3ddev->SetTextureStageState(0, D3DTSS_COLORARG2, D3DTA_DIFFUSE);
+				backend->set_stage_state(0, D3DTSS_COLORARG2, D3DTA_DIFFUSE);
 		}
 
 		if (pass.depth_func != D3DCMP_LESSEQUAL)
-			d3ddev->SetRenderState(D3DRS_ZFUNC, D3DCMP_LESSEQUAL);
-
-		if (pass.num_tcmods)
-			d3ddev->SetTextureStageState(0, D3DTSS_TEXTURETRANSFORMFLAGS, D3DTTFF_DISABLE);
+			backend->set_render_state(D3DRS_ZFUNC, D3DCMP_LESSEQUAL);
+
+		if (pass.flags & PF_TCGEN)
+			pass_tcgen = 0;
+		else if (pass.num_tcmods)
+			backend->set_stage_state(0, D3DTSS_TEXTURETRANSFORMFLAGS, D3DTTFF_DISABLE);
+
+		if (pass.flags & PF_MULTITEXTURE) {
+			backend->set_stage_state(1, D3DTSS_COLOROP, D3DTOP_DISABLE);
+			backend->set_stage_state(1, D3DTSS_ALPHAOP, D3DTOP_SELECTARG1);
+			if (!(pass.flags & PF_STAGE1TC1))
+				backend->set_stage_state(1, D3DTSS_TEXCOORDINDEX, 1);
+		}
 
 	} else { // (shaders[shader].type == STYPE_TEXTURE)
 		if (lightmap)
-			d3ddev->SetTextureStageState(1, D3DTSS_COLOROP, D3DTOP_DISABLE);
+			backend->set_stage_state(1, D3DTSS_COLOROP, D3DTOP_DISABLE);
 	}
 }
 
@@ -1050,26 +1679,12 @@ d3d_t::end_shader(hshader_t shader, htexture_t lightmap)
 //	console.printf("end_shader %s %s\n", shaders[shader].name.c_str(), shaders[lightmap].name.c_str());
 
 	if ((shaders[shader].flags & SF_CULLFRONT) || !(shaders[shader].flags & SF_CULLBACK))
-		d3ddev->SetRenderState(D3DRS_CULLMODE, D3DCULL_CCW);
+		backend->set_render_state(D3DRS_CULLMODE, D3DCULL_CCW);
 }
 
 //#include "entity.h"
 //extern player_t player;
 
-bool
-d3d_t::generate_mipmaps(shader_t& texture)
-{
-	HRESULT hr = D3DXFilterTexture(
-		texture.texture,
-		NULL,
-		D3DX_DEFAULT,
-		D3DX_FILTER_TRIANGLE
-	);
-	if (FAILED(hr))
-		console.printf("generate_mipmaps failed for %s\n", texture.name);
-	return SUCCEEDED(hr);
-}
-
 int
 d3d_t::resources_to_load()
 {
@@ -1083,50 +1698,347 @@ d3d_t::resources_to_load()
 
 void
 d3d_t::load_resource()
+	// Hand any unrequested textures to the texture loader while it has room,
+	// then upload whichever have finished decoding. Never waits on the loader
 {
-	// Find the first unloaded STYPE_TEXTURE
-	htexture_t texture;
-	for (texture = 4; texture < num_shaders; ++texture)
-		if (shaders[texture].type == STYPE_TEXTURE && (shaders[texture].flags & SF_PRECACHE))
-			break;
-	u_assert(texture < num_shaders);
+	for (htexture_t texture = NUM_RESERVED_SHADERS; texture < num_shaders; ++texture) {
+		shader_t& shader = shaders[texture];
+		if (shader.type == STYPE_TEXTURE && (shader.flags & (SF_PRECACHE | SF_LOADING)) == SF_PRECACHE) {
+			if (!texloader.request(texture, shader.location, !(shader.flags & SF_NOMIPMAPS)))
+				break;
+			shader.flags |= SF_LOADING;
+		}
+	}
 
-	// Now load that texture
-	load_texture(texture);
+	collect_textures(num_shaders);
+}
+
+void
+d3d_t::collect_textures(int limit)
+	// Upload up to limit textures the texture loader has finished with
+{
+	int texture;
+	image_t image;
+	for (int i = 0; i < limit && texloader.collect(texture, image); ++i) {
+		shaders[texture].flags &= ~SF_LOADING;
+		upload_texture(texture, image);
+		image.clear();
+	}
+}
+
+void
+d3d_t::prefetch_shaders(const hshader_t* list, int count)
+	// Replace the prefetch list with the unloaded textures used by list
+{
+	for (int i = next_prefetch; i < num_prefetch; ++i)
+		shaders[prefetch_list[i]].flags &= ~SF_PREFETCH;
+	num_prefetch = 0;
+	next_prefetch = 0;
+
+	for (int j = 0; j < count; ++j) {
+		if (list[j] <= 0 || list[j] >= num_shaders)
+			continue;
+		const shader_t& shader = shaders[list[j]];
+		if (shader.type == STYPE_TEXTURE) {
+			add_prefetch(list[j]);
+		} else {
+			for (int p = 0; p < shader.num_passes; ++p) {
+				const shader_pass_t& pass = passes[shader.first_pass + p];
+				for (int m = 0; m < pass.num_maps; ++m)
+					add_prefetch(pass.maps[m]);
+				if (pass.flags & PF_MULTITEXTURE)
+					add_prefetch(pass.stage1_map);
+			}
+		}
+	}
+}
+
+void
+d3d_t::add_prefetch(htexture_t texture)
+{
+	shader_t& shader = shaders[texture];
+	if (texture >= NUM_RESERVED_SHADERS && shader.type == STYPE_TEXTURE && !shader.texture && shader.location.zip &&
+		!(shader.flags & (SF_CACHED | SF_LOADING | SF_PREFETCH))) {
+		shader.flags |= SF_PREFETCH;
+		prefetch_list[num_prefetch++] = texture;
+	}
+}
+
+void
+d3d_t::load_prefetched()
+	// Keep the texture loader busy with the prefetch list and upload a few
+	// of the finished textures. Does nothing while a map is loading
+{
+	if (resources_to_load())
+		return;
+	for (; next_prefetch < num_prefetch; ++next_prefetch) {
+		shader_t& shader = shaders[prefetch_list[next_prefetch]];
+		if (!shader.texture && !(shader.flags & (SF_CACHED | SF_LOADING))) {
+			if (!texloader.request(prefetch_list[next_prefetch], shader.location, !(shader.flags & SF_NOMIPMAPS)))
+				break;
+			shader.flags |= SF_LOADING;
+		}
+		shader.flags &= ~SF_PREFETCH;
+	}
+	collect_textures(*prefetch_uploads);
 }
 
 void
 d3d_t::free_resources()
 {
+	texloader.discard();
+	num_prefetch = 0;
+	next_prefetch = 0;
 	for (int i = 0; i < num_shaders; ++i) {
+		shaders[i].flags &= ~(SF_LOADING | SF_PREFETCH);
 		if (!(shaders[i].flags & SF_RETAIN)) {
-			shaders[i].texture = 0;
-			shaders[i].flags &= ~(SF_CACHED | SF_PRECACHE);
+			release_texture(shaders[i]);
+			shaders[i].flags &= ~(SF_CACHED | SF_PRECACHE | SF_EVICTED);
 		}
 	}
 	num_static_verts = 0;
 	num_static_inds = 0;
 }
 
+void
+d3d_t::upload_texture(htexture_t texture, image_t& image)
+	// Copy a decoded image and its mipmaps into a new texture. Images the
+	// texture loader couldn't decode go through load_texture instead
+{
+	shader_t& shader = shaders[texture];
+	if (shader.texture)
+		return;
+	if (image.num_levels == 0) {
+		load_texture(texture);
+		return;
+	}
+	// D3DX scales images to powers of 2 for devices that need them
+	const image_level_t& top = image.levels[0];
+	bool pow2 = (top.width & (top.width - 1)) == 0 && (top.height & (top.height - 1)) == 0;
+	if (!pow2 && (back_buffer_format->format->device->caps.TextureCaps & D3DPTEXTURECAPS_POW2)) {
+		load_texture(texture);
+		return;
+	}
+
+	console.printf("loading texture: %s ... ", shader.name.c_str());
+	HRESULT hr;
+	if (image.format == IMAGE_BGRA) {
+		hr = d3ddev->CreateTexture(image.levels[0].width, image.levels[0].height, image.num_levels, 0,
+			back_buffer_format->back_buffer_format, D3DPOOL_MANAGED, &shader.texture);
+		for (int i = 0; SUCCEEDED(hr) && i < image.num_levels; ++i) {
+			const image_level_t& level = image.levels[i];
+			IDirect3DSurface8* surface;
+			if (SUCCEEDED(hr = shader.texture->GetSurfaceLevel(i, &surface))) {
+				RECT rect = { 0, 0, level.width, level.height };
+				hr = D3DXLoadSurfaceFromMemory(surface, NULL, NULL, level.pixels, D3DFMT_A8R8G8B8,
+					level.pitch, NULL, &rect, D3DX_FILTER_NONE, 0);
+				surface->Release();
+			}
+		}
+	} else {
+		// Compressed levels are laid out the way the device keeps them, so
+		// each row of blocks is copied straight in
+		hr = d3ddev->CreateTexture(image.levels[0].width, image.levels[0].height, image.num_levels, 0,
+			image.format == IMAGE_DXT1 ? D3DFMT_DXT1 : D3DFMT_DXT5, D3DPOOL_MANAGED, &shader.texture);
+		for (int j = 0; SUCCEEDED(hr) && j < image.num_levels; ++j) {
+			const image_level_t& level = image.levels[j];
+			D3DLOCKED_RECT rect;
+			if (SUCCEEDED(hr = shader.texture->LockRect(j, &rect, NULL, 0))) {
+				ubyte* dest = static_cast<ubyte*>(rect.pBits);
+				for (int y = 0; y < (level.height + 3) / 4; ++y)
+					u_memcpy(dest + y * rect.Pitch, level.pixels + y * level.pitch, level.pitch);
+				shader.texture->UnlockRect(j);
+			}
+		}
+	}
+	if (FAILED(hr)) {
+		console.printf("failed, %s\n", get_error_string(hr));
+		shader.texture = 0;
+	} else {
+		console.print("ok\n");
+		track_texture(shader);
+	}
+	shader.flags &= ~(SF_PRECACHE | SF_EVICTED);	// Dont try to load this texture again
+	shader.flags |= SF_CACHED;		// Texture is loaded
+}
+
+void
+d3d_t::benchmark_textures()
+	// Every texture the shaders have defined is decoded, whether or not it is
+	// in use, and the images are thrown away as they are collected
+{
+	if (texloader.pending()) {
+		console.print("texbench: textures are still loading\n");
+		return;
+	}
+
+	int requested = 0, decoded = 0, failed = 0;
+	double bytes = 0.0;
+	image_t image;
+	timer.start(TID_PROFILE0);
+	htexture_t next = NUM_RESERVED_SHADERS;
+	while (next < num_shaders || texloader.pending()) {
+		for (; next < num_shaders; ++next) {
+			if (shaders[next].type != STYPE_TEXTURE || !shaders[next].location.zip)
+				continue;
+			if (!texloader.request(next, shaders[next].location, !(shaders[next].flags & SF_NOMIPMAPS)))
+				break;
+			++requested;
+		}
+		int texture;
+		bool collected = false;
+		while (texloader.collect(texture, image)) {
+			if (image.num_levels) {
+				++decoded;
+				bytes += image.size();
+			} else {
+				++failed;
+			}
+			image.clear();
+			collected = true;
+		}
+		if (!collected)
+			Sleep(0);
+	}
+	timer.mark(TID_PROFILE0);
+
+	float seconds = u_max(timer.elapsed(TID_PROFILE0), 0.001f);
+	console.printf("Decoded %d of %d textures on %d threads in %.3fs\n",
+		decoded, requested, texloader.num_threads(), seconds);
+	console.printf("%.1f textures/s, %.2fMB/s of pixels, %d not decodable\n",
+		m_itof(decoded) / seconds, bytes / (1024.0 * 1024.0) / seconds, failed);
+}
+
+namespace {
+	int
+	texture_bytes(IDirect3DTexture8* texture)
+		// Memory used by every level of a texture
+	{
+		int total = 0;
+		D3DSURFACE_DESC desc;
+		for (DWORD level = 0; level < texture->GetLevelCount(); ++level)
+			if (SUCCEEDED(texture->GetLevelDesc(level, &desc)))
+				total += desc.Size;
+		return total;
+	}
+}
+
+void
+d3d_t::track_texture(shader_t& shader)
+	// Count a newly created texture towards the resident total
+{
+	shader.texture_size = texture_bytes(shader.texture);
+	shader.last_used = frame_number;
+	resident_bytes += shader.texture_size;
+}
+
+void
+d3d_t::release_texture(shader_t& shader)
+{
+	resident_bytes -= shader.texture_size;
+	shader.texture_size = 0;
+	shader.texture = 0;
+}
+
+namespace {
+	int
+	compare_eviction_keys(const void* a, const void* b)
+	{
+		uint64 ka = *static_cast<const uint64*>(a);
+		uint64 kb = *static_cast<const uint64*>(b);
+		return ka < kb ? -1 : (ka > kb ? 1 : 0);
+	}
+}
+
+void
+d3d_t::evict_textures(int budget)
+	// Release the least recently used textures until the total is under
+	// budget. Textures used in the last frame are the working set and are
+	// never evicted, nor are retained textures or those without a file to
+	// reload them from, such as lightmaps. The candidates are found in one
+	// pass over the shaders and sorted oldest first, keyed by last_used in
+	// the high bits and the handle in the low bits
+{
+	if (resident_bytes <= budget)
+		return;
+
+	int count = 0;
+	for (int i = NUM_RESERVED_SHADERS; i < num_shaders; ++i) {
+		const shader_t& shader = shaders[i];
+		if (shader.texture_size && shader.location.zip && !(shader.flags & SF_RETAIN) &&
+			shader.last_used < frame_number - 1)
+			eviction_keys[count++] = (static_cast<uint64>(shader.last_used) << 32) | static_cast<uint>(i);
+	}
+	qsort(eviction_keys, count, sizeof(uint64), compare_eviction_keys);
+
+	for (int j = 0; j < count && resident_bytes > budget; ++j) {
+		shader_t& shader = shaders[static_cast<int>(eviction_keys[j] & 0xffffffff)];
+		release_texture(shader);
+		shader.flags &= ~SF_CACHED;
+		shader.flags |= SF_EVICTED;
+		++num_evictions;
+	}
+
+	// The filter may still think an evicted handle is bound, a reload makes
+	// a new texture so the next set must reach the device
+	if (count)
+		state_filter.invalidate();
+}
+
+void
+d3d_t::print_texture_stats()
+{
+	int count = 0;
+	int largest = 0;
+	for (int i = 0; i < num_shaders; ++i) {
+		if (shaders[i].texture_size) {
+			++count;
+			if (shaders[i].texture_size > shaders[largest].texture_size)
+				largest = i;
+		}
+	}
+	console.printf("%d textures resident, %.2fMB of %dMB budget\n",
+		count, resident_bytes / (1024.0f * 1024.0f), *texture_budget);
+	console.printf("%d evicted, %d reloaded after eviction\n", num_evictions, num_reloads);
+	console.printf("%d loaded on demand while drawing, %d waiting to be prefetched\n",
+		num_demand_loads, num_prefetch - next_prefetch);
+	if (count)
+		console.printf("Largest: %s, %dKB\n", shaders[largest].name.c_str(), shaders[largest].texture_size / 1024);
+}
+
+void
+d3d_t::demand_load(htexture_t texture)
+	// Decode a texture on this thread through the texture loader, so it is
+	// compressed and cached the same as one loaded in the background
+{
+	image_t image;
+	texloader.load(shaders[texture].location, !(shaders[texture].flags & SF_NOMIPMAPS), image);
+	upload_texture(texture, image);
+}
+
 void
 d3d_t::load_texture(htexture_t texture)
 	// Loads a texture and returns a reference to it. The newly loaded texture is added to
-	// the textures map before returning
+	// the textures map before returning. Used for the images the texture
+	// loader can't handle, D3DX compresses them to dxt5 if the loader would
 {
 	u_assert(shaders[texture].texture == 0);
 
 	console.printf("loading texture: %s ... ", shaders[texture].name.c_str());
-	auto_ptr<file_t> file(pak.open_file(shaders[texture].name));
+	auto_ptr<file_t> file(pak.open_file(shaders[texture].location));
 	if (file.get()) {
 		HRESULT hr = D3DXCreateTextureFromFileInMemoryEx(
 			d3ddev, file->data(), file->size(), D3DX_DEFAULT, D3DX_DEFAULT,
-			((shaders[texture].flags & SF_NOMIPMAPS) ? 1 : D3DX_DEFAULT), 0, back_buffer_format->back_buffer_format,
+			((shaders[texture].flags & SF_NOMIPMAPS) ? 1 : D3DX_DEFAULT), 0,
+			texloader.compressing() ? D3DFMT_DXT5 : back_buffer_format->back_buffer_format,
 			D3DPOOL_MANAGED, D3DX_DEFAULT, D3DX_DEFAULT, 0, NULL, NULL, &shaders[texture].texture);
-		if (FAILED(hr))
+		if (FAILED(hr)) {
 			console.printf("failed, %s\n", get_error_string(hr));
-		else
+		} else {
 			console.print("ok\n");
-		shaders[texture].flags &= ~SF_PRECACHE;	// Dont try to load this texture again
+			track_texture(shaders[texture]);
+		}
+		shaders[texture].flags &= ~(SF_PRECACHE | SF_EVICTED);	// Dont try to load this texture again
 		shaders[texture].flags |= SF_CACHED;	// Texture is loaded
 	} else {
 		console.print("failed, file not found\n");
@@ -1138,28 +2050,32 @@ d3d_t::load_texture(htexture_t texture)
 ///////////////////////////////////////////////////////////////////////////////
 
 int
-d3d_t::upload_dynamic_verts(const vertex_t* verts, int count)
-	// Upload vertices into the dynamic vertex buffer
+d3d_t::upload_dynamic_verts(const void* verts, int count, int stride)
+	// Upload vertices into the dynamic vertex buffer. The buffer is shared
+	// by every vertex layout, so the position is kept in bytes and rounded up
+	// to a whole number of vertices of the layout being uploaded
 {
-	static int next_vertex = 0;
+	static int next_byte = 0;
 
-	vertex_t* ver;
-	if (next_vertex + count <= *max_dynamic_verts) {
+	int vertex = (next_byte + stride - 1) / stride;
+	int size = count * stride;
+	ubyte* ver;
+	if ((vertex * stride) + size <= *max_dynamic_verts * static_cast<int>(sizeof(vertex_t))) {
 		vbuf->Lock(
-			next_vertex * sizeof(vertex_t),
-			count * sizeof(vertex_t),
-			reinterpret_cast<ubyte**>(&ver),
+			vertex * stride,
+			size,
+			&ver,
 			D3DLOCK_NOOVERWRITE
 		);
 	} else {
-		vbuf->Lock(0, 0, reinterpret_cast<ubyte**>(&ver), D3DLOCK_DISCARD);
-		next_vertex = 0;
+		vbuf->Lock(0, 0, &ver, D3DLOCK_DISCARD);
+		vertex = 0;
+		++vertex_wraps;
 	}
-	u_memcpy(ver, verts, count * sizeof(vertex_t));
+	u_memcpy(ver, verts, size);
 	vbuf->Unlock();
 
-	int vertex = next_vertex;
-	next_vertex += count;
+	next_byte = vertex * stride + size;
 
 	return vertex;
 }
@@ -1181,6 +2097,7 @@ d3d_t::upload_dynamic_inds(const index_t* inds, int count)
 	} else {
 		ibuf->Lock(0, 0, reinterpret_cast<ubyte**>(&ind), D3DLOCK_DISCARD);
 		next_index = 0;
+		++index_wraps;
 	}
 	u_memcpy(ind, inds, count * sizeof(index_t));
 	ibuf->Unlock();
@@ -1198,7 +2115,7 @@ d3d_t::upload_static_verts(const vertex_t* verts, int count)
 	console.debugf("uploading %d static vertices for total %d static vertices\n", count, count + num_static_verts);
 
 	vertex_t* ver;
-	if (num_static_verts + count <= *max_static_verts) {
+	if (num_static_verts + count <= static_vert_capacity) {
 		svbuf->Lock(
 			num_static_verts * sizeof(vertex_t),
 			count * sizeof(vertex_t),
@@ -1214,21 +2131,27 @@ d3d_t::upload_static_verts(const vertex_t* verts, int count)
 }
 
 int
-d3d_t::upload_static_inds(const index_t* inds, int count)
-	// Upload index data into the static index buffer
+d3d_t::upload_static_inds(const uint* inds, int count)
+	// Upload index data into the static index buffer, the indices are narrowed
+	// to 16 bits unless the buffer was created for 32 bit indices
 {
 	console.debugf("uploading %d static indices for total %d static indices\n", count, count + num_static_inds);
 
-	index_t* ind;
-	if (num_static_inds + count <= *max_static_inds) {
+	if (num_static_inds + count <= static_ind_capacity) {
+		ubyte* data;
 		sibuf->Lock(
-			num_static_inds * sizeof(index_t),
-			count * sizeof(index_t),
-			reinterpret_cast<ubyte**>(&ind), 
+			num_static_inds * static_index_size,
+			count * static_index_size,
+			&data, 
 			0
 		);
-		for (int i = 0; i < count; ++i)
-			ind[i] = inds[i];
+		if (static_index_size == sizeof(uint)) {
+			u_memcpy(data, inds, count * sizeof(uint));
+		} else {
+			ushort* ind = reinterpret_cast<ushort*>(data);
+			for (int i = 0; i < count; ++i)
+				ind[i] = static_cast<ushort>(inds[i]);
+		}
 		sibuf->Unlock();
 		num_static_inds += count;
 		return num_static_inds - count;
@@ -1236,15 +2159,78 @@ d3d_t::upload_static_inds(const index_t* inds, int count)
 	return -1;
 }
 
-htexture_t
-d3d_t::upload_lightmap_rgb(const ubyte* data, const int width, const int height, const char* name)
-	// Upload a lightmap, lightmaps are arrays of 128 x 128 x 3 unsigned bytes
+bool
+d3d_t::reserve_static(int num_verts, int num_inds)
+	// Make sure the static buffers can hold a map with the given number of
+	// vertices and indices. 16 bit indices are used unless some vertex can't
+	// be reached with them, any static data already uploaded is lost
+{
+	if (num_verts - 1 > static_cast<int>(back_buffer_format->format->device->caps.MaxVertexIndex)) {
+		console.printf("Map has %d vertices, the device can only index %d\n",
+			num_verts, back_buffer_format->format->device->caps.MaxVertexIndex + 1);
+		return false;
+	}
+	int index_size = (num_verts - 1 > 0xffff) ? sizeof(uint) : sizeof(ushort);
+	if (num_verts <= static_vert_capacity && num_inds <= static_ind_capacity && index_size == static_index_size) {
+		num_static_verts = 0;
+		num_static_inds = 0;
+		return true;
+	}
+	return create_static_buffers(u_max(num_verts, *max_static_verts), u_max(num_inds, *max_static_inds), index_size);
+}
+
+bool
+d3d_t::create_static_buffers(int num_verts, int num_inds, int index_size)
+	// (Re)create the static vertex and index buffers
 {
+	d3ddev->SetIndices(NULL, 0);
+	d3ddev->SetStreamSource(0, NULL, 0);
+	sibuf = 0;
+	svbuf = 0;
+	num_static_verts = 0;
+	num_static_inds = 0;
+	static_vert_capacity = 0;
+	static_ind_capacity = 0;
+	static_index_size = index_size;
+
+	HRESULT hr = d3ddev->CreateIndexBuffer(
+		num_inds * index_size,
+		D3DUSAGE_WRITEONLY,
+		index_size == sizeof(uint) ? D3DFMT_INDEX32 : D3DFMT_INDEX16,
+		D3DPOOL_DEFAULT,
+		&sibuf
+	);
+	if (FAILED(hr)) {
+		console.printf("IDirect3D8->CreateIndexBuffer() failed for static index buffer, %s\n", get_error_string(hr));
+		return false;
+	}
+
+	hr = d3ddev->CreateVertexBuffer(
+		num_verts * sizeof(vertex_t),
+		D3DUSAGE_WRITEONLY,
+		vertex_format_t<vertex_t>::FVF,
+		D3DPOOL_DEFAULT,
+		&svbuf
+	);
+	if (FAILED(hr)) {
+		console.printf("IDirect3D8->CreateVertexBuffer() failed for static vertex buffer, %s\n", get_error_string(hr));
+		sibuf = 0;
+		return false;
+	}
+
+	static_vert_capacity = num_verts;
+	static_ind_capacity = num_inds;
+	if (index_size == sizeof(uint))
+		console.printf("Using 32 bit static indices for %d vertices\n", num_verts);
+	return true;
+}
+
+namespace {
 	// Quake 3 uses overbright/gamma in fullscreen to brighten up the world, since this
 	// is impossible in windowed mode, artificially inflate the lightmap values to
 	// get a similar effect
 	// lm_lookup[i] = floor(256 - (1.0 - (i / 255))^2 * 223
-	const int lm_lookup[] = {
+	const ubyte lm_lookup[256] = {
 		 32,  34,  36,  38,  39,  41,  43,  45,  46,  48,  50,  51,  53,  55,  56,  58,
 		 60,  61,  63,  64,  66,  68,  69,  71,  72,  74,  76,  77,  79,  80,  82,  83,
 		 85,  86,  88,  90,  91,  93,  94,  95,  97,  98, 100, 101, 103, 104, 106, 107,
@@ -1263,9 +2249,107 @@ d3d_t::upload_lightmap_rgb(const ubyte* data, const int width, const int height,
 		255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
 	};
 
+	struct lightmap_job_t {
+		const ubyte* const*	data;
+		image_t*			images;
+		int					width;
+		int					height;
+		bool				brighten;
+	};
+
+	void
+	convert_lightmap(const ubyte* data, image_t& image, bool brighten)
+		// Expand a lightmap to 32 bits, with the alpha the average of the
+		// colour channels, and build its mipmaps
+	{
+		const int count = image.levels[0].width * image.levels[0].height;
+		ubyte* dest = image.levels[0].pixels;
+		if (brighten) {
+			for (int i = 0; i < count; ++i, data += 3, dest += 4) {
+				dest[0] = lm_lookup[data[2]];
+				dest[1] = lm_lookup[data[1]];
+				dest[2] = lm_lookup[data[0]];
+				dest[3] = 0;
+			}
+		} else {
+			for (int i = 0; i < count; ++i, data += 3, dest += 4) {
+				dest[0] = data[2];
+				dest[1] = data[1];
+				dest[2] = data[0];
+				dest[3] = 0;
+			}
+		}
+
+		int i = 0;
+		ubyte* pixels = image.levels[0].pixels;
+#ifdef USE_SSE2
+		// Four pixels at a time, the channel sums are divided by 3 by taking
+		// the high half of sum * 65536 / 3, which is exact for sums up to 765
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i colour = _mm_set_epi16(0, 1, 1, 1, 0, 1, 1, 1);
+		const __m128i one = _mm_set1_epi16(1);
+		const __m128i third = _mm_set1_epi16(21846);
+		for (; i + 4 <= count; i += 4) {
+			__m128i* p = reinterpret_cast<__m128i*>(pixels + i * 4);
+			__m128i px = _mm_loadu_si128(p);
+			__m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(px, zero), colour);
+			__m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(px, zero), colour);
+			__m128i sums = _mm_madd_epi16(_mm_packs_epi32(lo, hi), one);
+			__m128i alpha = _mm_mulhi_epu16(_mm_packs_epi32(sums, sums), third);
+			alpha = _mm_slli_epi32(_mm_unpacklo_epi16(alpha, zero), 24);
+			_mm_storeu_si128(p, _mm_or_si128(px, alpha));
+		}
+#endif
+		for (; i < count; ++i) {
+			ubyte* p = pixels + i * 4;
+			p[3] = static_cast<ubyte>((p[0] + p[1] + p[2]) / 3);
+		}
+
+		build_mipmaps(image);
+	}
+
+	void
+	lightmap_job(void* context, int job)
+	{
+		lightmap_job_t* batch = static_cast<lightmap_job_t*>(context);
+		convert_lightmap(batch->data[job], batch->images[job], batch->brighten);
+	}
+}
+
+void
+d3d_t::upload_lightmaps_rgb(const ubyte* const* data, htexture_t* handles, int count, int width, int height, int first)
+	// Upload a batch of lightmaps, each an array of width x height x 3 unsigned
+	// bytes. They are converted and mipped on the job threads, only the copy
+	// into the textures is left to this thread
+{
+	lightmap_job_t batch;
+	batch.data = data;
+	batch.images = new image_t[count];
+	// Allocate here, the jobs only fill in the pixels
+	for (int i = 0; i < count; ++i)
+		batch.images[i].allocate(width, height, true);
+	batch.width = width;
+	batch.height = height;
+	// Brighten the lightmaps if we cant control gamma
+	batch.brighten = *display_fullscreen == 0 || !(back_buffer_format->format->device->caps.Caps2 & D3DCAPS2_FULLSCREENGAMMA);
+	jobs.run(lightmap_job, &batch, count);
+
+	for (int i = 0; i < count; ++i) {
+		str_t<64> name = "lightmap";
+		name += str_t<64>(first + i);
+		handles[i] = upload_lightmap(batch.images[i], name);
+	}
+	delete [] batch.images;
+}
+
+htexture_t
+d3d_t::upload_lightmap(const image_t& image, const char* name)
+	// Copy a converted lightmap and its mipmaps into a texture
+{
 	// Check if a texture with this name exists
 	htexture_t handle = get_texture(name);
-	if (handle == 0) {
+	bool created = handle == 0;
+	if (created) {
 		u_assert(num_shaders < *max_shaders);
 		handle = num_shaders++;
 	}
@@ -1274,46 +2358,36 @@ d3d_t::upload_lightmap_rgb(const ubyte* data, const int width, const int height,
 	shader_t& texture = shaders[handle];
 	texture.type = STYPE_TEXTURE;
 	texture.name = name;
+	if (created)
+		hash_shader(handle);	// So the next map reuses this slot
 	texture.flags = SF_CULLBACK;
 	texture.sort = SORT_OPAQUE;
-	texture.texture = 0;
+	release_texture(texture);
 	texture.num_passes = 1;
+	texture.num_deforms = 0;
 	texture.first_pass = -1;
+	// The slot may have held an image file, a lightmap has none to be
+	// reloaded from so eviction has to leave it alone
+	texture.location.zip = 0;
+	texture.location.entry = 0;
 
-	HRESULT hr = d3ddev->CreateTexture(width, height, 0, 0, D3DFMT_A8R8G8B8, D3DPOOL_MANAGED, &texture.texture);
+	HRESULT hr = d3ddev->CreateTexture(image.levels[0].width, image.levels[0].height, image.num_levels, 0, D3DFMT_A8R8G8B8, D3DPOOL_MANAGED, &texture.texture);
 	if (SUCCEEDED(hr)) {
-		D3DSURFACE_DESC desc;
-
-		if (SUCCEEDED(hr = texture.texture->GetLevelDesc(0, &desc))) {
+		for (int level = 0; level < image.num_levels; ++level) {
+			const image_level_t& src = image.levels[level];
 			D3DLOCKED_RECT rect;
-			if (SUCCEEDED(hr = texture.texture->LockRect(0, &rect, 0, 0))) {
-				ubyte* dstbuffer = static_cast<ubyte*>(rect.pBits);
-				for (int i = 0; i < width; ++i) {
-					ulong* dest = reinterpret_cast<ulong*>(dstbuffer);
-					for (int j = 0; j < height; ++j) {
-						ubyte r = *data++;
-						ubyte g = *data++;
-						ubyte b = *data++;
-						ubyte a;
-						if (*display_fullscreen == 0 || !(back_buffer_format->format->device->caps.Caps2 & D3DCAPS2_FULLSCREENGAMMA)) {
-							// Brighten the lightmaps if we cant control gamma
-							r = lm_lookup[r];
-							g = lm_lookup[g];
-							b = lm_lookup[b];
-							a = (r + g + b) / 3;
-						}
-						*dest++ = ((a << 24) + (r << 16) + (g << 8) + b);
-					}
-					dstbuffer += rect.Pitch;
-				}
-				console.printf("%s successfully uploaded\n", name);
-				texture.texture->UnlockRect(0);
-				generate_mipmaps(texture);
-			} else {
+			if (FAILED(hr = texture.texture->LockRect(level, &rect, 0, 0))) {
 				console.printf("IDirect3DTexture8->LockRect() failed, hr = %#x\n", hr);
+				break;
 			}
-		} else {
-			console.printf("IDirect3DTexture8->GetLevelDesc() failed, hr = %#x\n", hr);
+			ubyte* dstbuffer = static_cast<ubyte*>(rect.pBits);
+			for (int y = 0; y < src.height; ++y, dstbuffer += rect.Pitch)
+				u_memcpy(dstbuffer, src.pixels + y * src.width * 4, src.width * 4);
+			texture.texture->UnlockRect(level);
+		}
+		if (SUCCEEDED(hr)) {
+			console.printf("%s successfully uploaded\n", name);
+			track_texture(texture);
 		}
 	} else {
 		console.printf("IDirect3DDevice8->CreateTexture() falied: hr = %#x\n", hr);
@@ -1322,6 +2396,78 @@ d3d_t::upload_lightmap_rgb(const ubyte* data, const int width, const int height,
 	return handle;
 }
 
+int
+d3d_t::add_deform(const deform_t& deform)
+	// Returns the index of a deform the same as this one, adding it if there
+	// isn't one yet. Returns -1 if there is no room
+{
+	for (int i = 0; i < num_deforms; ++i)
+		if (deforms[i] == deform)
+			return i;
+	if (num_deforms == *max_shader_deforms) {
+		console.printf("add_deform: more than %d distinct deforms\n", *max_shader_deforms);
+		return -1;
+	}
+	deforms[num_deforms] = deform;
+	deform_frames[num_deforms].frame = -1;
+	return num_deforms++;
+}
+
+int
+d3d_t::add_wave(shader_t& shader, const wavefunc_t& wave)
+	// Append a wave to the shader's waves, returns the index of its value in
+	// wave_values or -1 if there is no room
+{
+	if (num_waves == *max_shader_waves) {
+		console.printf("add_wave: more than %d shader waves\n", *max_shader_waves);
+		return -1;
+	}
+	waves[num_waves] = wave;
+	++shader.num_waves;
+	return num_waves++;
+}
+
+bool
+d3d_t::gather_waves(shader_t& shader)
+	// Copy every wave the shader evaluates each frame into one run of waves so
+	// update_waves can do them in a single batch. Returns false if there is
+	// no room
+{
+	shader.first_wave = num_waves;
+	shader.num_waves = 0;
+	shader.wave_frame = -1;
+	for (int p = 0; p < shader.num_passes; ++p) {
+		shader_pass_t& pass = passes[shader.first_pass + p];
+		if (pass.alphagen == ALPHAGEN_WAVE && (pass.alphagen_value = add_wave(shader, pass.alphagen_wave)) < 0)
+			return false;
+		if (pass.rgbgen == RGBGEN_WAVE && (pass.rgbgen_value = add_wave(shader, pass.rgbgen_wave)) < 0)
+			return false;
+		for (int t = 0; t < pass.num_tcmods; ++t) {
+			tcmod_t& tcmod = pass.tcmods[t];
+			if (tcmod.type == TCMOD_STRETCH && (tcmod.value = add_wave(shader, tcmod.wave)) < 0)
+				return false;
+		}
+	}
+	for (int d = 0; d < shader.num_deforms; ++d) {
+		shader.deform_values[d] = -1;
+		const deform_t& deform = deforms[shader.deforms[d]];
+		if (deform.type == DEFORM_MOVE && (shader.deform_values[d] = add_wave(shader, deform.wave)) < 0)
+			return false;
+	}
+	return true;
+}
+
+void
+d3d_t::update_waves(hshader_t shader)
+	// Evaluate the shader's waves the first time it is used in a frame
+{
+	shader_t& s = shaders[shader];
+	if (s.wave_frame == frame_number)
+		return;
+	s.wave_frame = frame_number;
+	evaluate_waves(waves + s.first_wave, s.num_waves, frame_time, wave_values + s.first_wave);
+}
+
 void
 d3d_t::upload_shader(const token_t* tokens)
 	// Convert a token stream into the internal representation of a shader
@@ -1331,6 +2477,8 @@ d3d_t::upload_shader(const token_t* tokens)
 	// Save num shaders, if the parsing fails this will have to be restored
 	int save_num_shaders = num_shaders;
 	int save_num_passes = num_passes;
+	int save_num_deforms = num_deforms;
+	int save_num_waves = num_waves;
 
 	if (*verbose_shader_parsing) {
 		console.printf(DIVIDER);
@@ -1347,6 +2495,7 @@ d3d_t::upload_shader(const token_t* tokens)
 	shader.sort = SORT_OPAQUE;
 	shader.texture = 0;
 	shader.num_passes = 0;
+	shader.num_deforms = 0;
 	shader.first_pass = num_passes;
 
 	bool fail = false;
@@ -1361,6 +2510,8 @@ d3d_t::upload_shader(const token_t* tokens)
 		pass.flags = 0;
 		pass.num_maps = 0;
 		pass.num_tcmods = 0;
+		pass.tcgen = TCGEN_BASE;
+		pass.stage1_map = 0;
 		pass.anim_freq = 0.0f;
 		pass.alpha_func = D3DCMP_ALWAYS;
 		pass.alpha_ref = 0;
@@ -1583,13 +2734,20 @@ d3d_t::upload_shader(const token_t* tokens)
 				case SK_TCGEN:		// SE_TCGEN
 					switch (t[1].type) {
 					case SK_BASE:
-						pass.flags &= ~(PF_ENVIRONMENT);
+						pass.tcgen = TCGEN_BASE;
 						break;
 					case SK_ENVIRONMENT:
-						pass.flags |= PF_ENVIRONMENT;
+						pass.tcgen = TCGEN_ENVIRONMENT;
 						break;
 					case SK_LIGHTMAP:
+						pass.tcgen = TCGEN_LIGHTMAP;
 						pass.flags |= PF_USETC1;
+						break;
+					case SK_VECTOR:		// SE_VECTOR, SE_VECTOR
+						// Same axis swap as the bsp vertices
+						pass.tcgen = TCGEN_VECTOR;
+						pass.tcgen_s = vec3_t(t[3].float_value, t[5].float_value, -t[4].float_value);
+						pass.tcgen_t = vec3_t(t[8].float_value, t[10].float_value, -t[9].float_value);
 					}
 					break;
 				case SK_TCMOD:		// SE_TCMOD
@@ -1645,11 +2803,38 @@ d3d_t::upload_shader(const token_t* tokens)
 					case SK_TRANSFORM:	// SL_FLOAT, SL_FLOAT, SL_FLOAT, SL_FLOAT, SL_FLOAT, SL_FLOAT
 						break;
 					case SK_TURB:		// SE_TURB
+						u_assert(pass.num_tcmods != MAX_PASS_TCMODS);
+						pass.tcmods[pass.num_tcmods].type = TCMOD_TURB;
+						pass.tcmods[pass.num_tcmods].wave.type = WAVE_SIN;
+						{
+							// The sin keyword is optional
+							const token_t* f = (t[2].type == SK_SIN) ? t + 3 : t + 2;
+							pass.tcmods[pass.num_tcmods].wave.base	  = f[0].float_value;
+							pass.tcmods[pass.num_tcmods].wave.amplitude = f[1].float_value;
+							pass.tcmods[pass.num_tcmods].wave.phase	  = f[2].float_value;
+							pass.tcmods[pass.num_tcmods].wave.frequency = f[3].float_value;
+						}
+						++pass.num_tcmods;
 						break;
 					}
 					break;
 				}
 			}
+			// A lightmap map without a tcgen uses the lightmap co-ords. Anything
+			// a texture matrix can't do is generated per vertex in draw_face
+			if (pass.tcgen == TCGEN_BASE && (pass.flags & PF_USETC1))
+				pass.tcgen = TCGEN_LIGHTMAP;
+			if (pass.tcgen == TCGEN_ENVIRONMENT || pass.tcgen == TCGEN_VECTOR) {
+				pass.flags |= PF_TCGEN;
+			} else {
+				for (int i = 0; i < pass.num_tcmods; ++i)
+					if (pass.tcmods[i].type == TCMOD_TURB)
+						pass.flags |= PF_TCGEN;
+			}
+			if (pass.flags & PF_TCGEN) {
+				pass.flags &= ~PF_USETC1;	// tc1 is copied into tc0 instead
+				shader.flags |= SF_TCGEN;
+			}
 			if (shader.num_passes == 0)
 				shader.first_pass = num_passes;
 			++shader.num_passes;
@@ -1672,6 +2857,17 @@ d3d_t::upload_shader(const token_t* tokens)
 			};
 			break;
 		case SK_DEFORMVERTEXES:			// SE_DEFORMVERTEXES
+			if (shader.num_deforms == MAX_SHADER_DEFORMS) {
+				console.printf("upload_shader: too many deformvertexes in %s\n", shader.name.c_str());
+			} else {
+				int deform = add_deform(read_deform(t));
+				if (deform < 0) {
+					fail = true;
+				} else {
+					shader.deforms[shader.num_deforms++] = deform;
+					shader.flags |= SF_DEFORM;
+				}
+			}
 			break;
 		case SK_FOGPARMS:				// SE_FOGPARMS
 			break;
@@ -1739,11 +2935,23 @@ d3d_t::upload_shader(const token_t* tokens)
 		}
 	}
 
+	if (!fail)
+		fail = !gather_waves(shader);
+
 	if (fail) {
+		unhash_shaders(save_num_shaders);
 		num_shaders = save_num_shaders;
 		num_passes = save_num_passes;
+		num_deforms = save_num_deforms;
+		num_waves = save_num_waves;
 	} else {
 		num_passes += shader.num_passes;
+		collapse_shader_passes(shader);
+		shader_sorts[save_num_shaders] = u_max(0, u_min(shader.sort, 255));
+
+		// Only the first definition of a shader is ever used
+		if (find_shader(shader.name, STYPE_SHADER) == 0)
+			hash_shader(save_num_shaders);
 	}
 
 	if (*verbose_shader_parsing) {
@@ -1754,6 +2962,33 @@ d3d_t::upload_shader(const token_t* tokens)
 }
 
 
+void
+d3d_t::collapse_shader_passes(shader_t& shader)
+	// Most shaders are an opaque pass with a lightmap pass filtered over it,
+	// these and similar pairs are drawn as a single pass with two textures.
+	// The collapsed passes are a copy after the shader's own, so
+	// collapse_passes can be changed with shaders loaded. Shaders with
+	// nothing to collapse, or no room for the copy, draw their own passes
+{
+	shader.collapsed_pass = shader.first_pass;
+	shader.num_collapsed_passes = shader.num_passes;
+	if (num_passes + shader.num_passes > *max_shader_passes)
+		return;
+
+	shader_pass_t* pass = passes + num_passes;
+	int count = 0;
+	for (int i = 0; i < shader.num_passes; ++i) {
+		pass[count] = passes[shader.first_pass + i];
+		if (count == 0 || !collapse_pass(pass[count - 1], pass[count]))
+			++count;
+	}
+	if (count < shader.num_passes) {
+		shader.collapsed_pass = num_passes;
+		shader.num_collapsed_passes = count;
+		num_passes += count;
+	}
+}
+
 void
 d3d_t::list_shaders(uint first, uint num)
 	// list num shaders in the list, starting at first, if num is 0, then list all
@@ -1941,7 +3176,7 @@ d3d_t::confirm_device(const d3dinfo_t::device_t& device)
 		return "Device does not support counter-clockwise culling";
 	if (!(device.caps.PrimitiveMiscCaps & D3DPMISCCAPS_MASKZ))
 		return "Device cannot disable zbuffer modification for pixel operations";
-	if (device.caps.MaxVertexIndex < MAX_INDICES)
+	if (device.caps.MaxVertexIndex < 0xffff)
 		return "Device cannot support sufficiently large index buffers";
 	if (!(device.caps.DevCaps & D3DDEVCAPS_HWTRANSFORMANDLIGHT))
 		return "Device is not capable of hardware vertex processing";
@@ -8,6 +8,9 @@
 #define D3D_H
 
 #include "d3dinfo.h"
+#include "deform.h"
+#include "image.h"
+#include "renderer.h"
 
 extern const uint SF_ACTIVE;	// Shader is currently in use
 extern const uint SF_RETAIN;	// Never unload this shader
@@ -15,6 +18,36 @@ extern const uint SF_NOMIPMAPS;	// No mipmaps for this shader
 extern const uint SF_NOPICMIP;	// Never picmip this shader
 extern const uint SF_CULLFRONT;	// Cull front faces
 extern const uint SF_CULLBACK;	// Cull back faces (default)
+extern const uint SF_DEFORM;	// Vertices are deformed on the CPU, see deform_list
+extern const uint SF_TCGEN;		// Texture co-ords are generated on the CPU, see draw_face
+
+// Shader sort orders, anything after SORT_OPAQUE is drawn back to front
+extern const int SORT_PORTAL;
+extern const int SORT_SKY;
+extern const int SORT_OPAQUE;
+extern const int SORT_BANNER;
+extern const int SORT_UNDERWATER;
+extern const int SORT_ADDITIVE;
+extern const int SORT_NEAREST;
+
+// The fixed function vertex format each vertex layout is drawn with
+template <class V> struct vertex_format_t;
+
+template <> struct vertex_format_t<vertex_t> {
+	enum { FVF = D3DFVF_XYZ
+#ifdef VERTEX_FULL_NORMALS
+			| D3DFVF_NORMAL
+#endif
+			| D3DFVF_DIFFUSE
+#ifndef VERTEX_FULL_NORMALS
+			| D3DFVF_SPECULAR	// Packed normal
+#endif
+			| D3DFVF_TEX2 | D3DFVF_TEXCOORDSIZE2(0) | D3DFVF_TEXCOORDSIZE2(1) };
+};
+
+template <> struct vertex_format_t<ui_vertex_t> {
+	enum { FVF = D3DFVF_XYZ | D3DFVF_DIFFUSE | D3DFVF_TEX1 | D3DFVF_TEXCOORDSIZE2(0) };
+};
 
 struct render_stats_t {
 	// Simple struct for tracking statistics on rendering
@@ -22,11 +55,13 @@ struct render_stats_t {
 	int		num_faces;		// Number of faces rendered
 	int		num_verts;		// Number of vertices referenced
 	int		num_inds;		// Number of indices referenced
+	int		num_filtered;	// Number of redundant state changes dropped
 
-	render_stats_t(int nf = 0, int nv = 0, int ni = 0) :
+	render_stats_t(int nf = 0, int nv = 0, int ni = 0, int nfs = 0) :
 		num_faces(nf),
 		num_verts(nv),
-		num_inds(ni)
+		num_inds(ni),
+		num_filtered(nfs)
 	{}
 
 	void operator+=(const render_stats_t& rs)
@@ -34,11 +69,13 @@ struct render_stats_t {
 		num_faces += rs.num_faces;
 		num_verts += rs.num_verts;
 		num_inds += rs.num_inds;
+		num_filtered += rs.num_filtered;
 	}
 
 	render_stats_t operator+(const render_stats_t& rs)
 	{
-		return render_stats_t(num_faces + rs.num_faces, num_verts + rs.num_verts, num_inds + rs.num_inds);
+		return render_stats_t(num_faces + rs.num_faces, num_verts + rs.num_verts,
+			num_inds + rs.num_inds, num_filtered + rs.num_filtered);
 	}
 };
 
@@ -47,6 +84,7 @@ class d3d_t {
 public:
 	struct shader_t;
 	struct shader_pass_t;
+	struct pass_frame_t;
 
 	~d3d_t() { destroy(); }
 
@@ -65,48 +103,210 @@ public:
 		uint count = 0, const D3DRECT* rects = NULL)
 	{ d3ddev->Clear(count, rects, flags, color, z, stencil); }
 
-	render_stats_t	render_list(display_list_t& dl);
+	// Draw a display list of any vertex layout. Defined here as VC6 can't
+	// define member templates outside the class
+	template <class V>
+	render_stats_t render_list(basic_display_list_t<V>& dl)
+	{
+		dl.sort();
+		set_vertex_format(vertex_format_t<V>::FVF, sizeof(V));
+
+		render_stats_t stats;
+		int filtered = state_filter.filtered();
+
+		// The dynamic geometry of every face is uploaded before anything is
+		// drawn, so multi pass shaders don't upload it again for each pass.
+		// It goes in in sorted order so neighbouring faces can share a draw
+		const int* order = dl.sorted_faces();
+		int count = dl.num_faces();
+		begin_dynamic(count);
+		for (int s = 0; s < count; ++s)
+			stage_face(order[s], dl.face(order[s]), dl.face(order[s]).verts);
+		end_dynamic();
+
+		int last;
+		for (int first = 0; first < count; first = last) {
+			// Faces from first to last share the same shader and lightmap
+			const face_base_t* f = &dl.face(order[first]);
+			for (last = first + 1; last < count; ++last)
+				if (dl.face(order[last]).shader != f->shader || dl.face(order[last]).lightmap != f->lightmap)
+					break;
+
+			begin_shader(f->shader, f->lightmap);
+			for (int pass = 0; pass < num_shader_passes(f->shader); ++pass) {
+				begin_pass(f->shader, f->lightmap, pass);
+				for (int i = first; i < last; ++i) {
+					const basic_face_t<V>& face = dl.face(order[i]);
+					stats += render_stats_t(1, face.num_verts, face.num_inds);
+					queue_face(order[i], face, face.verts);
+				}
+				flush_faces();
+				end_pass(f->shader, f->lightmap, pass);
+			}
+			end_shader(f->shader, f->lightmap);
+		}
+
+		if (begin_show_tris()) {
+			for (int i = 0; i < count; ++i)
+				draw_face(i, dl.face(i), dl.face(i).verts);
+			end_show_tris();
+		}
+
+		stats.num_filtered = state_filter.filtered() - filtered;
+		return stats;
+	}
 
 	void		set_camera(const camera_t& camera);
 
+	// Apply the vertex deforms of each face's shader. Faces using shaders
+	// with SF_DEFORM must have their own vertices, which are changed in place.
+	// Call after set_camera as the sprite deforms turn to face it. Returns
+	// the number of faces deformed
+	int			deform_list(display_list_t& dl);
+
+	// Whether a pass drawn since begin() changes with time, a wave, a moving
+	// tcmod or an animMap, so the frame isn't the same when drawn again
+	bool		is_animating() const { return animating; }
+
+	// Send render commands to another backend, 0 restores the device
+	render_backend_t*	set_backend(render_backend_t* b);
+
+	// Turn the state filter on or off until the next begin(), returns
+	// whether it was on
+	bool		set_state_filtering(bool enabled);
+
+	// Set collapse_passes, returns whether it was set
+	bool		set_pass_collapsing(bool enabled);
+
 	hshader_t	get_shader(const char* name, bool retain = false);
 	uint		get_surface_flags(hshader_t shader);
+	int			get_sort(hshader_t shader) const { return shader_sorts[shader]; }
 
 	// Returns the number of resources that have been requested but not yet loaded
 	int			resources_to_load();
 	void		load_resource();
 	void		free_resources();
 
+	// Queue the textures of shaders that are likely to be drawn soon, most
+	// important first. load_prefetched feeds them to the texture loader and
+	// uploads some of the results along with any evicted textures being
+	// reloaded, call it once a frame
+	void		prefetch_shaders(const hshader_t* list, int count);
+	void		load_prefetched();
+
 	// Print a list of shaders to the console
 	void		list_shaders(uint first, uint num);
 
+	// Decode every texture in the paks through the texture loader without
+	// uploading them and print the throughput
+	void		benchmark_textures();
+
+	// Print the memory used by resident textures and the evictions made to
+	// keep it under texture_budget
+	void		print_texture_stats();
+
 	// The upload functions are used to pass data to the renderer
 	void		upload_shader(const token_t* tokens);
-	htexture_t	upload_lightmap_rgb(const ubyte* data, const int width, const int height, const char* name);
+	// Lightmaps are arrays of width x height x 3 unsigned bytes, lightmap i is
+	// named lightmap<first + i> and its texture returned in handles[i]
+	void		upload_lightmaps_rgb(const ubyte* const* data, htexture_t* handles, int count, int width, int height, int first);
 	int			upload_static_verts(const vertex_t* verts, int count);
-	int			upload_static_inds(const index_t* inds, int count);
+	int			upload_static_inds(const uint* inds, int count);
+
+	// Size the static buffers for a map, they switch to 32 bit indices if the
+	// map has more vertices than 16 bits can index. Returns false if the
+	// device can't draw that many vertices
+	bool		reserve_static(int num_verts, int num_inds);
 
 	static d3d_t& get_instance();
 
 private:
 
-	// Used for sorting the render list
-	friend int compare_faces(const void* f1, const void* f2);
-
 	int				num_shaders;		// Number of shaders defined
 	int				num_passes;			// Number of shader passes defined
 	int				num_static_verts;	// Number of static vertices
-	int				num_static_inds;	// Number of static vertices
+	int				num_static_inds;	// Number of static indices
+	int				static_vert_capacity;	// Size of the static vertex buffer
+	int				static_ind_capacity;	// Size of the static index buffer
+	int				static_index_size;	// 2 or 4 bytes per static index
+	int				vertex_stride;		// Size of the vertex layout being drawn
+
+	pass_frame_t*	pass_frames;		// Per frame values for each pass
+	int				num_deforms;		// Number of distinct deforms defined
+	deform_t*		deforms;			// Shared by every shader using them
+	deform_frame_t*	deform_frames;		// Per frame values for each deform
+	int				num_waves;			// Number of waves in every shader
+	wavefunc_t*		waves;				// Each shader's waves, see gather_waves
+	float*			wave_values;		// The waves evaluated for this frame
+	deform_view_t	deform_view;		// Camera position and axes from set_camera
+	vertex_t*		tcgen_verts;		// Face copy with generated texture co-ords
+	const tcgen_t*	pass_tcgen;			// Generation for the current pass, or 0
+	int				frame_number;		// Incremented by begin()
+	float			frame_time;			// Application time at begin()
+	bool			animating;			// See is_animating
+	int				resident_bytes;		// Memory used by every loaded texture
+	int				num_evictions;		// Textures released by evict_textures
+	int				num_reloads;		// Evicted textures loaded again
+	int				num_demand_loads;	// Textures ensure_loaded waited on
+
+	render_backend_t*	backend;		// Where render commands are sent, always
+										// state_filter which passes them on
+	render_backend_t*	device_backend;	// Backend drawing with d3ddev
+	state_filter_t		state_filter;	// Drops redundant state changes
+
+	friend class d3d_backend_t;
 
 	d3dinfo_t::back_buffer_format_t*	back_buffer_format;
 	d3dinfo_t::mode_t*					display_mode;
 
 	shader_t*		shaders;			// Array of shaders
 	shader_pass_t*	passes;				// Array of passes
+	ubyte*			shader_sorts;		// Sort order of each shader, kept
+										// apart for building sort keys
+	int				shader_hash_size;	// Number of buckets, a power of 2
+	int*			shader_hash;		// First shader in each bucket, or -1
+	int*			shader_hash_next;	// Next shader in the same bucket
+
+	ubyte*			dynamic_verts;		// Dynamic vertices of the list being drawn
+	index_t*		dynamic_inds;		// Dynamic indices of the list being drawn
+	int				dynamic_bytes;		// Bytes used in dynamic_verts
+	int				dynamic_count;		// Indices used in dynamic_inds
+	int*			dynamic_bases;		// First vertex and index of each face in
+										// the batch, -1 if it wasn't batched
+	int				dynamic_faces;		// Faces dynamic_bases has room for
+	int				batch_vertex;		// Where the batch went in the ring buffers
+	int				batch_index;
+	int				vertex_wraps;		// Times the dynamic buffers have been
+	int				index_wraps;		// discarded since the batch went in
+
+	// Faces queued to be drawn together, they share a buffer and their
+	// indices follow on from each other
+	int				merge_faces;		// Faces queued, 0 if none
+	render_buffer_t	merge_buffer;		// RB_STATIC or RB_DYNAMIC for both streams
+	int				merge_base_vertex;
+	int				merge_min_index;
+	int				merge_max_index;	// One past the highest vertex used
+	int				merge_base_index;
+	int				merge_num_inds;
+
+	htexture_t*		prefetch_list;		// Textures to prefetch, in order
+	uint64*			eviction_keys;		// Scratch for evict_textures
+	int				num_prefetch;		// Length of prefetch_list
+	int				next_prefetch;		// Next entry to request
 
 	const char*		get_error_string(HRESULT hr);
-	bool			generate_mipmaps(shader_t& texture);
-	void			show_tris(display_list_t& dl);
+	int				num_shader_passes(hshader_t shader) const;
+	int				draw_pass(hshader_t shader, int passno) const;
+	void			set_vertex_format(DWORD fvf, int stride);
+	void			begin_dynamic(int count);
+	void			stage_face(int index, const face_base_t& face, const void* verts);
+	void			end_dynamic();
+	void			draw_face(int index, const face_base_t& face, const void* verts);
+	void			queue_face(int index, const face_base_t& face, const void* verts);
+	void			flush_faces();
+	bool			begin_show_tris();
+	void			end_show_tris();
+	bool			create_static_buffers(int num_verts, int num_inds, int index_size);
 
 	d3d_t();
 
@@ -123,17 +323,35 @@ private:
 	D3DPRESENT_PARAMETERS d3dpp;
 
 	void begin_shader(hshader_t shader, htexture_t lightmap);
+	const pass_frame_t& evaluate_pass(int pass);
 	void begin_pass(hshader_t shader, htexture_t lightmap, int pass);
 	void end_pass(hshader_t shader, htexture_t lightmap, int pass);
 	void end_shader(hshader_t shader, htexture_t lightmap);
 
-	int upload_dynamic_verts(const vertex_t* verts, int count);
+	int upload_dynamic_verts(const void* verts, int count, int stride);
 	int upload_dynamic_inds(const index_t* verts, int count);
 
 	htexture_t	define_texture(const char* name, bool parsing);
 	htexture_t	get_texture(const char* name);
+	int			find_shader(const char* name, int type) const;
+	void		hash_shader(int shader);
+	void		unhash_shaders(int first);
 	void		load_texture(htexture_t texture);
+	void		demand_load(htexture_t texture);
+	void		upload_texture(htexture_t texture, image_t& image);
+	htexture_t	upload_lightmap(const image_t& image, const char* name);
+	void		track_texture(shader_t& shader);
+	void		release_texture(shader_t& shader);
+	void		evict_textures(int budget);
+	void		collect_textures(int limit);
+	void		add_prefetch(htexture_t texture);
 	void		ensure_loaded(htexture_t texture);
+	void		bind_texture(uint stage, htexture_t texture);
+	int			add_deform(const deform_t& deform);
+	int			add_wave(shader_t& shader, const wavefunc_t& wave);
+	bool		gather_waves(shader_t& shader);
+	void		update_waves(hshader_t shader);
+	void		collapse_shader_passes(shader_t& shader);
 
 	// Functions for selecting which formats etc will be used
 	result_t choose_present_params();
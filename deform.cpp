@@ -0,0 +1,500 @@
+//-----------------------------------------------------------------------------
+// File: deform.cpp
+//
+// Vertex deforms and texture coordinate generation. The deforms that move
+// every vertex (wave, bulge and move) and the generated texture coordinates
+// work on four vertices at a time with SSE2, loading the positions and
+// normals into one register per component
+//-----------------------------------------------------------------------------
+
+#include "deform.h"
+#include "simd.h"
+#include "util.h"
+
+#include "mem.h"
+#define new mem_new
+
+namespace {
+	// Edges of a quad, used by autosprite2 to find the short sides
+	const int quad_edges[6][2] = {
+		{ 0, 1 }, { 0, 2 }, { 0, 3 }, { 1, 2 }, { 1, 3 }, { 2, 3 }
+	};
+
+	inline bool
+	same_wave(const wavefunc_t& a, const wavefunc_t& b)
+	{
+		return a.type == b.type && a.base == b.base && a.amplitude == b.amplitude &&
+			a.phase == b.phase && a.frequency == b.frequency;
+	}
+
+#ifdef USE_SSE2
+	inline void
+	load_positions(const vertex_t* v, __m128& x, __m128& y, __m128& z, __m128& w)
+		// Load the positions of four vertices, one component per register. w
+		// gets whatever follows the position so store_positions can write it
+		// back untouched
+	{
+		x = _mm_loadu_ps(&v[0].pos.x);
+		y = _mm_loadu_ps(&v[1].pos.x);
+		z = _mm_loadu_ps(&v[2].pos.x);
+		w = _mm_loadu_ps(&v[3].pos.x);
+		_MM_TRANSPOSE4_PS(x, y, z, w);
+	}
+
+	inline void
+	store_positions(vertex_t* v, __m128 x, __m128 y, __m128 z, __m128 w)
+	{
+		_MM_TRANSPOSE4_PS(x, y, z, w);
+		_mm_storeu_ps(&v[0].pos.x, x);
+		_mm_storeu_ps(&v[1].pos.x, y);
+		_mm_storeu_ps(&v[2].pos.x, z);
+		_mm_storeu_ps(&v[3].pos.x, w);
+	}
+
+	inline void
+	load_normals(const vertex_t* v, __m128& x, __m128& y, __m128& z)
+		// Load the normals of four vertices, one component per register
+	{
+#ifdef VERTEX_FULL_NORMALS
+		__m128 w;
+		x = _mm_loadu_ps(&v[0].normal.x);
+		y = _mm_loadu_ps(&v[1].normal.x);
+		z = _mm_loadu_ps(&v[2].normal.x);
+		w = _mm_loadu_ps(&v[3].normal.x);
+		_MM_TRANSPOSE4_PS(x, y, z, w);
+#else
+		const __m128i mask = _mm_set1_epi32(0x3ff);
+		const __m128 scale = _mm_set1_ps(2.0f / 1023.0f);
+		const __m128 one = _mm_set1_ps(1.0f);
+		__m128i packed = _mm_set_epi32(v[3].packed_normal, v[2].packed_normal, v[1].packed_normal, v[0].packed_normal);
+		x = _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(packed, mask)), scale), one);
+		y = _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(packed, 10), mask)), scale), one);
+		z = _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(packed, 20), mask)), scale), one);
+#endif
+	}
+
+	inline __m128
+	sample_waves(wave_type_t type, __m128 pos)
+		// Sample a periodic wave at four positions, there is no gather so the
+		// table is read one sample at a time
+	{
+		const float* table = wave_tables[type];
+		__m128i index = _mm_and_si128(
+			_mm_cvttps_epi32(_mm_mul_ps(pos, _mm_set1_ps(m_itof(WAVE_TABLE_SIZE)))),
+			_mm_set1_epi32(WAVE_TABLE_MASK)
+		);
+		int i[4];
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(i), index);
+		return _mm_set_ps(table[i[3]], table[i[2]], table[i[1]], table[i[0]]);
+	}
+#endif
+
+	void
+	deform_wave(const deform_t& deform, const deform_frame_t& frame, vertex_t* verts, int num_verts)
+		// Move each vertex along its normal by the wave, the phase is offset
+		// by the vertex position so the surface ripples
+	{
+		const wavefunc_t& wave = deform.wave;
+		int i = 0;
+#ifdef USE_SSE2
+		if (wave.type != WAVE_NOISE) {
+			const __m128 spread = _mm_set1_ps(deform.spread);
+			const __m128 phase = _mm_set1_ps(frame.phase);
+			const __m128 base = _mm_set1_ps(wave.base);
+			const __m128 amplitude = _mm_set1_ps(wave.amplitude);
+			for (; i + 4 <= num_verts; i += 4) {
+				__m128 x, y, z, w, nx, ny, nz;
+				load_positions(verts + i, x, y, z, w);
+				load_normals(verts + i, nx, ny, nz);
+				__m128 pos = _mm_add_ps(phase, _mm_mul_ps(_mm_add_ps(_mm_add_ps(x, y), z), spread));
+				__m128 scale = _mm_add_ps(base, _mm_mul_ps(amplitude, sample_waves(wave.type, pos)));
+				x = _mm_add_ps(x, _mm_mul_ps(nx, scale));
+				y = _mm_add_ps(y, _mm_mul_ps(ny, scale));
+				z = _mm_add_ps(z, _mm_mul_ps(nz, scale));
+				store_positions(verts + i, x, y, z, w);
+			}
+		}
+#endif
+		for (; i < num_verts; ++i) {
+			vertex_t& v = verts[i];
+			float offset = (v.pos.x + v.pos.y + v.pos.z) * deform.spread;
+			float scale;
+			if (wave.type == WAVE_NOISE)
+				scale = wave.base + wave.amplitude * wave_noise(frame.phase + offset * wave.frequency);
+			else
+				scale = wave.base + wave.amplitude * wave_sample(wave.type, frame.phase + offset);
+			v.pos += v.get_normal() * scale;
+		}
+	}
+
+	void
+	deform_bulge(const deform_t& deform, const deform_frame_t& frame, vertex_t* verts, int num_verts)
+		// Move each vertex along its normal by a sine wave running along the
+		// s texture coordinate
+	{
+		const float period = 1.0f / M_2PI;
+		int i = 0;
+#ifdef USE_SSE2
+		const __m128 width = _mm_set1_ps(deform.width * period);
+		const __m128 phase = _mm_set1_ps(frame.phase * period);
+		const __m128 height = _mm_set1_ps(deform.height);
+		for (; i + 4 <= num_verts; i += 4) {
+			const vertex_t* v = verts + i;
+			__m128 x, y, z, w, nx, ny, nz;
+			load_positions(v, x, y, z, w);
+			load_normals(v, nx, ny, nz);
+			__m128 s = _mm_set_ps(v[3].tc0.x, v[2].tc0.x, v[1].tc0.x, v[0].tc0.x);
+			__m128 scale = _mm_mul_ps(height, sample_waves(WAVE_SIN, _mm_add_ps(_mm_mul_ps(s, width), phase)));
+			x = _mm_add_ps(x, _mm_mul_ps(nx, scale));
+			y = _mm_add_ps(y, _mm_mul_ps(ny, scale));
+			z = _mm_add_ps(z, _mm_mul_ps(nz, scale));
+			store_positions(verts + i, x, y, z, w);
+		}
+#endif
+		for (; i < num_verts; ++i) {
+			vertex_t& v = verts[i];
+			float scale = deform.height * wave_sample(WAVE_SIN, (v.tc0.x * deform.width + frame.phase) * period);
+			v.pos += v.get_normal() * scale;
+		}
+	}
+
+	void
+	deform_move(const deform_t& deform, const deform_frame_t& frame, vertex_t* verts, int num_verts)
+		// Move every vertex by the same amount
+	{
+		vec3_t offset = deform.move * frame.value;
+		int i = 0;
+#ifdef USE_SSE2
+		const __m128 ox = _mm_set1_ps(offset.x);
+		const __m128 oy = _mm_set1_ps(offset.y);
+		const __m128 oz = _mm_set1_ps(offset.z);
+		for (; i + 4 <= num_verts; i += 4) {
+			__m128 x, y, z, w;
+			load_positions(verts + i, x, y, z, w);
+			store_positions(verts + i, _mm_add_ps(x, ox), _mm_add_ps(y, oy), _mm_add_ps(z, oz), w);
+		}
+#endif
+		for (; i < num_verts; ++i)
+			verts[i].pos += offset;
+	}
+
+	void
+	deform_normal(const deform_t& deform, const deform_frame_t& frame, vertex_t* verts, int num_verts)
+		// Wobble the normals with noise, only the normals change so this is
+		// left as plain C++
+	{
+		const float amplitude = deform.wave.amplitude;
+		for (int i = 0; i < num_verts; ++i) {
+			vertex_t& v = verts[i];
+			float pos = (v.pos.x + v.pos.y + v.pos.z) * 0.98f + frame.phase;
+			vec3_t n = v.get_normal();
+			n.x += amplitude * wave_noise(pos);
+			n.y += amplitude * wave_noise(pos + 100.0f);
+			n.z += amplitude * wave_noise(pos + 200.0f);
+			v.set_normal(n.normalize());
+		}
+	}
+
+	void
+	autosprite(const deform_view_t& view, vertex_t* verts, int num_verts, index_t* inds)
+		// Replace each quad with a square of the same size facing the viewer
+	{
+		for (int q = 0; q < num_verts; q += 4) {
+			vertex_t* v = verts + q;
+			vec3_t mid = (v[0].pos + v[1].pos + v[2].pos + v[3].pos) * 0.25f;
+			float radius = (v[0].pos - mid).length() * 0.707f;
+			vec3_t left = view.right * -radius;
+			vec3_t up = view.up * radius;
+			vec3_t normal = -view.forward;
+
+			v[0].pos = mid + left + up;
+			v[1].pos = mid - left + up;
+			v[2].pos = mid - left - up;
+			v[3].pos = mid + left - up;
+			v[0].tc0 = vec2_t(0.0f, 0.0f);
+			v[1].tc0 = vec2_t(1.0f, 0.0f);
+			v[2].tc0 = vec2_t(1.0f, 1.0f);
+			v[3].tc0 = vec2_t(0.0f, 1.0f);
+			for (int j = 0; j < 4; ++j)
+				v[j].set_normal(normal);
+
+			index_t* ind = inds + q / 4 * 6;
+			ind[0] = static_cast<index_t>(q);
+			ind[1] = static_cast<index_t>(q + 1);
+			ind[2] = static_cast<index_t>(q + 3);
+			ind[3] = static_cast<index_t>(q + 3);
+			ind[4] = static_cast<index_t>(q + 1);
+			ind[5] = static_cast<index_t>(q + 2);
+		}
+	}
+
+	void
+	autosprite2(const deform_view_t& view, vertex_t* verts, int num_verts, const index_t* inds)
+		// Turn each quad around the line joining the middles of its two short
+		// sides so it faces the viewer as much as it can, used for beams
+	{
+		for (int q = 0; q < num_verts; q += 4) {
+			vertex_t* v = verts + q;
+
+			// Find the two shortest edges
+			int nums[2] = { 0, 0 };
+			float lengths[2] = { 999999.0f, 999999.0f };
+			for (int e = 0; e < 6; ++e) {
+				vec3_t edge = v[quad_edges[e][0]].pos - v[quad_edges[e][1]].pos;
+				float l = dot(edge, edge);
+				if (l < lengths[0]) {
+					nums[1] = nums[0];
+					lengths[1] = lengths[0];
+					nums[0] = e;
+					lengths[0] = l;
+				} else if (l < lengths[1]) {
+					nums[1] = e;
+					lengths[1] = l;
+				}
+			}
+
+			vec3_t mid[2];
+			for (int j = 0; j < 2; ++j)
+				mid[j] = (v[quad_edges[nums[j]][0]].pos + v[quad_edges[nums[j]][1]].pos) * 0.5f;
+
+			// The minor axis is across both the long axis and the view
+			vec3_t minor = cross(mid[1] - mid[0], view.forward);
+			float minor_length = minor.length();
+			if (minor_length == 0.0f)
+				continue;	// Looking straight down the beam
+			minor /= minor_length;
+
+			// Put the short edges back across the minor axis, keeping the
+			// winding the quad's triangles use
+			const index_t* ind = inds + q / 4 * 6;
+			for (int k = 0; k < 2; ++k) {
+				int v1 = quad_edges[nums[k]][0];
+				int v2 = quad_edges[nums[k]][1];
+				float l = 0.5f * m_sqrt(lengths[k]);
+				bool forwards = false;
+				for (int i = 0; i < 5; ++i)
+					if (ind[i] == q + v1 && ind[i + 1] == q + v2)
+						forwards = true;
+				if (forwards)
+					l = -l;
+				v[v1].pos = mid[k] + minor * l;
+				v[v2].pos = mid[k] - minor * l;
+			}
+		}
+	}
+}
+
+bool
+deform_t::operator==(const deform_t& d) const
+	// Deforms are equal if they would move vertices in the same way
+{
+	if (type != d.type)
+		return false;
+	switch (type) {
+	case DEFORM_WAVE:
+		return spread == d.spread && same_wave(wave, d.wave);
+	case DEFORM_MOVE:
+		return move == d.move && same_wave(wave, d.wave);
+	case DEFORM_NORMAL:
+		return wave.amplitude == d.wave.amplitude && wave.frequency == d.wave.frequency;
+	case DEFORM_BULGE:
+		return width == d.width && height == d.height && speed == d.speed;
+	default:
+		return true;
+	}
+}
+
+void
+prepare_deform(const deform_t& deform, float time, deform_frame_t& frame)
+{
+	const wavefunc_t& wave = deform.wave;
+	switch (deform.type) {
+	case DEFORM_WAVE:
+		if (wave.type == WAVE_NOISE)
+			frame.phase = (time + wave.phase) * wave.frequency;
+		else
+			frame.phase = time * wave.frequency + wave.phase;
+		break;
+	case DEFORM_NORMAL:
+		frame.phase = time * wave.frequency;
+		break;
+	case DEFORM_BULGE:
+		frame.phase = time * deform.speed;
+		break;
+	default:
+		break;
+	}
+}
+
+void
+apply_deform(const deform_t& deform, const deform_frame_t& frame, const deform_view_t& view,
+	vertex_t* verts, int num_verts, index_t* inds, int num_inds)
+{
+	switch (deform.type) {
+	case DEFORM_WAVE:
+		deform_wave(deform, frame, verts, num_verts);
+		break;
+	case DEFORM_NORMAL:
+		deform_normal(deform, frame, verts, num_verts);
+		break;
+	case DEFORM_BULGE:
+		deform_bulge(deform, frame, verts, num_verts);
+		break;
+	case DEFORM_MOVE:
+		deform_move(deform, frame, verts, num_verts);
+		break;
+	case DEFORM_AUTOSPRITE:
+	case DEFORM_AUTOSPRITE2:
+		// Only faces made entirely of quads can be turned into sprites
+		if (num_verts % 4 != 0 || num_inds != num_verts / 4 * 6 || inds == 0)
+			break;
+		if (deform.type == DEFORM_AUTOSPRITE)
+			autosprite(view, verts, num_verts, inds);
+		else
+			autosprite2(view, verts, num_verts, inds);
+		break;
+	}
+}
+
+namespace {
+	inline void
+	base_texcoord(const tcgen_t& tcgen, const deform_view_t& view, const vertex_t& v, float& s, float& t)
+		// Texture coordinate before the tcmods
+	{
+		switch (tcgen.type) {
+		case TCGEN_BASE:
+			s = v.tc0.x;
+			t = v.tc0.y;
+			break;
+		case TCGEN_LIGHTMAP:
+			s = v.tc1.x;
+			t = v.tc1.y;
+			break;
+		case TCGEN_ENVIRONMENT: {
+			vec3_t viewer = normalize(view.origin - v.pos);
+			vec3_t normal = v.get_normal();
+			vec3_t reflected = normal * (2.0f * dot(normal, viewer)) - viewer;
+			s = 0.5f - reflected.z * 0.5f;
+			t = 0.5f - reflected.y * 0.5f;
+			break;
+		}
+		case TCGEN_VECTOR:
+			s = dot(v.pos, tcgen.s);
+			t = dot(v.pos, tcgen.t);
+			break;
+		}
+	}
+
+#ifdef USE_SSE2
+	void
+	base_texcoords(const tcgen_t& tcgen, const deform_view_t& view, const vertex_t* v,
+		__m128 x, __m128 y, __m128 z, __m128& s, __m128& t)
+		// Texture coordinates of four vertices before the tcmods
+	{
+		switch (tcgen.type) {
+		case TCGEN_BASE:
+			s = _mm_set_ps(v[3].tc0.x, v[2].tc0.x, v[1].tc0.x, v[0].tc0.x);
+			t = _mm_set_ps(v[3].tc0.y, v[2].tc0.y, v[1].tc0.y, v[0].tc0.y);
+			break;
+		case TCGEN_LIGHTMAP:
+			s = _mm_set_ps(v[3].tc1.x, v[2].tc1.x, v[1].tc1.x, v[0].tc1.x);
+			t = _mm_set_ps(v[3].tc1.y, v[2].tc1.y, v[1].tc1.y, v[0].tc1.y);
+			break;
+		case TCGEN_ENVIRONMENT: {
+			__m128 nx, ny, nz;
+			load_normals(v, nx, ny, nz);
+			__m128 vx = _mm_sub_ps(_mm_set1_ps(view.origin.x), x);
+			__m128 vy = _mm_sub_ps(_mm_set1_ps(view.origin.y), y);
+			__m128 vz = _mm_sub_ps(_mm_set1_ps(view.origin.z), z);
+			__m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz)));
+			vx = _mm_div_ps(vx, length);
+			vy = _mm_div_ps(vy, length);
+			vz = _mm_div_ps(vz, length);
+			__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, vx), _mm_mul_ps(ny, vy)), _mm_mul_ps(nz, vz));
+			d = _mm_add_ps(d, d);
+			const __m128 half = _mm_set1_ps(0.5f);
+			s = _mm_sub_ps(half, _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(nz, d), vz), half));
+			t = _mm_sub_ps(half, _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(ny, d), vy), half));
+			break;
+		}
+		case TCGEN_VECTOR:
+			s = _mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(x, _mm_set1_ps(tcgen.s.x)),
+				_mm_mul_ps(y, _mm_set1_ps(tcgen.s.y))),
+				_mm_mul_ps(z, _mm_set1_ps(tcgen.s.z)));
+			t = _mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(x, _mm_set1_ps(tcgen.t.x)),
+				_mm_mul_ps(y, _mm_set1_ps(tcgen.t.y))),
+				_mm_mul_ps(z, _mm_set1_ps(tcgen.t.z)));
+			break;
+		}
+	}
+#endif
+
+	// Turbulence moves the coordinates by a sine of the position, one period
+	// every 1024 units
+	const float TURB_SCALE = 1.0f / 1024.0f;
+}
+
+void
+generate_texcoords(const tcgen_t& tcgen, const deform_view_t& view,
+	const vertex_t* src, vertex_t* dst, int count)
+{
+	u_memcpy(dst, src, count * sizeof(vertex_t));
+
+	int i = 0;
+#ifdef USE_SSE2
+	const __m128 turb_scale = _mm_set1_ps(TURB_SCALE);
+	for (; i + 4 <= count; i += 4) {
+		__m128 x, y, z, w, s, t;
+		load_positions(src + i, x, y, z, w);
+		base_texcoords(tcgen, view, src + i, x, y, z, s, t);
+
+		for (int j = 0; j < tcgen.num_steps; ++j) {
+			const tcgen_step_t& step = tcgen.steps[j];
+			if (step.turb) {
+				__m128 amplitude = _mm_set1_ps(step.amplitude);
+				__m128 phase = _mm_set1_ps(step.phase);
+				__m128 s_pos = _mm_add_ps(_mm_mul_ps(_mm_add_ps(x, y), turb_scale), phase);
+				__m128 t_pos = _mm_sub_ps(phase, _mm_mul_ps(z, turb_scale));
+				s = _mm_add_ps(s, _mm_mul_ps(amplitude, sample_waves(WAVE_SIN, s_pos)));
+				t = _mm_add_ps(t, _mm_mul_ps(amplitude, sample_waves(WAVE_SIN, t_pos)));
+			} else {
+				__m128 ns = _mm_add_ps(_mm_add_ps(
+					_mm_mul_ps(s, _mm_set1_ps(step.m00)),
+					_mm_mul_ps(t, _mm_set1_ps(step.m10))),
+					_mm_set1_ps(step.m20));
+				t = _mm_add_ps(_mm_add_ps(
+					_mm_mul_ps(s, _mm_set1_ps(step.m01)),
+					_mm_mul_ps(t, _mm_set1_ps(step.m11))),
+					_mm_set1_ps(step.m21));
+				s = ns;
+			}
+		}
+
+		// Interleave the coordinates back into s, t pairs
+		_mm_storel_pi(reinterpret_cast<__m64*>(&dst[i].tc0.x), _mm_unpacklo_ps(s, t));
+		_mm_storeh_pi(reinterpret_cast<__m64*>(&dst[i + 1].tc0.x), _mm_unpacklo_ps(s, t));
+		_mm_storel_pi(reinterpret_cast<__m64*>(&dst[i + 2].tc0.x), _mm_unpackhi_ps(s, t));
+		_mm_storeh_pi(reinterpret_cast<__m64*>(&dst[i + 3].tc0.x), _mm_unpackhi_ps(s, t));
+	}
+#endif
+	for (; i < count; ++i) {
+		const vertex_t& v = src[i];
+		float s, t;
+		base_texcoord(tcgen, view, v, s, t);
+		for (int j = 0; j < tcgen.num_steps; ++j) {
+			const tcgen_step_t& step = tcgen.steps[j];
+			if (step.turb) {
+				s += step.amplitude * wave_sample(WAVE_SIN, (v.pos.x + v.pos.y) * TURB_SCALE + step.phase);
+				t += step.amplitude * wave_sample(WAVE_SIN, step.phase - v.pos.z * TURB_SCALE);
+			} else {
+				float ns = s * step.m00 + t * step.m10 + step.m20;
+				t = s * step.m01 + t * step.m11 + step.m21;
+				s = ns;
+			}
+		}
+		dst[i].tc0.x = s;
+		dst[i].tc0.y = t;
+	}
+}
@@ -0,0 +1,103 @@
+//-----------------------------------------------------------------------------
+// File: deform.h
+//
+// Vertex deforms (deformVertexes in shaders) and texture coordinate generation
+// (tcGen and tcMod turb). These are done on the CPU for faces whose vertices
+// have been copied into the display list, see d3d_t::deform_list and
+// d3d_t::draw_face
+//-----------------------------------------------------------------------------
+
+#ifndef DEFORM_H
+#define DEFORM_H
+
+#include "displaylist.h"
+#include "wave.h"
+
+// Most deforms a single shader can have
+#define MAX_SHADER_DEFORMS	3
+
+// Most steps in a generated texture coordinate's tcmods, consecutive affine
+// tcmods are combined so there is at most one step per tcmod
+#define MAX_TCGEN_STEPS		3
+
+enum deform_type_t {
+	DEFORM_WAVE,		// Move along the normal, phase offset by position
+	DEFORM_NORMAL,		// Wobble the normals
+	DEFORM_BULGE,		// Move along the normal with a sine of the s coord
+	DEFORM_MOVE,		// Move every vertex by the same amount
+	DEFORM_AUTOSPRITE,	// Turn each quad to face the viewer
+	DEFORM_AUTOSPRITE2	// Turn each quad around its long axis to face the viewer
+};
+
+struct deform_t {
+	// A single deformVertexes line from a shader
+	deform_type_t	type;
+	wavefunc_t		wave;		// wave and move, normal uses amplitude and frequency
+	float			spread;		// wave, phase change per unit of x + y + z
+	float			width;		// bulge
+	float			height;		// bulge
+	float			speed;		// bulge
+	vec3_t			move;		// move, direction and distance for a value of 1
+
+	bool operator==(const deform_t& d) const;
+};
+
+struct deform_frame_t {
+	// The time dependent part of a deform, worked out once per frame and
+	// shared by every face using the deform
+	int		frame;			// Frame these were worked out for
+	float	phase;			// wave, bulge and normal, position in the wave
+	float	value;			// move, current value of the wave, set by the caller
+};
+
+struct deform_view_t {
+	// Camera position and axes in world space, used to turn the sprites and
+	// for environment mapping
+	vec3_t	origin;
+	vec3_t	right;
+	vec3_t	up;
+	vec3_t	forward;
+};
+
+// Work out the part of a deform that is the same for every vertex. The wave
+// of a move is evaluated with the shader's other waves so isn't set here
+void prepare_deform(const deform_t& deform, float time, deform_frame_t& frame);
+
+// Deform a face's vertices in place. The sprite deforms also rewrite the
+// indices, they expect a face made of quads of 4 vertices and 6 indices
+void apply_deform(const deform_t& deform, const deform_frame_t& frame, const deform_view_t& view,
+	vertex_t* verts, int num_verts, index_t* inds, int num_inds);
+
+enum tcgen_type_t {
+	TCGEN_BASE,			// tc0
+	TCGEN_LIGHTMAP,		// tc1
+	TCGEN_ENVIRONMENT,	// Reflection of the view direction
+	TCGEN_VECTOR		// Position projected onto two vectors
+};
+
+struct tcgen_step_t {
+	// One step in working out a texture coordinate, either an affine transform
+	// (s, t, 1) * m or turbulence
+	bool	turb;
+	float	m00, m01;
+	float	m10, m11;
+	float	m20, m21;
+	float	amplitude;	// turb
+	float	phase;		// turb, position in the wave this frame
+};
+
+struct tcgen_t {
+	// How to generate the texture coordinates of a pass for the current frame
+	tcgen_type_t	type;
+	vec3_t			s;			// vector
+	vec3_t			t;			// vector
+	int				num_steps;
+	tcgen_step_t	steps[MAX_TCGEN_STEPS];
+};
+
+// Copy count vertices from src to dst, replacing tc0 with the generated
+// texture coordinates
+void generate_texcoords(const tcgen_t& tcgen, const deform_view_t& view,
+	const vertex_t* src, vertex_t* dst, int count);
+
+#endif
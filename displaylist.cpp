@@ -6,73 +6,419 @@
 
 #include "displaylist.h"
 #include "console.h"
+#include "d3d.h"
+#include "exec.h"
 #include "util.h"
+#include "win.h"
 
 #include "mem.h"
 #define new mem_new
 
+struct dl_page_t {
+	// Page header, the page data follows directly after
+	dl_page_t*	next;		// Next page in the list or pool
+	int		size;		// Size of the page data in bytes
+	int		pad;		// Keeps the page data 16 byte aligned in 32 bit builds
+	int		pad2;
+
+	ubyte* data() { return reinterpret_cast<ubyte*>(this + 1); }
+};
+
+namespace {
+
+	class page_pool_t {
+		// Pages not currently in use by any display list. The display lists on
+		// the job threads take pages at the same time, so the pool is locked
+	public:
+		typedef dl_page_t page_t;
+
+		page_pool_t() : free_pages(0), pages_allocated(0), bytes_allocated(0),
+			pages_in_use(0), peak_pages_in_use(0), allocations(0) {}
+		~page_pool_t();
+
+		page_t* acquire(int size);
+		void release(page_t* list);
+
+		page_t*	free_pages;
+		critical_section_t lock;
+
+		// Statistics
+		int		pages_allocated;	// Pages ever allocated
+		int		bytes_allocated;	// Size of those pages
+		int		pages_in_use;		// Pages held by display lists now
+		int		peak_pages_in_use;	// High water mark for pages_in_use
+		int		allocations;		// Pages allocated since the last dlstats
+	};
+
+	// File scope so it outlives the display lists owned by the singletons
+	page_pool_t page_pool;
+
+	page_pool_t::~page_pool_t()
+	{
+		while (free_pages) {
+			page_t* next = free_pages->next;
+			delete [] reinterpret_cast<ubyte*>(free_pages);
+			free_pages = next;
+		}
+	}
+
+	page_pool_t::page_t*
+	page_pool_t::acquire(int size)
+		// Take a page of at least size bytes from the pool, only allocating a
+		// new one if there is none big enough
+	{
+		lock.enter();
+		page_t** link = &free_pages;
+		while (*link && (*link)->size < size)
+			link = &(*link)->next;
+		page_t* page = *link;
+		if (page) {
+			*link = page->next;
+		} else {
+			size = u_max(size, DL_PAGE_SIZE);
+			page = reinterpret_cast<page_t*>(new ubyte[sizeof(page_t) + size]);
+			page->size = size;
+			++pages_allocated;
+			bytes_allocated += size;
+			++allocations;
+		}
+		page->next = 0;
+		peak_pages_in_use = u_max(peak_pages_in_use, ++pages_in_use);
+		lock.leave();
+		return page;
+	}
+
+	void
+	page_pool_t::release(page_t* list)
+		// Return a list of pages to the pool
+	{
+		if (list == 0)
+			return;
+		int count = 1;
+		page_t* last = list;
+		for (; last->next; last = last->next)
+			++count;
+		lock.enter();
+		last->next = free_pages;
+		free_pages = list;
+		pages_in_use -= count;
+		lock.leave();
+	}
+
+	cvstr_t
+	dlstats_callback(int argc, cvstr_t* argv)
+	{
+		display_list_t::print_stats();
+		return cvstr_t();
+	}
+
+	cfunc_t cf_dlstats("dlstats", dlstats_callback, 0, 0);
+
+	// Scratch space for sorting, only ever used from the main thread
+	struct sort_scratch_t {
+		sort_scratch_t() : size(0), keys(0), temp_keys(0), temp_order(0) {}
+		~sort_scratch_t() { delete [] keys; delete [] temp_keys; delete [] temp_order; }
+
+		void reserve(int count)
+		{
+			if (count <= size)
+				return;
+			delete [] keys;
+			delete [] temp_keys;
+			delete [] temp_order;
+			size = u_max(count, size * 2);
+			keys = new uint64[size];
+			temp_keys = new uint64[size];
+			temp_order = new int[size];
+		}
+
+		int size;
+		uint64* keys;
+		uint64* temp_keys;
+		int* temp_order;
+	} scratch;
+
+	inline uint64
+	make_sort_key(int sort, hshader_t shader, htexture_t lightmap, uint depth = 0)
+		// Build a sort key, see displaylist.h for the layout
+	{
+		if (sort <= SORT_OPAQUE) {
+			return (static_cast<uint64>(sort & 0xff) << 56) |
+				(static_cast<uint64>(shader & 0xffff) << 40) |
+				(static_cast<uint64>(lightmap & 0xffff) << 24);
+		} else {
+			return (static_cast<uint64>(sort & 0xff) << 56) |
+				(static_cast<uint64>(0xffffff - (depth & 0xffffff)) << 32) |
+				(static_cast<uint64>(shader & 0xffff) << 16) |
+				static_cast<uint64>(lightmap & 0xffff);
+		}
+	}
+}
+
+template <class V>
 void
-display_list_t::clear()
+basic_display_list_t<V>::set_depth(face_type* face, float depth)
 {
-	int vused = next_vertex - verts;
-	int iused = next_index - inds;
-	int fused = next_face - faces;
-	next_vertex = verts;
-	next_index = inds;
-	next_face = faces;
+	int sort = d3d.get_sort(face->shader);
+	if (sort <= SORT_OPAQUE)
+		return;	// Opaque faces stay sorted by state
+	depth = u_max(0.0f, u_min(depth, MAX_SORT_DEPTH));
+	uint quantized = static_cast<uint>(depth * (0xffffff / MAX_SORT_DEPTH));
+	face->sort_key = make_sort_key(sort, face->shader, face->lightmap, quantized);
+	num_sorted = -1;
 }
 
-vertex_t*
-display_list_t::grow_verts(int count)
-	// Increase the size of the vertex buffer for the last face allocated
-	// and return a pointer to the first of the newly allocated vertices
+template <class V>
+basic_display_list_t<V>::basic_display_list_t() :
+	pages(0),
+	face_pages(0),
+	max_face_pages(0),
+	next_vertex(0),
+	end_vertex(0),
+	next_index(0),
+	end_index(0),
+	last_face(0),
+	faces_used(0),
+	verts_used(0),
+	inds_used(0),
+	sorted(0),
+	max_sorted(0),
+	num_sorted(-1)
 {
-	if (next_vertex + count >= max_vertex())
+}
+
+template <class V>
+basic_display_list_t<V>::~basic_display_list_t()
+{
+	clear();
+	delete [] face_pages;
+	delete [] sorted;
+}
+
+template <class V>
+void
+basic_display_list_t<V>::clear()
+	// Give all the pages back to the pool
+{
+	page_pool.release(pages);
+	pages = 0;
+	next_vertex = end_vertex = 0;
+	next_index = end_index = 0;
+	last_face = 0;
+	faces_used = 0;
+	verts_used = 0;
+	inds_used = 0;
+	num_sorted = -1;
+}
+
+template <class V>
+void
+basic_display_list_t<V>::print_stats()
+{
+	console.printf("Display list pages: %d allocated (%dk), %d in use, %d peak, %d new since last dlstats\n",
+		page_pool.pages_allocated,
+		page_pool.bytes_allocated / 1024,
+		page_pool.pages_in_use,
+		page_pool.peak_pages_in_use,
+		page_pool.allocations
+	);
+	page_pool.allocations = 0;
+}
+
+template <class V>
+dl_page_t*
+basic_display_list_t<V>::new_page(int size)
+	// Take a page of at least size bytes from the pool and add it to this list
+{
+	dl_page_t* page = page_pool.acquire(size);
+	page->next = pages;
+	pages = page;
+	return page;
+}
+
+template <class V>
+V*
+basic_display_list_t<V>::alloc_verts(int count)
+{
+	if (count == 0)
 		return 0;
-	vertex_t* v = next_vertex;
+	if (end_vertex - next_vertex < count) {
+		dl_page_t* page = new_page(count * sizeof(V));
+		next_vertex = reinterpret_cast<V*>(page->data());
+		end_vertex = next_vertex + page->size / sizeof(V);
+	}
+	V* v = next_vertex;
 	next_vertex += count;
-	(next_face - 1)->num_verts += count;
+	verts_used += count;
 	return v;
 }
 
+template <class V>
 index_t*
-display_list_t::grow_inds(int count)
-	// Increase the size of the index buffer for the last face allocated
-	// and return a pointer to the first of the newly allocated indices
+basic_display_list_t<V>::alloc_inds(int count)
 {
-	if (next_index + count >= max_index())
+	if (count == 0)
 		return 0;
+	if (end_index - next_index < count) {
+		dl_page_t* page = new_page(count * sizeof(index_t));
+		next_index = reinterpret_cast<index_t*>(page->data());
+		end_index = next_index + page->size / sizeof(index_t);
+	}
 	index_t* i = next_index;
 	next_index += count;
-	(next_face - 1)->num_inds += count;
+	inds_used += count;
 	return i;
 }
 
-face_t*
-display_list_t::get_face(hshader_t shader, htexture_t lightmap, int num_verts, int num_inds) 
+template <class V>
+void
+basic_display_list_t<V>::sort()
 {
-	if (next_vertex + num_verts >= max_vertex()) {
-		console.warn("display_list_t::get_face(): vertex buffer full\n");
-		return 0;
+	int count = num_faces();
+	if (count == num_sorted)
+		return;		// Faces are only ever added, so nothing has changed
+	if (count > max_sorted) {
+		delete [] sorted;
+		max_sorted = u_max(count, max_sorted * 2);
+		sorted = new int[max_sorted];
 	}
-	if (next_index + num_inds >= max_index()) {
-		console.warn("display_list_t::get_face(): index buffer full\n");
-		return 0;
+	scratch.reserve(count);
+	for (int i = 0; i < count; ++i) {
+		scratch.keys[i] = face(i).sort_key;
+		sorted[i] = i;
 	}
-	if (next_face == max_face()) {
-		console.warn("display_list_t::get_face(): face buffer full\n");
-		return 0;
+	u_radix_sort(scratch.keys, sorted, scratch.temp_keys, scratch.temp_order, count);
+	num_sorted = count;
+}
+
+template <class V>
+V*
+basic_display_list_t<V>::grow_verts(int count)
+	// Increase the size of the vertex buffer for the last face allocated
+	// and return a pointer to the first of the newly allocated vertices
+{
+	face_type* face = last_face;
+	if (face->verts && face->verts + face->num_verts == next_vertex && end_vertex - next_vertex >= count) {
+		next_vertex += count;
+		verts_used += count;
+	} else {
+		// Move the vertices to a page with room for them all
+		V* verts = alloc_verts(face->num_verts + count);
+		verts_used -= face->num_verts;
+		if (face->num_verts)
+			u_memcpy(verts, face->verts, face->num_verts * sizeof(V));
+		face->verts = verts;
+	}
+	face->num_verts += count;
+	return face->verts + face->num_verts - count;
+}
+
+template <class V>
+index_t*
+basic_display_list_t<V>::grow_inds(int count)
+	// Increase the size of the index buffer for the last face allocated
+	// and return a pointer to the first of the newly allocated indices
+{
+	face_type* face = last_face;
+	if (face->inds && face->inds + face->num_inds == next_index && end_index - next_index >= count) {
+		next_index += count;
+		inds_used += count;
+	} else {
+		// Move the indices to a page with room for them all
+		index_t* inds = alloc_inds(face->num_inds + count);
+		inds_used -= face->num_inds;
+		if (face->num_inds)
+			u_memcpy(inds, face->inds, face->num_inds * sizeof(index_t));
+		face->inds = inds;
 	}
-	next_face->shader = shader;
-	next_face->lightmap = lightmap;
-	next_face->num_verts = num_verts;
-	next_face->num_inds = num_inds;
-	next_face->verts = num_verts ? next_vertex : 0;
-	next_face->inds = num_inds ? next_index : 0;
-	next_face->base_vert = next_vertex - verts;
-	next_face->base_ind = next_index - inds;
-	next_vertex += num_verts;
-	next_index += num_inds;
-
-	return next_face++;
+	face->num_inds += count;
+	return face->inds + face->num_inds - count;
 }
+
+template <class V>
+void
+basic_display_list_t<V>::shrink_verts(int count)
+{
+	if (last_face->verts + last_face->num_verts == next_vertex)
+		next_vertex -= count;
+	verts_used -= count;
+	last_face->num_verts -= count;
+}
+
+template <class V>
+void
+basic_display_list_t<V>::shrink_inds(int count)
+{
+	if (last_face->inds + last_face->num_inds == next_index)
+		next_index -= count;
+	inds_used -= count;
+	last_face->num_inds -= count;
+}
+
+template <class V>
+typename basic_display_list_t<V>::face_type*
+basic_display_list_t<V>::get_face(hshader_t shader, htexture_t lightmap, int num_verts, int num_inds)
+	// Allocate a face, along with space for its vertices and indices
+{
+	int page = faces_used / FACES_PER_PAGE;
+	if (faces_used % FACES_PER_PAGE == 0) {
+		if (page == max_face_pages) {
+			// Grow the table of face pages
+			int size = u_max(16, max_face_pages * 2);
+			face_type** table = new face_type*[size];
+			for (int i = 0; i < max_face_pages; ++i)
+				table[i] = face_pages[i];
+			delete [] face_pages;
+			face_pages = table;
+			max_face_pages = size;
+		}
+		face_pages[page] = reinterpret_cast<face_type*>(new_page(FACES_PER_PAGE * sizeof(face_type))->data());
+	}
+	face_type* face = face_pages[page] + faces_used % FACES_PER_PAGE;
+	++faces_used;
+
+	face->sort_key = make_sort_key(d3d.get_sort(shader), shader, lightmap);
+	face->shader = shader;
+	face->lightmap = lightmap;
+	face->num_verts = num_verts;
+	face->num_inds = num_inds;
+	face->base_vert = verts_used;
+	face->base_ind = inds_used;
+	face->verts = alloc_verts(num_verts);
+	face->inds = alloc_inds(num_inds);
+
+	last_face = face;
+	return face;
+}
+
+template <class V>
+void
+basic_display_list_t<V>::append(const basic_display_list_t& src)
+	// Faces with their own vertices or indices get copies of them, faces
+	// referencing the static buffers (verts or inds of 0) have base_vert and
+	// base_ind left untouched as they are not offsets into src
+{
+	int vbase = verts_used;
+	int ibase = inds_used;
+	for (int i = 0; i < src.num_faces(); ++i) {
+		const face_type& from = src.face(i);
+		face_type* to = get_face(from.shader, from.lightmap, from.verts ? from.num_verts : 0, from.inds ? from.num_inds : 0);
+		V* verts = to->verts;
+		index_t* inds = to->inds;
+		*to = from;
+		if (from.verts) {
+			u_memcpy(verts, from.verts, from.num_verts * sizeof(V));
+			to->verts = verts;
+			to->base_vert = from.base_vert + vbase;
+		}
+		if (from.inds) {
+			u_memcpy(inds, from.inds, from.num_inds * sizeof(index_t));
+			to->inds = inds;
+			to->base_ind = from.base_ind + ibase;
+		}
+	}
+}
+
+// The vertex layouts display lists are built for
+template class basic_display_list_t<vertex_t>;
+template class basic_display_list_t<ui_vertex_t>;
@@ -9,24 +9,89 @@
 
 #include "maths.h"
 
-#define MAX_VERTICES	65000
-#define MAX_INDICES		65000
-#define MAX_FACES		20000
-
+// Size in bytes of the pages display lists are built from, anything that
+// needs more than this in one piece gets a page of its own
+#define DL_PAGE_SIZE	65536
+
+// Vertex layouts. Each display list is built for a single layout and the
+// renderer picks the matching vertex format, see vertex_format_t in d3d.h
+
+// World vertices, the layout used by the bsp and the static vertex buffer.
+// Lighting is done with lightmaps so the normal is only needed on the CPU.
+// Unless VERTEX_FULL_NORMALS is defined it is packed into 10:10:10 bits and
+// carried in the specular colour, which the pipeline ignores as specular
+// lighting is never enabled. This takes the vertex from 44 to 36 bytes
 struct vertex_t {
 	vec3_t pos;
+#ifdef VERTEX_FULL_NORMALS
 	vec3_t normal;
+#endif
 	color_t diffuse;
+#ifndef VERTEX_FULL_NORMALS
+	uint packed_normal;
+#endif
 	vec2_t tc0;
 	vec2_t tc1;
+
+	vec3_t get_normal() const;
+	void set_normal(const vec3_t& n);
+};
+
+inline vec3_t
+vertex_t::get_normal() const
+{
+#ifdef VERTEX_FULL_NORMALS
+	return normal;
+#else
+	return vec3_t(
+		m_itof(packed_normal & 0x3ff) * (2.0f / 1023.0f) - 1.0f,
+		m_itof((packed_normal >> 10) & 0x3ff) * (2.0f / 1023.0f) - 1.0f,
+		m_itof((packed_normal >> 20) & 0x3ff) * (2.0f / 1023.0f) - 1.0f
+	);
+#endif
+}
+
+inline void
+vertex_t::set_normal(const vec3_t& n)
+{
+#ifdef VERTEX_FULL_NORMALS
+	normal = n;
+#else
+	packed_normal =
+		m_ftoi(m_clamp(n.x * 0.5f + 0.5f) * 1023.0f + 0.5f) |
+		(m_ftoi(m_clamp(n.y * 0.5f + 0.5f) * 1023.0f + 0.5f) << 10) |
+		(m_ftoi(m_clamp(n.z * 0.5f + 0.5f) * 1023.0f + 0.5f) << 20);
+#endif
+}
+
+// Vertices for the console and text, 24 bytes
+struct ui_vertex_t {
+	vec3_t pos;
+	color_t diffuse;
+	vec2_t tc0;
 };
 
 typedef ushort index_t;
 
-struct face_t {
+// Faces are drawn in order of their sort key. From the most significant bits
+// down the key holds the shader sort order (8 bits), then for opaque sorts
+// the shader (16 bits), lightmap (16 bits) and 24 unused bits. Translucent
+// sorts instead put the depth (24 bits, inverted so the furthest face comes
+// first) ahead of the shader and lightmap, so they draw back to front
+
+// Depths are clamped to this range when quantized into the sort key
+#define MAX_SORT_DEPTH	16384.0f
+
+// A face with no vertices of its own uses the static vertex buffer starting at
+// base_vert. A face with no indices of its own uses the static index buffer
+// starting at base_ind, static indices are absolute vertex numbers (either 16
+// or 32 bit depending on the map) while a face's own indices are relative to
+// its first vertex and always fit in an index_t
+struct face_base_t {
+	// The parts of a face that don't depend on the vertex layout
+	uint64 sort_key;
 	hshader_t shader;
 	htexture_t lightmap;
-	vertex_t* verts;
 	index_t* inds;
 	int num_verts;
 	int num_inds;
@@ -34,56 +99,107 @@ struct face_t {
 	int base_ind;
 };
 
-class display_list_t {
+template <class V>
+struct basic_face_t : public face_base_t {
+	V* verts;
+};
+
+typedef basic_face_t<vertex_t> face_t;
+typedef basic_face_t<ui_vertex_t> ui_face_t;
+
+// Page header, defined in displaylist.cpp
+struct dl_page_t;
+
+template <class V>
+class basic_display_list_t {
 	// A display list, all the visible objects get tesselated into this list
-	// each frame, the list is then sent to the renderer to be shown on screen
+	// each frame, the list is then sent to the renderer to be shown on screen.
+	// The list is built from pages taken from a pool shared by every display
+	// list, so it grows as needed and gives its pages back when cleared. Pages
+	// are never moved once written, so pointers returned by get_face remain
+	// valid until the list is cleared. The only instantiations are
+	// display_list_t and ui_display_list_t, see the end of displaylist.cpp
 public:
-	display_list_t() : next_vertex(verts), next_index(inds), next_face(faces) {}
+	typedef V vertex_type;
+	typedef basic_face_t<V> face_type;
+
+	basic_display_list_t();
+	~basic_display_list_t();
 
 	void clear();
-	face_t* get_face(hshader_t shader, htexture_t lightmap, int num_verts, int num_inds = 0);
 
-	// Return the beginning of the various buffers
-	face_t* face_buffer()		{ return faces; }
-	vertex_t* vertex_buffer()	{ return verts; }
-	index_t* index_buffer()		{ return inds; }
+	// Fill in the list of face indices ordered by sort key, does nothing if
+	// the list hasn't changed since it was last sorted
+	void sort();
+	const int* sorted_faces() const { return sorted; }
+
+	face_type* get_face(hshader_t shader, htexture_t lightmap, int num_verts, int num_inds = 0);
+
+	// Set the view depth of a face, this only affects the order of faces with
+	// translucent sort orders which are drawn back to front
+	void set_depth(face_type* face, float depth);
 
-	// Return the end of the various buffers, the value at this point is NOT
-	// a valid whatever. Iteration over all the faces would take the form:
-	// for (face_t* f = face_buffer(); f != face_buffer_end(); f++);
-	// and so on for the other buffers
-	const face_t* face_buffer_end() const { return next_face; }
-	const vertex_t* vertex_buffer_end() const { return next_vertex; }
-	const index_t* index_buffer_end() const { return next_index; }
+	// Copy every face in src onto the end of this list, along with any vertices
+	// and indices they own. Faces come out exactly as they would have had they
+	// been allocated from this list in the first place
+	void append(const basic_display_list_t& src);
+
+	// Faces are numbered in the order they were allocated
+	face_type& face(int n)				{ return face_pages[n / FACES_PER_PAGE][n % FACES_PER_PAGE]; }
+	const face_type& face(int n) const	{ return face_pages[n / FACES_PER_PAGE][n % FACES_PER_PAGE]; }
 
 	// Free the specified amount of verts or inds from the end of the previous
 	// face allocated, the face will be modified by this call. Use if it turns
 	// out that less vertices or indices than requested are required, The grow
 	// methods can be used if you end up needing more vertices as you go. They
-	// both return a pointer to the first of the newly added whatevers
-	vertex_t* grow_verts(int count);
+	// both return a pointer to the first of the newly added whatevers. If the
+	// current page is full growing moves the face's vertices or indices to a
+	// new page, so any pointers to the old ones must be refetched from the face
+	V* grow_verts(int count);
 	index_t* grow_inds(int count);
-	void shrink_verts(int count) { next_vertex -= count; (next_face - 1)->num_verts -= count; }
-	void shrink_inds(int count) { next_index -= count; (next_face - 1)->num_inds -= count; }
+	void shrink_verts(int count);
+	void shrink_inds(int count);
+
+	int num_faces() const { return faces_used; }
+	int num_verts() const { return verts_used; }
+	int num_inds()  const { return inds_used; }
 
-	int num_faces() const { return next_face - faces; }
-	int num_verts() const { return next_vertex - verts; }
-	int num_inds()  const { return next_index - inds; }
+	// Print statistics on the page pool to the console
+	static void print_stats();
 
 private:
-#pragma pack (push, 16)
-	vertex_t verts[MAX_VERTICES];
-	index_t inds[MAX_INDICES];
-	face_t faces[MAX_FACES];
-#pragma pack (pop)
-
-	vertex_t* max_vertex() { return verts + MAX_VERTICES; }
-	index_t* max_index() { return inds + MAX_INDICES; }
-	face_t* max_face() { return faces + MAX_FACES; }
-
-	vertex_t* next_vertex;
-	index_t* next_index;
-	face_t* next_face;
+	enum { FACES_PER_PAGE = DL_PAGE_SIZE / sizeof(face_type) };
+
+	// Not copyable
+	basic_display_list_t(const basic_display_list_t&);
+	basic_display_list_t& operator=(const basic_display_list_t&);
+
+	dl_page_t* new_page(int size);
+	V* alloc_verts(int count);
+	index_t* alloc_inds(int count);
+
+	dl_page_t* pages;		// Every page used by the list
+
+	face_type** face_pages;	// Pages holding the faces in order
+	int max_face_pages;		// Size of the face_pages array
+
+	V* next_vertex;			// Free space on the current vertex page
+	V* end_vertex;
+	index_t* next_index;	// Free space on the current index page
+	index_t* end_index;
+	face_type* last_face;	// Last face allocated
+
+	int faces_used;
+	int verts_used;
+	int inds_used;
+
+	int* sorted;			// Face numbers in order of sort key
+	int max_sorted;			// Size of the sorted array
+	int num_sorted;			// Faces in the list when it was sorted, -1 if
+							// a sort key has changed since
 };
 
+typedef basic_display_list_t<vertex_t> display_list_t;
+typedef basic_display_list_t<ui_vertex_t> ui_display_list_t;
+
 #endif
@@ -0,0 +1,211 @@
+//-----------------------------------------------------------------------------
+// File: dxt.cpp
+//
+// Implementation of the dxt compressor. The bounds of each block are found
+// with SSE2, a 4x4 block of 32 bit pixels is exactly four registers
+//-----------------------------------------------------------------------------
+
+#include "dxt.h"
+#include "simd.h"
+#include "util.h"
+#include <limits.h>
+
+#include "mem.h"
+#define new mem_new
+
+namespace {
+	inline ushort
+	pack_565(const ubyte* bgra)
+	{
+		return static_cast<ushort>(((bgra[2] >> 3) << 11) | ((bgra[1] >> 2) << 5) | (bgra[0] >> 3));
+	}
+
+	inline void
+	unpack_565(ushort c, int* bgr)
+		// Expand to 8 bits a channel the way the hardware does
+	{
+		int r = (c >> 11) & 31;
+		int g = (c >> 5) & 63;
+		int b = c & 31;
+		bgr[0] = (b << 3) | (b >> 2);
+		bgr[1] = (g << 2) | (g >> 4);
+		bgr[2] = (r << 3) | (r >> 2);
+	}
+
+	void
+	block_bounds(const ubyte* block, ubyte* lo, ubyte* hi)
+		// Smallest and largest value of each channel in the block
+	{
+#ifdef USE_SSE2
+		const __m128i* rows = reinterpret_cast<const __m128i*>(block);
+		__m128i r0 = _mm_loadu_si128(rows);
+		__m128i r1 = _mm_loadu_si128(rows + 1);
+		__m128i r2 = _mm_loadu_si128(rows + 2);
+		__m128i r3 = _mm_loadu_si128(rows + 3);
+		__m128i mn = _mm_min_epu8(_mm_min_epu8(r0, r1), _mm_min_epu8(r2, r3));
+		__m128i mx = _mm_max_epu8(_mm_max_epu8(r0, r1), _mm_max_epu8(r2, r3));
+		// Fold the four pixels of each register together
+		mn = _mm_min_epu8(mn, _mm_shuffle_epi32(mn, _MM_SHUFFLE(1, 0, 3, 2)));
+		mx = _mm_max_epu8(mx, _mm_shuffle_epi32(mx, _MM_SHUFFLE(1, 0, 3, 2)));
+		mn = _mm_min_epu8(mn, _mm_shuffle_epi32(mn, _MM_SHUFFLE(2, 3, 0, 1)));
+		mx = _mm_max_epu8(mx, _mm_shuffle_epi32(mx, _MM_SHUFFLE(2, 3, 0, 1)));
+		uint l = _mm_cvtsi128_si32(mn);
+		uint h = _mm_cvtsi128_si32(mx);
+		u_memcpy(lo, &l, 4);
+		u_memcpy(hi, &h, 4);
+#else
+		for (int c = 0; c < 4; ++c) {
+			lo[c] = hi[c] = block[c];
+			for (int i = 1; i < 16; ++i) {
+				lo[c] = u_min(lo[c], block[i * 4 + c]);
+				hi[c] = u_max(hi[c], block[i * 4 + c]);
+			}
+		}
+#endif
+	}
+
+	void
+	encode_colours(const ubyte* block, const ubyte* lo, const ubyte* hi, ubyte* dest)
+		// Colour half of a block, the endpoints are the bounding box inset by
+		// 1/16 of its size on each side which lowers the average error
+	{
+		ubyte c0[3], c1[3];
+		for (int c = 0; c < 3; ++c) {
+			int inset = (hi[c] - lo[c]) >> 4;
+			c0[c] = static_cast<ubyte>(hi[c] - inset);
+			c1[c] = static_cast<ubyte>(lo[c] + inset);
+		}
+		ushort max565 = pack_565(c0);
+		ushort min565 = pack_565(c1);
+
+		uint indices = 0;
+		if (max565 != min565) {
+			int palette[4][3];
+			unpack_565(max565, palette[0]);
+			unpack_565(min565, palette[1]);
+			for (int c = 0; c < 3; ++c) {
+				palette[2][c] = (palette[0][c] * 2 + palette[1][c]) / 3;
+				palette[3][c] = (palette[0][c] + palette[1][c] * 2) / 3;
+			}
+			for (int i = 15; i >= 0; --i) {
+				const ubyte* p = block + i * 4;
+				int best = 0;
+				int best_error = INT_MAX;
+				for (int j = 0; j < 4; ++j) {
+					int db = p[0] - palette[j][0];
+					int dg = p[1] - palette[j][1];
+					int dr = p[2] - palette[j][2];
+					int error = db * db + dg * dg + dr * dr;
+					if (error < best_error) {
+						best_error = error;
+						best = j;
+					}
+				}
+				indices = (indices << 2) | best;
+			}
+		}
+
+		dest[0] = static_cast<ubyte>(max565);
+		dest[1] = static_cast<ubyte>(max565 >> 8);
+		dest[2] = static_cast<ubyte>(min565);
+		dest[3] = static_cast<ubyte>(min565 >> 8);
+		dest[4] = static_cast<ubyte>(indices);
+		dest[5] = static_cast<ubyte>(indices >> 8);
+		dest[6] = static_cast<ubyte>(indices >> 16);
+		dest[7] = static_cast<ubyte>(indices >> 24);
+	}
+
+	void
+	encode_alpha(const ubyte* block, int lo, int hi, ubyte* dest)
+		// Alpha half of a dxt5 block. The alpha range isn't inset so fully
+		// opaque and transparent pixels stay exact for alpha testing
+	{
+		dest[0] = static_cast<ubyte>(hi);
+		dest[1] = static_cast<ubyte>(lo);
+		u_memset(dest + 2, 0, 6);
+		if (hi == lo)
+			return;
+
+		int palette[8];
+		palette[0] = hi;
+		palette[1] = lo;
+		for (int k = 1; k < 7; ++k)
+			palette[k + 1] = ((7 - k) * hi + k * lo) / 7;
+
+		for (int i = 0; i < 16; ++i) {
+			int a = block[i * 4 + 3];
+			int best = 0;
+			int best_error = INT_MAX;
+			for (int j = 0; j < 8; ++j) {
+				int error = a > palette[j] ? a - palette[j] : palette[j] - a;
+				if (error < best_error) {
+					best_error = error;
+					best = j;
+				}
+			}
+			// 3 bit indices packed little endian across the 6 bytes
+			int bit = i * 3;
+			dest[2 + (bit >> 3)] |= static_cast<ubyte>(best << (bit & 7));
+			if ((bit & 7) > 5)
+				dest[3 + (bit >> 3)] |= static_cast<ubyte>(best >> (8 - (bit & 7)));
+		}
+	}
+
+	void
+	read_block(const image_level_t& level, int x, int y, ubyte* block)
+		// Copy a block out of a level, levels smaller than 4 pixels repeat
+		// their last row and column
+	{
+		for (int j = 0; j < 4; ++j) {
+			const ubyte* row = level.pixels + u_min(y + j, level.height - 1) * level.pitch;
+			for (int i = 0; i < 4; ++i)
+				u_memcpy(block + (j * 4 + i) * 4, row + u_min(x + i, level.width - 1) * 4, 4);
+		}
+	}
+}
+
+void
+encode_dxt1_block(const ubyte* block, ubyte* dest)
+{
+	ubyte lo[4], hi[4];
+	block_bounds(block, lo, hi);
+	encode_colours(block, lo, hi, dest);
+}
+
+void
+encode_dxt5_block(const ubyte* block, ubyte* dest)
+{
+	ubyte lo[4], hi[4];
+	block_bounds(block, lo, hi);
+	encode_alpha(block, lo[3], hi[3], dest);
+	encode_colours(block, lo, hi, dest + 8);
+}
+
+bool
+compress_dxt(const image_t& src, image_t& dst)
+{
+	if (src.num_levels == 0 || src.format != IMAGE_BGRA || (src.levels[0].width & 3) || (src.levels[0].height & 3))
+		return false;
+
+	image_format_t format = src.has_alpha ? IMAGE_DXT5 : IMAGE_DXT1;
+	dst.allocate(src.levels[0].width, src.levels[0].height, src.num_levels > 1, format);
+	dst.has_alpha = src.has_alpha;
+	u_assert(dst.num_levels == src.num_levels);
+
+	const int block_size = format == IMAGE_DXT1 ? 8 : 16;
+	ubyte block[64];
+	for (int l = 0; l < src.num_levels; ++l) {
+		const image_level_t& level = src.levels[l];
+		for (int y = 0; y < level.height; y += 4) {
+			ubyte* dest = dst.levels[l].pixels + (y / 4) * dst.levels[l].pitch;
+			for (int x = 0; x < level.width; x += 4, dest += block_size) {
+				read_block(level, x, y, block);
+				if (format == IMAGE_DXT1)
+					encode_dxt1_block(block, dest);
+				else
+					encode_dxt5_block(block, dest);
+			}
+		}
+	}
+	return true;
+}
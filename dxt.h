@@ -0,0 +1,22 @@
+//-----------------------------------------------------------------------------
+// File: dxt.h
+//
+// Dxt1 and dxt5 texture compression. Each block's colour endpoints are taken
+// from the bounding box of its colours, which is fast enough to run on the
+// texture loader threads as textures are loaded
+//-----------------------------------------------------------------------------
+
+#ifndef DXT_H
+#define DXT_H
+
+#include "image.h"
+
+// Compress every level of src into dst, as dxt5 if src has alpha or dxt1 if it
+// doesn't. Fails if src isn't IMAGE_BGRA or its sides aren't multiples of 4
+bool compress_dxt(const image_t& src, image_t& dst);
+
+// Encode a 4x4 block of BGRA pixels, 64 bytes in rows, into 8 or 16 bytes
+void encode_dxt1_block(const ubyte* block, ubyte* dest);
+void encode_dxt5_block(const ubyte* block, ubyte* dest);
+
+#endif
@@ -44,7 +44,7 @@ font_t::get_instance()
 static float tab_size = 8.0f;
 
 void 
-font_t::write_text(display_list_t& dl, float xpos, float ypos, const char* text) const
+font_t::write_text(ui_display_list_t& dl, float xpos, float ypos, const char* text) const
 	// Add a face to the display list to render the given text on a ui sized screen
 	// Any chars that would be off the bounds of a ui sized screen are discarded, this
 	// may mean that dl comes back unchanged return and newline chars are treated just
@@ -57,12 +57,12 @@ font_t::write_text(display_list_t& dl, float xpos, float ypos, const char* text)
 	if (len == 0 || shader == 0 || ypos - cheight > UI_HEIGHT || ypos < 0.0f)
 		return;
 
-	face_t* face = dl.get_face(shader, 0, len * 4, len * 6);
+	ui_face_t* face = dl.get_face(shader, 0, len * 4, len * 6);
 	if (face == 0) {
 		console.print("Unable to allocate face for font\n");
 		return;
 	}
-	vertex_t* vert = face->verts;
+	ui_vertex_t* vert = face->verts;
 	index_t* ind = face->inds;
 
 	float vleft = xpos * cwidth;
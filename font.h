@@ -22,7 +22,7 @@ public:
 	// Set the number of characters per screen
 	void set_resolution(float x, float y) { cwidth = UI_WIDTH / x; cheight = UI_HEIGHT / y; }
 	// Append the nescessary faces to render the required text
-	void write_text(display_list_t& dl, float xpos, float ypos, const char* text) const;
+	void write_text(ui_display_list_t& dl, float xpos, float ypos, const char* text) const;
 	// Get the current text color
 	color_t get_color() const { return color; }
 	// Get the current text resolution
@@ -0,0 +1,881 @@
+//-----------------------------------------------------------------------------
+// File: image.cpp
+//
+// Tga and baseline jpeg decoders. These are called from the texture loader's
+// worker threads so they keep no state outside of the image being decoded
+//-----------------------------------------------------------------------------
+
+#include "image.h"
+#include "maths.h"
+#include "simd.h"
+#include "util.h"
+
+#include "mem.h"
+#define new mem_new
+
+void
+image_t::allocate(int width, int height, bool mipmaps, image_format_t fmt)
+{
+	clear();
+
+	int total = 0;
+	int w = width;
+	int h = height;
+	do {
+		image_level_t& level = levels[num_levels];
+		level.width = w;
+		level.height = h;
+		if (fmt == IMAGE_BGRA) {
+			level.pitch = w * 4;
+			level.size = level.pitch * h;
+		} else {
+			level.pitch = ((w + 3) / 4) * (fmt == IMAGE_DXT1 ? 8 : 16);
+			level.size = level.pitch * ((h + 3) / 4);
+		}
+		total += level.size;
+		++num_levels;
+		w = u_max(w >> 1, 1);
+		h = u_max(h >> 1, 1);
+	} while (mipmaps && num_levels < MAX_IMAGE_LEVELS && (levels[num_levels - 1].width > 1 || levels[num_levels - 1].height > 1));
+
+	data = new ubyte[total];
+	ubyte* pixels = data;
+	for (int i = 0; i < num_levels; ++i) {
+		levels[i].pixels = pixels;
+		pixels += levels[i].size;
+	}
+	format = fmt;
+	has_alpha = false;
+}
+
+void
+image_t::clear()
+{
+	delete [] data;
+	data = 0;
+	num_levels = 0;
+	format = IMAGE_BGRA;
+}
+
+void
+image_t::swap(image_t& image)
+{
+	image_t temp;
+	u_memcpy(&temp, this, sizeof(image_t));
+	u_memcpy(this, &image, sizeof(image_t));
+	u_memcpy(&image, &temp, sizeof(image_t));
+	temp.data = 0;
+}
+
+int
+image_t::size() const
+{
+	int total = 0;
+	for (int i = 0; i < num_levels; ++i)
+		total += levels[i].size;
+	return total;
+}
+
+namespace {
+	inline ubyte
+	clamp_byte(int n)
+	{
+		return static_cast<ubyte>(n < 0 ? 0 : (n > 255 ? 255 : n));
+	}
+}
+
+bool
+decode_image(const char* name, const ubyte* data, uint size, image_t& image, bool mipmaps, bool srgb)
+{
+	int length = u_strlen(name);
+	bool result = false;
+	if (length >= 4 && u_fncmp(name + length - 4, ".tga") == 0)
+		result = decode_tga(data, size, image, mipmaps);
+	else if (length >= 4 && u_fncmp(name + length - 4, ".jpg") == 0)
+		result = decode_jpeg(data, size, image, mipmaps);
+
+	if (!result) {
+		image.clear();
+		return false;
+	}
+	if (mipmaps)
+		build_mipmaps(image, srgb);
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// TGA
+///////////////////////////////////////////////////////////////////////////////
+
+namespace {
+	// Image types
+	const int TGA_RGB		= 2;
+	const int TGA_GREY		= 3;
+	const int TGA_RLE_RGB	= 10;
+	const int TGA_RLE_GREY	= 11;
+
+	const int TGA_HEADER_SIZE = 18;
+	const int TGA_TOP_LEFT	= 0x20;	// Descriptor bit for rows stored top down
+
+	inline void
+	read_tga_pixel(const ubyte* src, int bytes, ubyte* dst)
+		// Tga stores colours as blue, green, red (, alpha) already
+	{
+		if (bytes == 1) {
+			dst[0] = dst[1] = dst[2] = src[0];
+			dst[3] = 255;
+		} else {
+			dst[0] = src[0];
+			dst[1] = src[1];
+			dst[2] = src[2];
+			dst[3] = bytes == 4 ? src[3] : 255;
+		}
+	}
+}
+
+bool
+decode_tga(const ubyte* data, uint size, image_t& image, bool mipmaps)
+{
+	if (size < TGA_HEADER_SIZE)
+		return false;
+
+	int id_length = data[0];
+	int colormap_type = data[1];
+	int type = data[2];
+	int width = data[12] | (data[13] << 8);
+	int height = data[14] | (data[15] << 8);
+	int bits = data[16];
+	int descriptor = data[17];
+
+	if (colormap_type != 0)
+		return false;
+	bool grey = type == TGA_GREY || type == TGA_RLE_GREY;
+	bool rle = type == TGA_RLE_RGB || type == TGA_RLE_GREY;
+	if (!grey && type != TGA_RGB && !rle)
+		return false;
+	if (grey ? bits != 8 : (bits != 24 && bits != 32))
+		return false;
+	if (width == 0 || height == 0)
+		return false;
+
+	const int bytes = bits / 8;
+	const ubyte* src = data + TGA_HEADER_SIZE + id_length;
+	const ubyte* end = data + size;
+
+	image.allocate(width, height, mipmaps);
+	ubyte* pixels = image.levels[0].pixels;
+	const int count = width * height;
+
+	if (!rle) {
+		if (src + count * bytes > end)
+			return false;
+		for (int i = 0; i < count; ++i, src += bytes)
+			read_tga_pixel(src, bytes, pixels + i * 4);
+	} else {
+		// Packets can run on from one row into the next
+		int i = 0;
+		while (i < count) {
+			if (src >= end)
+				return false;
+			int header = *src++;
+			int run = u_min((header & 0x7f) + 1, count - i);
+			if (header & 0x80) {
+				if (src + bytes > end)
+					return false;
+				ubyte pixel[4];
+				read_tga_pixel(src, bytes, pixel);
+				src += bytes;
+				for (int j = 0; j < run; ++j, ++i)
+					u_memcpy(pixels + i * 4, pixel, 4);
+			} else {
+				if (src + run * bytes > end)
+					return false;
+				for (int j = 0; j < run; ++j, ++i, src += bytes)
+					read_tga_pixel(src, bytes, pixels + i * 4);
+			}
+		}
+	}
+
+	// Rows are stored bottom up unless the descriptor says otherwise
+	if (!(descriptor & TGA_TOP_LEFT)) {
+		const int pitch = width * 4;
+		ubyte* row = new ubyte[pitch];
+		for (int y = 0; y < height / 2; ++y) {
+			ubyte* top = pixels + y * pitch;
+			ubyte* bottom = pixels + (height - 1 - y) * pitch;
+			u_memcpy(row, top, pitch);
+			u_memcpy(top, bottom, pitch);
+			u_memcpy(bottom, row, pitch);
+		}
+		delete [] row;
+	}
+
+	if (bytes == 4) {
+		for (int i = 0; i < count && !image.has_alpha; ++i)
+			if (pixels[i * 4 + 3] != 255)
+				image.has_alpha = true;
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// JPEG
+///////////////////////////////////////////////////////////////////////////////
+
+namespace {
+	// Markers
+	const int JPEG_SOF0	= 0xc0;	// Baseline
+	const int JPEG_SOF1	= 0xc1;	// Extended sequential, huffman
+	const int JPEG_DHT	= 0xc4;
+	const int JPEG_RST0	= 0xd0;
+	const int JPEG_SOI	= 0xd8;
+	const int JPEG_EOI	= 0xd9;
+	const int JPEG_SOS	= 0xda;
+	const int JPEG_DQT	= 0xdb;
+	const int JPEG_DRI	= 0xdd;
+
+	const int JPEG_MAX_COMPONENTS = 3;
+
+	// Position in a block of each coefficient in the order they are stored
+	const int zigzag[64] = {
+		 0,  1,  8, 16,  9,  2,  3, 10,
+		17, 24, 32, 25, 18, 11,  4,  5,
+		12, 19, 26, 33, 40, 48, 41, 34,
+		27, 20, 13,  6,  7, 14, 21, 28,
+		35, 42, 49, 56, 57, 50, 43, 36,
+		29, 22, 15, 23, 30, 37, 44, 51,
+		58, 59, 52, 45, 38, 31, 39, 46,
+		53, 60, 61, 54, 47, 55, 62, 63
+	};
+
+	// idct_table[x][u] = C(u) / 2 * cos((2x + 1) * u * pi / 16)
+	float idct_table[8][8];
+
+	struct idct_table_init_t {
+		// Fill in idct_table at startup, before any loader threads exist
+		idct_table_init_t();
+	} idct_table_init;
+
+	idct_table_init_t::idct_table_init_t()
+	{
+		for (int x = 0; x < 8; ++x)
+			for (int u = 0; u < 8; ++u)
+				idct_table[x][u] = (u == 0 ? m_sqrt(0.5f) : 1.0f) * 0.5f *
+					m_cos(m_itof((2 * x + 1) * u) * M_PI / 16.0f);
+	}
+
+	void
+	idct_block(const float* in, ubyte* out, int pitch)
+		// Inverse DCT of a dequantized block in natural order, written as
+		// 8x8 bytes with the level shift added back
+	{
+		float temp[64];
+		for (int y = 0; y < 8; ++y) {
+			const float* row = in + y * 8;
+			for (int x = 0; x < 8; ++x) {
+				const float* c = idct_table[x];
+				temp[y * 8 + x] = c[0] * row[0] + c[1] * row[1] + c[2] * row[2] + c[3] * row[3] +
+					c[4] * row[4] + c[5] * row[5] + c[6] * row[6] + c[7] * row[7];
+			}
+		}
+		for (int x = 0; x < 8; ++x) {
+			for (int y = 0; y < 8; ++y) {
+				const float* c = idct_table[y];
+				float value = c[0] * temp[x] + c[1] * temp[8 + x] + c[2] * temp[16 + x] + c[3] * temp[24 + x] +
+					c[4] * temp[32 + x] + c[5] * temp[40 + x] + c[6] * temp[48 + x] + c[7] * temp[56 + x];
+				out[y * pitch + x] = clamp_byte(m_ftoi(value) + 128);
+			}
+		}
+	}
+
+	struct huffman_t {
+		// A huffman table, codes of up to 8 bits are found with one lookup
+		ubyte	fast_length[256];	// 0 if the code is longer than 8 bits
+		ubyte	fast_symbol[256];
+		int		max_code[18];		// Largest code of each length, -1 if none
+		int		offset[17];			// symbols index minus the first code of each length
+		ubyte	symbols[256];
+		bool	defined;
+	};
+
+	bool
+	build_huffman(huffman_t& table, const ubyte* counts, const ubyte* symbols, int num_symbols)
+	{
+		u_memcpy(table.symbols, symbols, num_symbols);
+		u_zeromem(table.fast_length, sizeof(table.fast_length));
+
+		int code = 0;
+		int k = 0;
+		for (int length = 1; length <= 16; ++length) {
+			int count = counts[length - 1];
+			table.offset[length] = k - code;
+			if (code + count > (1 << length))
+				return false;
+			for (int i = 0; i < count; ++i, ++code, ++k) {
+				if (length <= 8) {
+					int first = code << (8 - length);
+					for (int j = 0; j < (1 << (8 - length)); ++j) {
+						table.fast_length[first + j] = static_cast<ubyte>(length);
+						table.fast_symbol[first + j] = symbols[k];
+					}
+				}
+			}
+			table.max_code[length] = count ? code - 1 : -1;
+			code <<= 1;
+		}
+		table.max_code[17] = 0x7fffffff;	// Stops a bad code running off the end
+		table.defined = true;
+		return true;
+	}
+
+	class jpeg_bits_t {
+		// Reads the entropy coded data a few bits at a time. Stuffed zero bytes
+		// are skipped and zeros are returned from a marker onwards
+	public:
+		jpeg_bits_t(const ubyte* p, const ubyte* e) : pos(p), end(e), buffer(0), count(0), marker(false) {}
+
+		void fill()
+		{
+			while (count <= 24) {
+				uint byte = 0;
+				if (!marker && pos < end) {
+					byte = *pos;
+					if (byte != 0xff) {
+						++pos;
+					} else if (pos + 1 < end && pos[1] == 0) {
+						pos += 2;
+					} else {
+						marker = true;
+						byte = 0;
+					}
+				}
+				buffer |= byte << (24 - count);
+				count += 8;
+			}
+		}
+
+		uint peek(int bits) const	{ return buffer >> (32 - bits); }
+		void skip(int bits)			{ buffer <<= bits; count -= bits; }
+
+		int receive(int bits)
+			// Read a value of bits bits and sign extend it
+		{
+			if (bits == 0)
+				return 0;
+			fill();
+			int value = static_cast<int>(peek(bits));
+			skip(bits);
+			if (value < (1 << (bits - 1)))
+				value -= (1 << bits) - 1;
+			return value;
+		}
+
+		int decode(const huffman_t& table)
+		{
+			fill();
+			uint look = peek(8);
+			if (table.fast_length[look]) {
+				skip(table.fast_length[look]);
+				return table.fast_symbol[look];
+			}
+			int length = 9;
+			int code = static_cast<int>(peek(9));
+			while (code > table.max_code[length])
+				code = static_cast<int>(peek(++length));
+			if (length > 16)
+				return 0;
+			skip(length);
+			return table.symbols[table.offset[length] + code];
+		}
+
+		bool restart()
+			// Skip the restart marker at the end of an interval
+		{
+			buffer = 0;
+			count = 0;
+			marker = false;
+			if (pos + 1 < end && pos[0] == 0xff && (pos[1] & 0xf8) == JPEG_RST0) {
+				pos += 2;
+				return true;
+			}
+			return false;
+		}
+
+		const ubyte* position() const { return pos; }
+
+	private:
+		const ubyte*	pos;
+		const ubyte*	end;
+		uint			buffer;		// Bits to be read at the top
+		int				count;		// Number of bits in buffer
+		bool			marker;
+	};
+
+	struct jpeg_component_t {
+		int		id;
+		int		h;				// Horizontal sampling factor
+		int		v;				// Vertical sampling factor
+		int		quant;			// Quantization table
+		int		dc_table;
+		int		ac_table;
+		int		pred;			// Previous dc value
+		int		width;			// Size of the plane, a whole number of MCUs
+		int		height;
+		ubyte*	plane;
+	};
+
+	struct jpeg_t {
+		int					width;
+		int					height;
+		int					num_components;
+		jpeg_component_t	components[JPEG_MAX_COMPONENTS];
+		int					quant[4][64];	// In the stored order
+		huffman_t			dc[4];
+		huffman_t			ac[4];
+		int					restart_interval;
+
+		jpeg_t() : width(0), height(0), num_components(0), restart_interval(0)
+		{
+			for (int i = 0; i < 4; ++i)
+				dc[i].defined = ac[i].defined = false;
+			for (int c = 0; c < JPEG_MAX_COMPONENTS; ++c)
+				components[c].plane = 0;
+		}
+
+		~jpeg_t()
+		{
+			for (int c = 0; c < JPEG_MAX_COMPONENTS; ++c)
+				delete [] components[c].plane;
+		}
+	};
+
+	inline int
+	read_ushort(const ubyte* p)
+	{
+		return (p[0] << 8) | p[1];
+	}
+
+	bool
+	decode_block(jpeg_t& jpeg, jpeg_component_t& component, jpeg_bits_t& bits, ubyte* out)
+	{
+		const int* quant = jpeg.quant[component.quant];
+		const huffman_t& dc = jpeg.dc[component.dc_table];
+		const huffman_t& ac = jpeg.ac[component.ac_table];
+
+		float block[64];
+		for (int i = 0; i < 64; ++i)
+			block[i] = 0.0f;
+
+		int size = bits.decode(dc);
+		if (size > 16)
+			return false;
+		component.pred += bits.receive(size);
+		block[0] = m_itof(component.pred * quant[0]);
+
+		for (int k = 1; k < 64; ) {
+			int rs = bits.decode(ac);
+			int run = rs >> 4;
+			size = rs & 15;
+			if (size == 0) {
+				if (run != 15)
+					break;		// End of block
+				k += 16;
+				continue;
+			}
+			k += run;
+			if (k > 63)
+				return false;
+			block[zigzag[k]] = m_itof(bits.receive(size) * quant[k]);
+			++k;
+		}
+
+		idct_block(block, out, component.width);
+		return true;
+	}
+
+	bool
+	decode_scan(jpeg_t& jpeg, const ubyte* data, const ubyte* end, const ubyte*& next)
+		// Decode the entropy coded data of a scan containing every component
+	{
+		int h_max = 1;
+		int v_max = 1;
+		if (jpeg.num_components > 1) {
+			for (int c = 0; c < jpeg.num_components; ++c) {
+				h_max = u_max(h_max, jpeg.components[c].h);
+				v_max = u_max(v_max, jpeg.components[c].v);
+			}
+		} else {
+			// A single component scan has one block per MCU
+			jpeg.components[0].h = 1;
+			jpeg.components[0].v = 1;
+		}
+
+		int mcus_x = (jpeg.width + 8 * h_max - 1) / (8 * h_max);
+		int mcus_y = (jpeg.height + 8 * v_max - 1) / (8 * v_max);
+		for (int c = 0; c < jpeg.num_components; ++c) {
+			jpeg_component_t& component = jpeg.components[c];
+			component.width = mcus_x * component.h * 8;
+			component.height = mcus_y * component.v * 8;
+			component.plane = new ubyte[component.width * component.height];
+			component.pred = 0;
+		}
+
+		jpeg_bits_t bits(data, end);
+		int todo = jpeg.restart_interval ? jpeg.restart_interval : 0x7fffffff;
+		for (int my = 0; my < mcus_y; ++my) {
+			for (int mx = 0; mx < mcus_x; ++mx) {
+				for (int c = 0; c < jpeg.num_components; ++c) {
+					jpeg_component_t& component = jpeg.components[c];
+					for (int by = 0; by < component.v; ++by) {
+						for (int bx = 0; bx < component.h; ++bx) {
+							int x = (mx * component.h + bx) * 8;
+							int y = (my * component.v + by) * 8;
+							if (!decode_block(jpeg, component, bits, component.plane + y * component.width + x))
+								return false;
+						}
+					}
+				}
+				if (--todo == 0) {
+					bits.restart();
+					for (int c = 0; c < jpeg.num_components; ++c)
+						jpeg.components[c].pred = 0;
+					todo = jpeg.restart_interval;
+				}
+			}
+		}
+
+		next = bits.position();
+		return true;
+	}
+
+	void
+	convert_jpeg(const jpeg_t& jpeg, ubyte* pixels)
+		// Colour convert the planes to bgra, the chroma planes are upsampled
+		// by repeating their samples
+	{
+		if (jpeg.num_components == 1) {
+			const jpeg_component_t& grey = jpeg.components[0];
+			for (int y = 0; y < jpeg.height; ++y) {
+				const ubyte* src = grey.plane + y * grey.width;
+				for (int x = 0; x < jpeg.width; ++x, pixels += 4) {
+					pixels[0] = pixels[1] = pixels[2] = src[x];
+					pixels[3] = 255;
+				}
+			}
+			return;
+		}
+
+		const jpeg_component_t& cy = jpeg.components[0];
+		const jpeg_component_t& cb = jpeg.components[1];
+		const jpeg_component_t& cr = jpeg.components[2];
+		int h_max = u_max(cy.h, u_max(cb.h, cr.h));
+		int v_max = u_max(cy.v, u_max(cb.v, cr.v));
+
+		// Fixed point with 16 fractional bits
+		const int CR_R = 91881;		// 1.402
+		const int CB_G = 22554;		// 0.344136
+		const int CR_G = 46802;		// 0.714136
+		const int CB_B = 116130;	// 1.772
+		const int ROUND = 1 << 15;
+
+		for (int y = 0; y < jpeg.height; ++y) {
+			const ubyte* src_y = cy.plane + (y * cy.v / v_max) * cy.width;
+			const ubyte* src_cb = cb.plane + (y * cb.v / v_max) * cb.width;
+			const ubyte* src_cr = cr.plane + (y * cr.v / v_max) * cr.width;
+			for (int x = 0; x < jpeg.width; ++x, pixels += 4) {
+				int lum = (src_y[x * cy.h / h_max] << 16) + ROUND;
+				int blue = src_cb[x * cb.h / h_max] - 128;
+				int red = src_cr[x * cr.h / h_max] - 128;
+				pixels[0] = clamp_byte((lum + CB_B * blue) >> 16);
+				pixels[1] = clamp_byte((lum - CB_G * blue - CR_G * red) >> 16);
+				pixels[2] = clamp_byte((lum + CR_R * red) >> 16);
+				pixels[3] = 255;
+			}
+		}
+	}
+}
+
+bool
+decode_jpeg(const ubyte* data, uint size, image_t& image, bool mipmaps)
+	// Decodes baseline jpegs with one (grey) or three (YCbCr) components
+{
+	const ubyte* pos = data;
+	const ubyte* end = data + size;
+	if (size < 4 || pos[0] != 0xff || pos[1] != JPEG_SOI)
+		return false;
+	pos += 2;
+
+	jpeg_t jpeg;
+	bool have_frame = false;
+	bool decoded = false;
+
+	while (!decoded) {
+		// Find the next marker, there may be fill bytes before it
+		while (pos < end && *pos != 0xff)
+			++pos;
+		while (pos < end && *pos == 0xff)
+			++pos;
+		if (pos >= end)
+			return false;
+		int marker = *pos++;
+		if (marker == JPEG_EOI)
+			return false;
+		if (marker >= JPEG_RST0 && marker < JPEG_RST0 + 8)
+			continue;
+		if (pos + 2 > end)
+			return false;
+		int length = read_ushort(pos);
+		const ubyte* segment = pos + 2;
+		const ubyte* segment_end = pos + length;
+		if (length < 2 || segment_end > end)
+			return false;
+		pos = segment_end;
+
+		switch (marker) {
+		case JPEG_DQT:
+			while (segment < segment_end) {
+				int precision = segment[0] >> 4;
+				int table = segment[0] & 3;
+				++segment;
+				if (segment + (precision ? 128 : 64) > segment_end)
+					return false;
+				for (int i = 0; i < 64; ++i) {
+					jpeg.quant[table][i] = precision ? read_ushort(segment) : segment[0];
+					segment += precision ? 2 : 1;
+				}
+			}
+			break;
+		case JPEG_DHT:
+			while (segment + 17 <= segment_end) {
+				int table_class = segment[0] >> 4;
+				int table = segment[0] & 3;
+				const ubyte* counts = segment + 1;
+				int num_symbols = 0;
+				for (int i = 0; i < 16; ++i)
+					num_symbols += counts[i];
+				segment += 17;
+				if (num_symbols > 256 || segment + num_symbols > segment_end)
+					return false;
+				if (!build_huffman(table_class ? jpeg.ac[table] : jpeg.dc[table], counts, segment, num_symbols))
+					return false;
+				segment += num_symbols;
+			}
+			break;
+		case JPEG_DRI:
+			if (length < 4)
+				return false;
+			jpeg.restart_interval = read_ushort(segment);
+			break;
+		case JPEG_SOF0:
+		case JPEG_SOF1:
+			if (length < 8 || segment[0] != 8)
+				return false;
+			jpeg.height = read_ushort(segment + 1);
+			jpeg.width = read_ushort(segment + 3);
+			jpeg.num_components = segment[5];
+			if ((jpeg.num_components != 1 && jpeg.num_components != 3) || length < 8 + jpeg.num_components * 3)
+				return false;
+			if (jpeg.width == 0 || jpeg.height == 0)
+				return false;
+			for (int c = 0; c < jpeg.num_components; ++c) {
+				const ubyte* p = segment + 6 + c * 3;
+				jpeg.components[c].id = p[0];
+				jpeg.components[c].h = p[1] >> 4;
+				jpeg.components[c].v = p[1] & 15;
+				jpeg.components[c].quant = p[2] & 3;
+				if (jpeg.components[c].h < 1 || jpeg.components[c].h > 4 || jpeg.components[c].v < 1 || jpeg.components[c].v > 4)
+					return false;
+			}
+			have_frame = true;
+			break;
+		case JPEG_SOS: {
+			// Only single scans with every component interleaved are handled
+			if (!have_frame || segment[0] != jpeg.num_components)
+				return false;
+			for (int s = 0; s < jpeg.num_components; ++s) {
+				const ubyte* p = segment + 1 + s * 2;
+				int c;
+				for (c = 0; c < jpeg.num_components; ++c)
+					if (jpeg.components[c].id == p[0])
+						break;
+				if (c == jpeg.num_components)
+					return false;
+				jpeg.components[c].dc_table = p[1] >> 4 & 3;
+				jpeg.components[c].ac_table = p[1] & 3;
+				if (!jpeg.dc[jpeg.components[c].dc_table].defined || !jpeg.ac[jpeg.components[c].ac_table].defined)
+					return false;
+			}
+			if (!decode_scan(jpeg, segment_end, end, pos))
+				return false;
+			decoded = true;
+			break;
+		}
+		default:
+			// SOF2 onwards are progressive, lossless or arithmetic coded
+			if (marker > JPEG_SOF1 && marker <= 0xcf && marker != JPEG_DHT && marker != 0xc8 && marker != 0xcc)
+				return false;
+			break;	// APPn, COM and the like
+		}
+	}
+
+	image.allocate(jpeg.width, jpeg.height, mipmaps);
+	convert_jpeg(jpeg, image.levels[0].pixels);
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MIPMAPS
+///////////////////////////////////////////////////////////////////////////////
+
+namespace {
+	struct srgb_tables_t {
+		// Conversions between 8 bit sRGB and 12 bit linear values for gamma
+		// correct filtering. Built before main so every thread can share them
+		srgb_tables_t();
+
+		ushort	to_linear[256];
+		ubyte	to_srgb[4096];
+	} srgb_tables;
+
+	srgb_tables_t::srgb_tables_t()
+	{
+		for (int i = 0; i < 256; ++i) {
+			double c = i / 255.0;
+			c = c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+			to_linear[i] = static_cast<ushort>(c * 4095.0 + 0.5);
+		}
+		for (int j = 0; j < 4096; ++j) {
+			double l = j / 4095.0;
+			l = l <= 0.0031308 ? l * 12.92 : 1.055 * pow(l, 1.0 / 2.4) - 0.055;
+			to_srgb[j] = static_cast<ubyte>(l * 255.0 + 0.5);
+		}
+	}
+
+	struct mip_taps_t {
+		// The source pixels along one side that make up a destination pixel
+		int		first;
+		int		count;
+		float	weight[3];
+	};
+
+	void
+	make_mip_taps(int src, int dst, mip_taps_t* taps)
+		// Even sides average pairs of pixels. Odd sides use three pixels per
+		// destination pixel, weighted so each source pixel counts equally
+		// across the whole level
+	{
+		for (int i = 0; i < dst; ++i) {
+			mip_taps_t& t = taps[i];
+			t.first = src > 1 ? i * 2 : 0;
+			if (src == 1) {
+				t.count = 1;
+				t.weight[0] = 1.0f;
+			} else if ((src & 1) == 0) {
+				t.count = 2;
+				t.weight[0] = t.weight[1] = 0.5f;
+			} else {
+				float scale = 1.0f / m_itof(src);
+				t.count = 3;
+				t.weight[0] = m_itof(dst - i) * scale;
+				t.weight[1] = m_itof(dst) * scale;
+				t.weight[2] = m_itof(i + 1) * scale;
+			}
+		}
+	}
+
+	// Levels up to this size keep their taps on the stack, so mipping on the
+	// job threads doesn't go through the allocator
+	const int MAX_STACK_TAPS = 512;
+
+	void
+	filter_level(const image_level_t& src, const image_level_t& dst, bool srgb)
+		// General filter for any size of level, colours are averaged as
+		// linear values if srgb is set. Alpha is always averaged as is
+	{
+		mip_taps_t stack_x[MAX_STACK_TAPS];
+		mip_taps_t stack_y[MAX_STACK_TAPS];
+		mip_taps_t* taps_x = dst.width <= MAX_STACK_TAPS ? stack_x : new mip_taps_t[dst.width];
+		mip_taps_t* taps_y = dst.height <= MAX_STACK_TAPS ? stack_y : new mip_taps_t[dst.height];
+		make_mip_taps(src.width, dst.width, taps_x);
+		make_mip_taps(src.height, dst.height, taps_y);
+
+		ubyte* d = dst.pixels;
+		for (int y = 0; y < dst.height; ++y) {
+			const mip_taps_t& ty = taps_y[y];
+			for (int x = 0; x < dst.width; ++x, d += 4) {
+				const mip_taps_t& tx = taps_x[x];
+				float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+				for (int j = 0; j < ty.count; ++j) {
+					const ubyte* s = src.pixels + ((ty.first + j) * src.width + tx.first) * 4;
+					for (int i = 0; i < tx.count; ++i, s += 4) {
+						float w = ty.weight[j] * tx.weight[i];
+						for (int c = 0; c < 3; ++c)
+							sum[c] += w * (srgb ? srgb_tables.to_linear[s[c]] : s[c]);
+						sum[3] += w * s[3];
+					}
+				}
+				for (int c = 0; c < 3; ++c)
+					d[c] = srgb ? srgb_tables.to_srgb[m_ftoi(sum[c] + 0.5f)] : static_cast<ubyte>(m_ftoi(sum[c] + 0.5f));
+				d[3] = static_cast<ubyte>(m_ftoi(sum[3] + 0.5f));
+			}
+		}
+
+		if (taps_x != stack_x)
+			delete [] taps_x;
+		if (taps_y != stack_y)
+			delete [] taps_y;
+	}
+
+#ifdef USE_SSE2
+	inline __m128i
+	sum_blocks(const ubyte* s0, const ubyte* s1, __m128i zero)
+		// Sum the 2x2 blocks of four pixels from each of two rows, giving two
+		// pixels with 16 bit channels
+	{
+		__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s0));
+		__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s1));
+		__m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+		__m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+		return _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+	}
+#endif
+
+	void
+	box_level(const image_level_t& src, const image_level_t& dst)
+		// Average 2x2 blocks, both sides of src must be even. Four destination
+		// pixels are done at a time with SSE2
+	{
+		for (int y = 0; y < dst.height; ++y) {
+			const ubyte* s0 = src.pixels + y * 2 * src.width * 4;
+			const ubyte* s1 = s0 + src.width * 4;
+			ubyte* d = dst.pixels + y * dst.width * 4;
+			int x = 0;
+#ifdef USE_SSE2
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i two = _mm_set1_epi16(2);
+			for (; x + 4 <= dst.width; x += 4, s0 += 32, s1 += 32, d += 16) {
+				__m128i lo = _mm_srli_epi16(_mm_add_epi16(sum_blocks(s0, s1, zero), two), 2);
+				__m128i hi = _mm_srli_epi16(_mm_add_epi16(sum_blocks(s0 + 16, s1 + 16, zero), two), 2);
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(d), _mm_packus_epi16(lo, hi));
+			}
+#endif
+			for (; x < dst.width; ++x, s0 += 8, s1 += 8, d += 4) {
+				for (int c = 0; c < 4; ++c)
+					d[c] = static_cast<ubyte>((s0[c] + s0[c + 4] + s1[c] + s1[c + 4] + 2) >> 2);
+			}
+		}
+	}
+}
+
+void
+build_mipmaps(image_t& image, bool srgb)
+{
+	for (int level = 1; level < image.num_levels; ++level) {
+		const image_level_t& src = image.levels[level - 1];
+		const image_level_t& dst = image.levels[level];
+		if (!srgb && src.width == dst.width * 2 && src.height == dst.height * 2)
+			box_level(src, dst);
+		else
+			filter_level(src, dst, srgb);
+	}
+}
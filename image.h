@@ -0,0 +1,74 @@
+//-----------------------------------------------------------------------------
+// File: image.h
+//
+// Decoding of the tga and jpg files textures are made from, and building
+// their mipmaps. Decoded images are 32 bits per pixel with the bytes in blue,
+// green, red, alpha order, the same as D3DFMT_A8R8G8B8. They can then be
+// compressed to dxt1 or dxt5 (see dxt.h)
+//-----------------------------------------------------------------------------
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "types.h"
+
+// Most levels an image can have, enough for 32768 x 32768
+#define MAX_IMAGE_LEVELS	16
+
+// Pixel formats, the dxt formats are stored as rows of 4x4 blocks which is
+// the layout D3D locks them with
+enum image_format_t {
+	IMAGE_BGRA,		// 4 bytes per pixel
+	IMAGE_DXT1,		// 8 bytes per block, opaque
+	IMAGE_DXT5		// 16 bytes per block, interpolated alpha
+};
+
+struct image_level_t {
+	int		width;
+	int		height;
+	int		pitch;		// Bytes per row of pixels or blocks
+	int		size;		// Bytes in the level
+	ubyte*	pixels;
+};
+
+class image_t {
+	// An image and its mipmaps, level 0 is the full size image
+public:
+	image_t() : num_levels(0), format(IMAGE_BGRA), has_alpha(false), data(0) {}
+	~image_t() { clear(); }
+
+	// Make space for an image and, if mipmaps is set, every level down to 1x1
+	void allocate(int width, int height, bool mipmaps, image_format_t fmt = IMAGE_BGRA);
+	void clear();
+	void swap(image_t& image);
+
+	// Total size of the pixels of every level, they are stored one after the
+	// other starting at levels[0].pixels
+	int size() const;
+
+	int				num_levels;		// 0 if there is no image
+	image_format_t	format;
+	bool			has_alpha;		// Some pixels aren't opaque
+	image_level_t	levels[MAX_IMAGE_LEVELS];
+
+private:
+	ubyte*			data;			// Every level in one block
+
+	image_t(const image_t&);
+	void operator=(const image_t&);
+};
+
+// Decode a file into image, the extension of name picks the decoder. Only the
+// common types are handled, paletted tgas and progressive jpgs fail. srgb is
+// passed on to build_mipmaps
+bool decode_image(const char* name, const ubyte* data, uint size, image_t& image, bool mipmaps, bool srgb = false);
+
+bool decode_tga(const ubyte* data, uint size, image_t& image, bool mipmaps);
+bool decode_jpeg(const ubyte* data, uint size, image_t& image, bool mipmaps);
+
+// Fill in every level after the first from the level before it. Sides of any
+// length are handled, odd ones with a 3 pixel filter. If srgb is set colours
+// are treated as sRGB and averaged as linear values
+void build_mipmaps(image_t& image, bool srgb = false);
+
+#endif
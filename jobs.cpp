@@ -0,0 +1,186 @@
+//-----------------------------------------------------------------------------
+// File: jobs.cpp
+//
+// Implementation of the worker thread pool
+//-----------------------------------------------------------------------------
+
+#include "jobs.h"
+#include "console.h"
+#include "exec.h"
+#include "util.h"
+#include <memory>
+
+#include "mem.h"
+#define new mem_new
+
+cvar_int_t job_threads("job_threads", 0, CVF_CONST, 0, MAX_JOB_THREADS);
+	// 0 = one thread per processor
+	// n = use n threads in total (including the main thread)
+
+namespace {
+	void
+	count_job(void* context, int job)
+	{
+		InterlockedIncrement(static_cast<volatile LONG*>(context) + job);
+	}
+}
+
+cvstr_t
+jobtest_callback(int argc, cvstr_t* argv)
+	// Run batches of jobs that count how often each job number is run and
+	// check every one ran exactly once, usage: jobtest [count] [batches]
+{
+	int count = 1000, batches = 100;
+	if (argc >= 1)
+		u_strtoi(argv[0].c_str(), count, count);
+	if (argc == 2)
+		u_strtoi(argv[1].c_str(), batches, batches);
+	count = u_max(count, 1);
+	batches = u_max(batches, 1);
+
+	LONG* runs = new LONG[count];
+	int failures = 0;
+	for (int batch = 0; batch < batches; ++batch) {
+		for (int i = 0; i < count; ++i)
+			runs[i] = 0;
+		jobs.run(count_job, runs, count);
+		for (int j = 0; j < count; ++j) {
+			if (runs[j] != 1) {
+				if (failures < 10)
+					console.printf("jobtest: batch %d, job %d ran %d times\n", batch, j, runs[j]);
+				++failures;
+			}
+		}
+	}
+	delete [] runs;
+
+	console.printf("jobtest: %d batches of %d jobs on %d threads, %d failures\n",
+		batches, count, jobs.num_threads(), failures);
+	return cvstr_t();
+}
+
+cfunc_t cf_jobtest("jobtest", jobtest_callback, 0, 2);
+
+jobs_t&
+jobs_t::get_instance()
+{
+	static std::auto_ptr<jobs_t> instance(new jobs_t());
+	return *instance;
+}
+
+jobs_t::jobs_t() :
+	num_workers(0),
+	start(0),
+	done(0),
+	quit(false),
+	job_func(0),
+	job_context(0),
+	job_count(0),
+	next_job(0),
+	workers_left(0)
+{
+}
+
+result_t
+jobs_t::init()
+	// Create the worker threads, the number of threads is taken from job_threads
+	// or from the number of processors if job_threads is 0
+{
+	int threads = *job_threads;
+	if (threads == 0) {
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		threads = u_min(static_cast<int>(info.dwNumberOfProcessors), MAX_JOB_THREADS);
+	}
+
+	start = CreateSemaphore(NULL, 0, MAX_JOB_THREADS, NULL);
+	done = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (start == NULL || done == NULL) {
+		destroy();
+		return "Job system failed to create its synchronization objects";
+	}
+
+	quit = false;
+	for (num_workers = 0; num_workers < threads - 1; ++num_workers) {
+		DWORD id;
+		workers[num_workers] = CreateThread(NULL, 0, worker_proc, this, 0, &id);
+		if (workers[num_workers] == NULL)
+			break;
+	}
+	console.printf("Job system using %d threads\n", num_threads());
+	return true;
+}
+
+void
+jobs_t::destroy()
+	// Tell the workers to quit and wait for them to do so
+{
+	if (num_workers) {
+		quit = true;
+		ReleaseSemaphore(start, num_workers, NULL);
+		WaitForMultipleObjects(num_workers, workers, TRUE, INFINITE);
+		for (int i = 0; i < num_workers; ++i)
+			CloseHandle(workers[i]);
+		num_workers = 0;
+	}
+	if (start) {
+		CloseHandle(start);
+		start = 0;
+	}
+	if (done) {
+		CloseHandle(done);
+		done = 0;
+	}
+}
+
+void
+jobs_t::run(job_func_t func, void* context, int count)
+{
+	if (num_workers == 0 || count <= 1) {
+		for (int i = 0; i < count; ++i)
+			func(context, i);
+		return;
+	}
+
+	job_func = func;
+	job_context = context;
+	job_count = count;
+	next_job = 0;
+	workers_left = num_workers;
+
+	// The semaphore is released once per worker, but workers_left counts
+	// those wakeups rather than distinct workers. A worker that finishes early
+	// can take a second wakeup while another sleeps through the batch. Every
+	// wakeup still checks back in before run() returns, so none is left over
+	// to pick up jobs from a stale batch
+	ReleaseSemaphore(start, num_workers, NULL);
+	work();
+	WaitForSingleObject(done, INFINITE);
+}
+
+void
+jobs_t::work()
+	// Take jobs from the current batch until there are none left
+{
+	for (;;) {
+		int job = InterlockedIncrement(&next_job) - 1;
+		if (job >= job_count)
+			return;
+		job_func(job_context, job);
+	}
+}
+
+DWORD WINAPI
+jobs_t::worker_proc(void* param)
+	// Worker thread main loop
+{
+	jobs_t* pool = static_cast<jobs_t*>(param);
+	for (;;) {
+		WaitForSingleObject(pool->start, INFINITE);
+		if (pool->quit)
+			return 0;
+		pool->work();
+		if (InterlockedDecrement(&pool->workers_left) == 0)
+			SetEvent(pool->done);
+	}
+}
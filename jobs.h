@@ -0,0 +1,60 @@
+//-----------------------------------------------------------------------------
+// File: jobs.h
+//
+// Worker threads for splitting a piece of work into a number of jobs that are
+// run in parallel. The thread calling run() takes part in the work and does
+// not return until every job in the batch has completed
+//-----------------------------------------------------------------------------
+
+#ifndef JOBS_H
+#define JOBS_H
+
+#include "win.h"
+#include "util.h"
+
+// Most threads (including the calling thread) that will ever run jobs
+#define MAX_JOB_THREADS		16
+
+// A job function, called once for each job number in [0, count)
+typedef void (*job_func_t)(void* context, int job);
+
+class jobs_t {
+	// Pool of worker threads
+public:
+	~jobs_t() { destroy(); }
+
+	result_t init();
+	void destroy();
+
+	// Run func for every job number from 0 to count - 1, the jobs are spread
+	// across the worker threads and the calling thread, returns when all are
+	// complete. Jobs may run in any order so must not depend on each other
+	void run(job_func_t func, void* context, int count);
+
+	// Number of threads that take part in run(), including the caller
+	int num_threads() const { return num_workers + 1; }
+
+	static jobs_t& get_instance();
+
+private:
+	jobs_t();
+
+	static DWORD WINAPI worker_proc(void* param);
+	void work();
+
+	int				num_workers;	// Number of worker threads created
+	HANDLE			workers[MAX_JOB_THREADS];
+	HANDLE			start;			// Released once per worker for each batch
+	HANDLE			done;			// Set when the last worker finishes a batch
+	bool			quit;			// Workers exit when woken if this is set
+
+	job_func_t		job_func;		// Current batch
+	void*			job_context;
+	int				job_count;
+	volatile LONG	next_job;		// Next job number to be taken
+	volatile LONG	workers_left;	// Workers yet to finish the current batch
+};
+
+#define jobs (jobs_t::get_instance())
+
+#endif
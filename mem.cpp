@@ -10,6 +10,7 @@
 #include <new>
 #include "util.h"
 #include "types.h"
+#include "win.h"
 #include "mem.h"
 
 #undef mem_new
@@ -141,6 +142,29 @@ namespace {
 	};
 	logfile_t log;
 
+	// The allocator is shared by the job and texture loader threads, every
+	// allocation and free holds this lock. Allocations are made before this
+	// file's constructors run, so rather than a critical_section_t it is set
+	// up by the first allocation, relying on mem_section_ready being zeroed
+	// before any code runs. The first allocation is always made by the main
+	// thread before any other thread exists. It is never deleted as memory
+	// is still freed while the statics are destroyed
+	CRITICAL_SECTION mem_section;
+	bool mem_section_ready;
+
+	class mem_lock_t {
+	public:
+		mem_lock_t()
+		{
+			if (!mem_section_ready) {
+				InitializeCriticalSectionAndSpinCount(&mem_section, LOCK_SPIN_COUNT);
+				mem_section_ready = true;
+			}
+			EnterCriticalSection(&mem_section);
+		}
+		~mem_lock_t()	{ LeaveCriticalSection(&mem_section); }
+	};
+
 	// Methods that do the actual memory allocation and freeing
 	inline void*
 	mem_alloc_final(size_t size)
@@ -244,7 +268,10 @@ operator new(size_t size, const char* file, const int line)
 		size = 1;
 	void* ptr;
 	do {
-		ptr = mem_alloc_debug(size, file, line, MEM_ALLOC_METHOD_NEW);
+		{
+			mem_lock_t lock;
+			ptr = mem_alloc_debug(size, file, line, MEM_ALLOC_METHOD_NEW);
+		}
 		if (ptr == 0) {
 			new_handler nh = set_new_handler(0);
 			set_new_handler(nh);
@@ -262,7 +289,10 @@ operator new[](size_t size, const char* file, const int line)
 		size = 1;
 	void* ptr;
 	do {
-		ptr = mem_alloc_debug(size, file, line, MEM_ALLOC_METHOD_NEW_ARRAY);
+		{
+			mem_lock_t lock;
+			ptr = mem_alloc_debug(size, file, line, MEM_ALLOC_METHOD_NEW_ARRAY);
+		}
 		if (ptr == 0) {
 			new_handler nh = set_new_handler(0);
 			set_new_handler(nh);
@@ -278,6 +308,7 @@ operator delete(void* ptr, const char* file, const int line)
 	// in a constructor call, for an object allocated using the overloaded
 	// operator new
 {
+	mem_lock_t lock;
 	mem_free_debug(ptr, MEM_FREE_METHOD_DELETE);
 }
 
@@ -287,6 +318,7 @@ operator delete[](void* ptr, const char* file, const int line)
 	// in a constructor call, for an object allocated using the overloaded
 	// operator new[]
 {
+	mem_lock_t lock;
 	mem_free_debug(ptr, MEM_FREE_METHOD_DELETE_ARRAY);
 }
 
@@ -301,9 +333,15 @@ operator new(size_t size)
 	void* ptr;
 	do {
 #ifdef MEM_DEBUGGING_ENABLED
-		ptr = mem_alloc_debug(size, "<new>", 0, MEM_ALLOC_METHOD_NEW);
+		{
+			mem_lock_t lock;
+			ptr = mem_alloc_debug(size, "<new>", 0, MEM_ALLOC_METHOD_NEW);
+		}
 #else
-		ptr = mem_alloc_final(size);
+		{
+			mem_lock_t lock;
+			ptr = mem_alloc_final(size);
+		}
 #endif
 		if (ptr == 0) {
 			new_handler nh = set_new_handler(0);
@@ -322,9 +360,15 @@ operator new[](size_t size)
 	void* ptr;
 	do {
 #ifdef MEM_DEBUGGING_ENABLED
-		ptr = mem_alloc_debug(size, "<new>", 0, MEM_ALLOC_METHOD_NEW_ARRAY);
+		{
+			mem_lock_t lock;
+			ptr = mem_alloc_debug(size, "<new>", 0, MEM_ALLOC_METHOD_NEW_ARRAY);
+		}
 #else
-		ptr = mem_alloc_final(size);
+		{
+			mem_lock_t lock;
+			ptr = mem_alloc_final(size);
+		}
 #endif
 		if (ptr == 0) {
 			new_handler nh = set_new_handler(0);
@@ -341,8 +385,10 @@ operator delete(void* ptr)
 	if (ptr == 0)
 		return;
 #ifdef MEM_DEBUGGING_ENABLED
+	mem_lock_t lock;
 	mem_free_debug(ptr, MEM_FREE_METHOD_DELETE);
 #else
+	mem_lock_t lock;
 	mem_free_final(ptr);
 #endif
 }
@@ -353,8 +399,10 @@ operator delete[](void* ptr)
 	if (ptr == 0)
 		return;
 #ifdef MEM_DEBUGGING_ENABLED
+	mem_lock_t lock;
 	mem_free_debug(ptr, MEM_FREE_METHOD_DELETE_ARRAY);
 #else
+	mem_lock_t lock;
 	mem_free_final(ptr);
 #endif
 }
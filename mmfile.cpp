@@ -23,8 +23,9 @@ mmfile_t::open(const char* filename)
 	if (file != INVALID_HANDLE_VALUE)
 		close();
 
-	// Open the file
-	if ((file = CreateFile(filename, GENERIC_READ, 0, NULL, OPEN_EXISTING, 0, NULL)) != INVALID_HANDLE_VALUE)
+	// Open the file, shared so several texture loader threads can read the
+	// same cache file at once
+	if ((file = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL)) != INVALID_HANDLE_VALUE)
 		// Dont map 0 length files
 		if ((view_size = GetFileSize(file, NULL)) != 0)
 			// Create a file mapping object
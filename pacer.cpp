@@ -0,0 +1,191 @@
+//-----------------------------------------------------------------------------
+// File: pacer.cpp
+//
+// Implementation of the frame pacer
+//-----------------------------------------------------------------------------
+
+#include "pacer.h"
+#include "console.h"
+#include "exec.h"
+#include "util.h"
+#include "win.h"
+#include <mmsystem.h>
+#include <math.h>
+#include <memory>
+
+#include "mem.h"
+#define new mem_new
+
+#pragma comment (lib, "winmm.lib")
+
+using std::auto_ptr;
+
+cvar_int_t max_fps("max_fps", 0, CVF_NONE, 0, 1000);
+	// 0 = draw frames as fast as possible
+	// n = draw at most n frames a second
+cvar_int_t idle_fps("idle_fps", 10, CVF_NONE, 0, 1000);
+	// 0 = draw frames at the normal rate when nothing is changing
+	// n = draw at most n frames a second when nothing is changing
+cvar_int_t pace_spin("pace_spin", 2, CVF_NONE, 0, 20);
+	// Milliseconds before a frame is due to stop sleeping and spin instead
+
+cvstr_t
+framestats_callback(int argc, cvstr_t* args)
+	// Show frame times since the last framestats, usage: framestats
+{
+	pacer.print_stats();
+	return cvstr_t();
+}
+
+cfunc_t cf_framestats("framestats", framestats_callback);
+
+namespace {
+	const DWORD HIDDEN_WAIT = 100;		// Milliseconds between checks while hidden
+}
+
+frame_pacer_t&
+frame_pacer_t::get_instance()
+{
+	static auto_ptr<frame_pacer_t> instance(new frame_pacer_t());
+	return *instance;
+}
+
+frame_pacer_t::frame_pacer_t() :
+	frequency(0),
+	next_due(0),
+	last_frame(0),
+	woken(false),
+	period_set(false)
+{
+	reset_stats();
+}
+
+void
+frame_pacer_t::init()
+	// Ask for 1ms sleeps, the default granularity is too coarse to pace with.
+	// Without a performance counter frames are drawn unpaced
+{
+	LARGE_INTEGER li;
+	if (!QueryPerformanceFrequency(&li))
+		li.QuadPart = 0;
+	frequency = li.QuadPart;
+	if (frequency == 0)
+		console.print("No performance counter, frames will not be paced\n");
+	else
+		period_set = timeBeginPeriod(1) == TIMERR_NOERROR;
+	next_due = 0;
+	last_frame = 0;
+	reset_stats();
+}
+
+void
+frame_pacer_t::destroy()
+{
+	if (period_set) {
+		timeEndPeriod(1);
+		period_set = false;
+	}
+}
+
+__int64
+frame_pacer_t::ticks() const
+{
+	LARGE_INTEGER li;
+	QueryPerformanceCounter(&li);
+	return li.QuadPart;
+}
+
+bool
+frame_pacer_t::wait(bool idle)
+{
+	if (IsIconic(hwnd) || !IsWindowVisible(hwnd)) {
+		++num_hidden;
+		last_frame = 0;		// Time spent hidden isn't a frame
+		MsgWaitForMultipleObjects(0, NULL, FALSE, HIDDEN_WAIT, QS_ALLINPUT);
+		return false;
+	}
+
+	idle = idle && !woken;
+	int fps = *max_fps;
+	if (idle && *idle_fps)
+		fps = fps ? u_min(fps, *idle_fps) : *idle_fps;
+
+	__int64 now = ticks();
+	if (fps && frequency) {
+		__int64 interval = frequency / fps;
+		if (next_due == 0)
+			next_due = now;
+		__int64 due = u_min(next_due, last_frame ? last_frame + interval : now);
+		while (now < due) {
+			DWORD ms = static_cast<DWORD>((due - now) * 1000 / frequency);
+			if (ms > static_cast<DWORD>(*pace_spin)) {
+				// Sleep in a message wait, anything arriving is handled first
+				// and the wait picks up where it left off on the next call
+				if (MsgWaitForMultipleObjects(0, NULL, FALSE, ms - *pace_spin, QS_ALLINPUT) == WAIT_OBJECT_0)
+					return false;
+			} else {
+				Sleep(0);
+			}
+			now = ticks();
+		}
+		// A frame more than an interval late starts a new schedule rather than
+		// hurrying the next few frames to catch up
+		next_due = now - due > interval ? now + interval : due + interval;
+	} else {
+		next_due = 0;
+	}
+
+	if (idle)
+		++num_idle;
+	woken = false;
+	record_frame(now);
+	return true;
+}
+
+void
+frame_pacer_t::record_frame(__int64 now)
+	// Add the time since the last frame to the statistics
+{
+	if (last_frame && frequency) {
+		double t = static_cast<double>(now - last_frame) / static_cast<double>(frequency);
+		++num_frames;
+		total_time += t;
+		total_squared += t * t;
+		if (t < min_time)
+			min_time = t;
+		if (t > max_time)
+			max_time = t;
+	}
+	last_frame = now;
+}
+
+void
+frame_pacer_t::reset_stats()
+{
+	num_frames = 0;
+	total_time = 0.0;
+	total_squared = 0.0;
+	min_time = 1.0e9;
+	max_time = 0.0;
+	num_idle = 0;
+	num_hidden = 0;
+}
+
+void
+frame_pacer_t::print_stats()
+	// The standard deviation of the frame times is what shows up as stutter,
+	// an even 30fps looks smoother than 60fps with the odd long frame
+{
+	if (num_frames == 0) {
+		console.print("No frames drawn since the last framestats\n");
+	} else {
+		double mean = total_time / num_frames;
+		double variance = total_squared / num_frames - mean * mean;
+		double deviation = variance > 0.0 ? sqrt(variance) : 0.0;
+		console.printf("%d frames, %.1f fps: mean %.3fms, std dev %.3fms, min %.3fms, max %.3fms\n",
+			num_frames, mean > 0.0 ? 1.0 / mean : 0.0, mean * 1000.0, deviation * 1000.0,
+			min_time * 1000.0, max_time * 1000.0);
+		console.printf("%d idle frames, %d waits while hidden\n", num_idle, num_hidden);
+	}
+	reset_stats();
+}
@@ -0,0 +1,60 @@
+//-----------------------------------------------------------------------------
+// File: pacer.h
+//
+// Frame pacer. Decides when the app draws a frame: never while the window is
+// minimized or hidden, at most max_fps times a second, and only idle_fps
+// times a second while nothing on screen is changing. Waits sleep until just
+// before a frame is due then spin for the rest, the sleep is a message wait
+// so input still wakes the main loop straight away
+//-----------------------------------------------------------------------------
+
+#ifndef PACER_H
+#define PACER_H
+
+class frame_pacer_t {
+public:
+	~frame_pacer_t() { destroy(); }
+
+	void init();
+	void destroy();
+
+	// Wait for the next frame to be due. Returns false if the frame should
+	// be skipped, either the window is hidden or a message arrived first and
+	// should be handled before waiting again. idle is true if nothing changed
+	// in the last frame drawn
+	bool wait(bool idle);
+
+	// Input has arrived, the next frame isn't idle whatever the app thinks
+	void wake() { woken = true; }
+
+	// Print the frame time statistics since they were last printed
+	void print_stats();
+
+	static frame_pacer_t& get_instance();
+
+private:
+	frame_pacer_t();
+
+	__int64	ticks() const;
+	void	record_frame(__int64 now);
+	void	reset_stats();
+
+	__int64	frequency;		// Ticks per second
+	__int64	next_due;		// Time the next frame may be drawn, 0 if unpaced
+	__int64	last_frame;		// Time the last frame was started, 0 if none
+	bool	woken;
+	bool	period_set;		// timeBeginPeriod succeeded
+
+	// Intervals between frames drawn, in seconds
+	int		num_frames;
+	double	total_time;
+	double	total_squared;
+	double	min_time;
+	double	max_time;
+	int		num_idle;		// Frames drawn at the idle rate
+	int		num_hidden;		// Waits skipped as the window was hidden
+};
+
+#define pacer (frame_pacer_t::get_instance())
+
+#endif
@@ -55,13 +55,25 @@ pak_file_finder_t::search(const char* dir, const char* mask)
 	return names.size();
 }
 
-pak_t::pak_t()
+namespace {
+	inline bool
+	is_image_name(const filename_t& name, int length)
+		// Whether name is a .tga or .jpg file
+	{
+		return length >= 4 && (u_fncmp(&name[length - 4], ".tga") == 0 || u_fncmp(&name[length - 4], ".jpg") == 0);
+	}
+}
+
+pak_t::pak_t() :
+	texture_index_size(0),
+	texture_index(0)
 {
 }
 
 pak_t::~pak_t()
 	// Delete the zip files
 {
+	delete [] texture_index;
 	for (int i = 0; i < zips.size(); i++)
 		delete zips[i];
 }
@@ -69,7 +81,62 @@ pak_t::~pak_t()
 result_t
 pak_t::init()
 {
-	return scan_dir(*pakdir);
+	result_t result = scan_dir(*pakdir);
+	build_texture_index();
+	return result;
+}
+
+void
+pak_t::build_texture_index()
+	// Index every image by its name less the extension, so a texture can be
+	// found with or without its extension by a single lookup. Later archives
+	// replace the entries of earlier ones
+{
+	int count = 0;
+	for (int z = 0; z < zips.size(); ++z)
+		for (int e = 0; e < zips[z]->num_entries(); ++e)
+			if (is_image_name(zips[z]->entry_name(e), zips[z]->entry_name(e).length()))
+				++count;
+
+	// Keep the index at most half full
+	delete [] texture_index;
+	for (texture_index_size = 1; texture_index_size < count * 2; texture_index_size <<= 1)
+		;
+	texture_index = new texture_slot_t[texture_index_size];
+	u_zeromem(texture_index, texture_index_size * sizeof(texture_slot_t));
+
+	for (int i = 0; i < zips.size(); ++i) {
+		for (int entry = 0; entry < zips[i]->num_entries(); ++entry) {
+			const filename_t& name = zips[i]->entry_name(entry);
+			int length = name.length();
+			if (!is_image_name(name, length))
+				continue;
+			uint hash = u_image_name_hash(name, length);
+			texture_slot_t* slot = find_texture_slot(name, length - 4, hash);
+			pak_location_t& location = u_fncmp(&name[length - 4], ".tga") == 0 ? slot->tga : slot->jpg;
+			slot->hash = hash;
+			location.zip = zips[i];
+			location.entry = entry;
+		}
+	}
+}
+
+pak_t::texture_slot_t*
+pak_t::find_texture_slot(const char* name, int length, uint hash)
+	// Find the slot for the first length characters of name, or the empty
+	// slot where it would go
+{
+	int mask = texture_index_size - 1;
+	for (int i = hash & mask; ; i = (i + 1) & mask) {
+		texture_slot_t* slot = &texture_index[i];
+		if (slot->tga.zip == 0 && slot->jpg.zip == 0)
+			return slot;
+		if (slot->hash != hash)
+			continue;
+		const filename_t& found = file_name(slot->tga.zip ? slot->tga : slot->jpg);
+		if (found.length() == length + 4 && found.cmpfnn(name, length) == 0)
+			return slot;
+	}
 }
 
 bool
@@ -115,6 +182,61 @@ pak_t::open_file(const char* name)
 	return 0;
 }
 
+bool
+pak_t::find_file(const char* name, pak_location_t& location)
+{
+	for (int i = zips.size() - 1; i >= 0; --i) {
+		int entry = zips[i]->find_entry(name);
+		if (entry != -1) {
+			location.zip = zips[i];
+			location.entry = entry;
+			return true;
+		}
+	}
+	location.zip = 0;
+	return false;
+}
+
+bool
+pak_t::find_texture(const char* name, pak_location_t& location)
+{
+	int full_length = u_strlen(name);
+	int length = full_length;
+	bool prefer_jpg = false;
+	if (length >= 4 && u_fncmp(name + length - 4, ".jpg") == 0) {
+		prefer_jpg = true;
+		length -= 4;
+	} else if (length >= 4 && u_fncmp(name + length - 4, ".tga") == 0) {
+		length -= 4;
+	}
+
+	if (texture_index_size) {
+		const texture_slot_t* slot = find_texture_slot(name, length, u_image_name_hash(name, full_length));
+		const pak_location_t& first = prefer_jpg ? slot->jpg : slot->tga;
+		const pak_location_t& second = prefer_jpg ? slot->tga : slot->jpg;
+		location = first.zip ? first : second;
+		if (location.zip)
+			return true;
+	}
+
+	// Not an image the index knows about, try the name as it is
+	return find_file(name, location);
+}
+
+file_t*
+pak_t::open_file(const pak_location_t& location)
+{
+	if (location.zip == 0)
+		return 0;
+	return location.zip->open_entry(location.entry);
+}
+
+const filename_t&
+pak_t::file_name(const pak_location_t& location) const
+{
+	return location.zip->entry_name(location.entry);
+}
+
 bool
 pak_t::file_exists(const char* name)
 	// Check if the file exists in the pak
@@ -20,6 +20,12 @@ private:
 	vector_t<filename_t> names;
 };
 
+struct pak_location_t {
+	// Where a file is in the archives
+	zip_t*	zip;		// 0 if there is no such file
+	int		entry;		// Entry number in zip
+};
+
 class pak_t {
 	// Several zip files representing all the files available to the app
 public:
@@ -33,12 +39,37 @@ public:
 	file_t* open_file(const char* name);
 	bool file_exists(const char* name);
 
+	// Find a file, the archives are searched newest first
+	bool find_file(const char* name, pak_location_t& location);
+
+	// Find the image for a texture. A .tga or .jpg extension on name is only
+	// a preference, either is accepted. This uses an index built by init so
+	// the archives only need searching if name has some other extension
+	bool find_texture(const char* name, pak_location_t& location);
+
+	file_t* open_file(const pak_location_t& location);
+	const filename_t& file_name(const pak_location_t& location) const;
+	uint file_crc(const pak_location_t& location) const { return location.zip->entry_crc(location.entry); }
+
 	static pak_t& get_instance();
 
 private:
+	struct texture_slot_t {
+		// The newest .tga and .jpg with the same name less the extension
+		uint			hash;
+		pak_location_t	tga;
+		pak_location_t	jpg;
+	};
+
 	pak_t();
 
+	void build_texture_index();
+	texture_slot_t* find_texture_slot(const char* name, int length, uint hash);
+
 	vector_t<zip_t*> zips;
+
+	int				texture_index_size;	// Number of slots, a power of 2
+	texture_slot_t*	texture_index;		// Open addressed, empty slots have no zips
 };
 
 #define pak (pak_t::get_instance())
@@ -0,0 +1,383 @@
+//-----------------------------------------------------------------------------
+// File: renderer.cpp
+//
+// Implementation of the state filter, the null render backend and recorded
+// frames
+//-----------------------------------------------------------------------------
+
+#include "renderer.h"
+#include "util.h"
+#include <stdio.h>
+
+#include "mem.h"
+#define new mem_new
+
+namespace {
+	const char* command_names[NUM_RENDER_COMMANDS] = {
+		"render states",
+		"stage states",
+		"textures",
+		"transforms",
+		"vertex formats",
+		"vertex uploads",
+		"index uploads",
+		"draws"
+	};
+}
+
+state_filter_t::state_filter_t() :
+	target(0),
+	enabled(true),
+	requested(0),
+	applied(0),
+	num_dirty(0)
+{
+	u_zeromem(dirty, sizeof(dirty));
+	invalidate();
+}
+
+void
+state_filter_t::set_enabled(bool e)
+{
+	if (e == enabled)
+		return;
+	flush();
+	enabled = e;
+	invalidate();
+}
+
+void
+state_filter_t::invalidate()
+{
+	u_zeromem(known, sizeof(known));
+}
+
+void
+state_filter_t::set(int slot, uint value)
+	// Note the value a state should have at the next draw
+{
+	++requested;
+	pending[slot] = value;
+	if (!enabled) {
+		apply(slot);
+		return;
+	}
+	if (!dirty[slot]) {
+		dirty[slot] = true;
+		dirty_slots[num_dirty++] = static_cast<ushort>(slot);
+	}
+}
+
+void
+state_filter_t::apply(int slot)
+	// Pass on the pending value of a slot if the target doesn't have it yet
+{
+	uint value = pending[slot];
+	if (known[slot] && current[slot] == value)
+		return;
+	current[slot] = value;
+	known[slot] = enabled;
+	++applied;
+
+	if (slot < SLOT_STAGE_STATES) {
+		target->set_render_state(slot, value);
+	} else if (slot < SLOT_TEXTURES) {
+		int stage_state = slot - SLOT_STAGE_STATES;
+		target->set_stage_state(stage_state / MAX_STAGE_STATES, stage_state % MAX_STAGE_STATES, value);
+	} else if (slot < SLOT_VERTEX_FORMAT) {
+		target->set_texture(slot - SLOT_TEXTURES, static_cast<htexture_t>(value));
+	} else {
+		target->set_vertex_format(value);
+	}
+}
+
+void
+state_filter_t::flush()
+{
+	for (int i = 0; i < num_dirty; ++i) {
+		dirty[dirty_slots[i]] = false;
+		apply(dirty_slots[i]);
+	}
+	num_dirty = 0;
+}
+
+void
+state_filter_t::set_render_state(uint state, uint value)
+{
+	if (state < MAX_RENDER_STATES)
+		set(state, value);
+	else
+		target->set_render_state(state, value);
+}
+
+void
+state_filter_t::set_stage_state(uint stage, uint state, uint value)
+{
+	if (stage < MAX_TEXTURE_STAGES && state < MAX_STAGE_STATES)
+		set(SLOT_STAGE_STATES + stage * MAX_STAGE_STATES + state, value);
+	else
+		target->set_stage_state(stage, state, value);
+}
+
+void
+state_filter_t::set_texture(uint stage, htexture_t texture)
+{
+	if (stage < MAX_TEXTURE_STAGES)
+		set(SLOT_TEXTURES + stage, texture);
+	else
+		target->set_texture(stage, texture);
+}
+
+void
+state_filter_t::set_transform(uint transform, const matrix_t& mat)
+	// Transforms are always passed straight on
+{
+	target->set_transform(transform, mat);
+}
+
+void
+state_filter_t::set_vertex_format(uint fvf)
+{
+	set(SLOT_VERTEX_FORMAT, fvf);
+}
+
+int
+state_filter_t::upload_verts(const void* verts, int count, int stride)
+{
+	return target->upload_verts(verts, count, stride);
+}
+
+int
+state_filter_t::upload_inds(const index_t* inds, int count)
+{
+	return target->upload_inds(inds, count);
+}
+
+void
+state_filter_t::draw(render_buffer_t vb, render_buffer_t ib, int stride, int base_vertex,
+	int min_index, int num_verts, int base_index, int num_tris)
+{
+	flush();
+	target->draw(vb, ib, stride, base_vertex, min_index, num_verts, base_index, num_tris);
+}
+
+null_backend_t::null_backend_t() :
+	cmds(0),
+	num_cmds(0),
+	max_cmds(0)
+{
+	reset();
+}
+
+null_backend_t::~null_backend_t()
+{
+	delete [] cmds;
+}
+
+void
+null_backend_t::reset()
+{
+	num_cmds = 0;
+	for (int i = 0; i < NUM_RENDER_COMMANDS; ++i)
+		counts[i] = 0;
+	redundant = 0;
+	tris = 0;
+	upload_bytes = 0;
+	next_vertex = 0;
+	next_index = 0;
+	u_zeromem(render_known, sizeof(render_known));
+	u_zeromem(stage_known, sizeof(stage_known));
+	u_zeromem(texture_known, sizeof(texture_known));
+}
+
+void
+null_backend_t::record(render_command_type_t type, uint stage, uint state, uint value)
+{
+	if (num_cmds == max_cmds) {
+		max_cmds = u_max(1024, max_cmds * 2);
+		render_command_t* grown = new render_command_t[max_cmds];
+		if (num_cmds)
+			u_memcpy(grown, cmds, num_cmds * sizeof(render_command_t));
+		delete [] cmds;
+		cmds = grown;
+	}
+	render_command_t& cmd = cmds[num_cmds++];
+	cmd.type = static_cast<ubyte>(type);
+	cmd.stage = static_cast<ubyte>(stage);
+	cmd.pad = 0;
+	cmd.state = state;
+	cmd.value = value;
+	++counts[type];
+}
+
+bool
+null_backend_t::change(uint& current, bool& known, uint value)
+	// Track the new value of a state, counting it if nothing changed
+{
+	if (known && current == value) {
+		++redundant;
+		return false;
+	}
+	current = value;
+	known = true;
+	return true;
+}
+
+void
+null_backend_t::set_render_state(uint state, uint value)
+{
+	record(RCMD_RENDER_STATE, 0, state, value);
+	if (state < MAX_RENDER_STATES)
+		change(render_states[state], render_known[state], value);
+}
+
+void
+null_backend_t::set_stage_state(uint stage, uint state, uint value)
+{
+	record(RCMD_STAGE_STATE, stage, state, value);
+	if (stage < MAX_TEXTURE_STAGES && state < MAX_STAGE_STATES)
+		change(stage_states[stage][state], stage_known[stage][state], value);
+}
+
+void
+null_backend_t::set_texture(uint stage, htexture_t texture)
+{
+	record(RCMD_TEXTURE, stage, 0, texture);
+	if (stage < MAX_TEXTURE_STAGES)
+		change(textures[stage], texture_known[stage], texture);
+}
+
+void
+null_backend_t::set_transform(uint transform, const matrix_t& mat)
+{
+	record(RCMD_TRANSFORM, 0, transform, 0);
+}
+
+void
+null_backend_t::set_vertex_format(uint fvf)
+{
+	record(RCMD_VERTEX_FORMAT, 0, 0, fvf);
+}
+
+int
+null_backend_t::upload_verts(const void* verts, int count, int stride)
+{
+	record(RCMD_UPLOAD_VERTS, 0, 0, count * stride);
+	upload_bytes += count * stride;
+	int vertex = next_vertex;
+	next_vertex += count;
+	return vertex;
+}
+
+int
+null_backend_t::upload_inds(const index_t* inds, int count)
+{
+	record(RCMD_UPLOAD_INDS, 0, 0, count * sizeof(index_t));
+	upload_bytes += count * sizeof(index_t);
+	int index = next_index;
+	next_index += count;
+	return index;
+}
+
+void
+null_backend_t::draw(render_buffer_t vb, render_buffer_t ib, int stride, int base_vertex,
+	int min_index, int num_verts, int base_index, int num_tris)
+{
+	record(RCMD_DRAW, vb | (ib << 1), num_verts, num_tris);
+	tris += num_tris;
+}
+
+const char*
+render_command_name(render_command_type_t type)
+{
+	return command_names[type];
+}
+
+void
+replay_commands(const render_command_t* cmds, int count, render_backend_t& backend)
+{
+	for (int i = 0; i < count; ++i) {
+		const render_command_t& cmd = cmds[i];
+		switch (cmd.type) {
+		case RCMD_RENDER_STATE:
+			backend.set_render_state(cmd.state, cmd.value);
+			break;
+		case RCMD_STAGE_STATE:
+			backend.set_stage_state(cmd.stage, cmd.state, cmd.value);
+			break;
+		case RCMD_TEXTURE:
+			backend.set_texture(cmd.stage, cmd.value);
+			break;
+		case RCMD_TRANSFORM:
+			backend.set_transform(cmd.state, matrix_t::identity);
+			break;
+		case RCMD_VERTEX_FORMAT:
+			backend.set_vertex_format(cmd.value);
+			break;
+		case RCMD_UPLOAD_VERTS:
+			backend.upload_verts(0, cmd.value, 1);
+			break;
+		case RCMD_UPLOAD_INDS:
+			backend.upload_inds(0, cmd.value / sizeof(index_t));
+			break;
+		case RCMD_DRAW:
+			backend.draw(static_cast<render_buffer_t>(cmd.stage & 1), static_cast<render_buffer_t>(cmd.stage >> 1),
+				0, 0, 0, cmd.state, 0, cmd.value);
+			break;
+		}
+	}
+}
+
+void
+count_replay(const render_command_t* cmds, int count, null_backend_t& backend, recording_header_t& header)
+{
+	state_filter_t filter;
+	filter.set_target(&backend);
+	replay_commands(cmds, count, filter);
+	filter.flush();
+
+	header.magic = RECORDING_MAGIC;
+	header.version = RECORDING_VERSION;
+	header.num_commands = count;
+	for (int i = 0; i < NUM_RENDER_COMMANDS; ++i)
+		header.counts[i] = backend.count(static_cast<render_command_type_t>(i));
+	header.redundant = backend.redundant_changes();
+	header.tris = backend.num_tris();
+}
+
+bool
+save_recording(const char* filename, const render_command_t* cmds, int count)
+{
+	null_backend_t backend;
+	recording_header_t header;
+	count_replay(cmds, count, backend, header);
+
+	FILE* file = fopen(filename, "wb");
+	if (!file)
+		return false;
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+		(count == 0 || fwrite(cmds, sizeof(render_command_t), count, file) == static_cast<size_t>(count));
+	return fclose(file) == 0 && ok;
+}
+
+bool
+load_recording(const char* filename, recording_header_t& header, render_command_t*& cmds)
+{
+	cmds = 0;
+	FILE* file = fopen(filename, "rb");
+	if (!file)
+		return false;
+	bool ok = fread(&header, sizeof(header), 1, file) == 1 && header.magic == RECORDING_MAGIC &&
+		header.version == RECORDING_VERSION && header.num_commands >= 0;
+	if (ok) {
+		cmds = new render_command_t[header.num_commands];
+		ok = header.num_commands == 0 ||
+			fread(cmds, sizeof(render_command_t), header.num_commands, file) == static_cast<size_t>(header.num_commands);
+		if (!ok) {
+			delete [] cmds;
+			cmds = 0;
+		}
+	}
+	fclose(file);
+	return ok;
+}
@@ -0,0 +1,221 @@
+//-----------------------------------------------------------------------------
+// File: renderer.h
+//
+// Render backends. d3d_t works out what has to be drawn for a display list
+// and hands the resulting stream of state changes, uploads and draws to a
+// backend, which either passes them on to the device or just records them.
+// Nothing here needs Direct3D or the rest of the app, so recorded frames can
+// be replayed by tools/replay.cpp on machines without a GPU
+//-----------------------------------------------------------------------------
+
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include "displaylist.h"
+#include "maths.h"
+
+// Highest state numbers the backends track, render and texture stage states
+// use the Direct3D 8 numbering so the device backend can pass them through
+#define MAX_RENDER_STATES		256
+#define MAX_TEXTURE_STAGES		8
+#define MAX_STAGE_STATES		32
+
+enum render_buffer_t {
+	RB_DYNAMIC,				// Filled by upload_verts / upload_inds this frame
+	RB_STATIC				// Loaded along with the map
+};
+
+enum render_command_type_t {
+	RCMD_RENDER_STATE,		// state, value
+	RCMD_STAGE_STATE,		// stage, state, value
+	RCMD_TEXTURE,			// stage, value = texture handle
+	RCMD_TRANSFORM,			// state = transform type
+	RCMD_VERTEX_FORMAT,		// value = vertex format
+	RCMD_UPLOAD_VERTS,		// value = bytes uploaded
+	RCMD_UPLOAD_INDS,		// value = bytes uploaded
+	RCMD_DRAW,				// stage = vertex buffer | index buffer << 1, state = vertices, value = triangles
+	NUM_RENDER_COMMANDS
+};
+
+struct render_command_t {
+	// A single recorded command, see render_command_type_t for the meaning
+	// of the fields for each type
+	ubyte	type;
+	ubyte	stage;
+	ushort	pad;
+	uint	state;
+	uint	value;
+};
+
+class render_backend_t {
+	// Receives the commands for drawing display lists
+public:
+	virtual ~render_backend_t() {}
+
+	virtual void set_render_state(uint state, uint value) = 0;
+	virtual void set_stage_state(uint stage, uint state, uint value) = 0;
+	virtual void set_texture(uint stage, htexture_t texture) = 0;
+	virtual void set_transform(uint transform, const matrix_t& mat) = 0;
+	virtual void set_vertex_format(uint fvf) = 0;
+
+	// Copy vertices or indices into the dynamic buffers, returns the number of
+	// the first vertex or index written
+	virtual int upload_verts(const void* verts, int count, int stride) = 0;
+	virtual int upload_inds(const index_t* inds, int count) = 0;
+
+	// Draw an indexed triangle list
+	virtual void draw(render_buffer_t vb, render_buffer_t ib, int stride, int base_vertex,
+		int min_index, int num_verts, int base_index, int num_tris) = 0;
+};
+
+class state_filter_t : public render_backend_t {
+	// Shadow state cache sitting in front of another backend. State changes
+	// are held back until the next draw and only those leaving a state
+	// different from what the target already has are passed on, so the
+	// reset in one end_pass followed by the set in the next begin_pass costs
+	// nothing and switching between two passes only sends the difference
+public:
+	state_filter_t();
+
+	// Set the backend the filtered commands go to, this forgets the state
+	void set_target(render_backend_t* t) { target = t; invalidate(); }
+	render_backend_t* get_target() const { return target; }
+
+	// When disabled every change is passed on as soon as it is made
+	void set_enabled(bool e);
+	bool is_enabled() const { return enabled; }
+
+	// Forget what the target's state is, the next change to each is sent
+	void invalidate();
+
+	// Pass on any changes being held back
+	void flush();
+
+	// Number of state changes dropped since the filter was created
+	int filtered() const { return requested - applied; }
+
+	void set_render_state(uint state, uint value);
+	void set_stage_state(uint stage, uint state, uint value);
+	void set_texture(uint stage, htexture_t texture);
+	void set_transform(uint transform, const matrix_t& mat);
+	void set_vertex_format(uint fvf);
+	int upload_verts(const void* verts, int count, int stride);
+	int upload_inds(const index_t* inds, int count);
+	void draw(render_buffer_t vb, render_buffer_t ib, int stride, int base_vertex,
+		int min_index, int num_verts, int base_index, int num_tris);
+
+private:
+	// Every filtered state has a slot, render states first, then the stage
+	// states for each stage, the textures for each stage and the vertex format
+	enum {
+		SLOT_STAGE_STATES = MAX_RENDER_STATES,
+		SLOT_TEXTURES = SLOT_STAGE_STATES + MAX_TEXTURE_STAGES * MAX_STAGE_STATES,
+		SLOT_VERTEX_FORMAT = SLOT_TEXTURES + MAX_TEXTURE_STAGES,
+		NUM_SLOTS
+	};
+
+	void set(int slot, uint value);
+	void apply(int slot);
+
+	render_backend_t* target;
+	bool enabled;
+	int requested;			// State changes asked for
+	int applied;			// State changes passed on to the target
+
+	uint current[NUM_SLOTS];	// Value the target has, if known
+	uint pending[NUM_SLOTS];	// Value to have at the next draw, if dirty
+	bool known[NUM_SLOTS];
+	bool dirty[NUM_SLOTS];
+	ushort dirty_slots[NUM_SLOTS];
+	int num_dirty;
+};
+
+class null_backend_t : public render_backend_t {
+	// Records commands without drawing anything, keeping a count of each type
+	// and of the state changes that set a state to the value it already had
+public:
+	null_backend_t();
+	~null_backend_t();
+
+	// Forget the recorded commands and the current state
+	void reset();
+
+	int num_commands() const { return num_cmds; }
+	const render_command_t* commands() const { return cmds; }
+	int count(render_command_type_t type) const { return counts[type]; }
+	int redundant_changes() const { return redundant; }
+	int num_tris() const { return tris; }
+	int uploaded_bytes() const { return upload_bytes; }
+
+	void set_render_state(uint state, uint value);
+	void set_stage_state(uint stage, uint state, uint value);
+	void set_texture(uint stage, htexture_t texture);
+	void set_transform(uint transform, const matrix_t& mat);
+	void set_vertex_format(uint fvf);
+	int upload_verts(const void* verts, int count, int stride);
+	int upload_inds(const index_t* inds, int count);
+	void draw(render_buffer_t vb, render_buffer_t ib, int stride, int base_vertex,
+		int min_index, int num_verts, int base_index, int num_tris);
+
+private:
+	// Not copyable
+	null_backend_t(const null_backend_t&);
+	null_backend_t& operator=(const null_backend_t&);
+
+	void record(render_command_type_t type, uint stage, uint state, uint value);
+	bool change(uint& current, bool& known, uint value);
+
+	render_command_t* cmds;
+	int num_cmds;
+	int max_cmds;
+
+	int counts[NUM_RENDER_COMMANDS];
+	int redundant;
+	int tris;
+	int upload_bytes;		// Vertex and index bytes copied
+	int next_vertex;
+	int next_index;
+
+	// Last value set for each state, only valid where known is set
+	uint render_states[MAX_RENDER_STATES];
+	bool render_known[MAX_RENDER_STATES];
+	uint stage_states[MAX_TEXTURE_STAGES][MAX_STAGE_STATES];
+	bool stage_known[MAX_TEXTURE_STAGES][MAX_STAGE_STATES];
+	uint textures[MAX_TEXTURE_STAGES];
+	bool texture_known[MAX_TEXTURE_STAGES];
+};
+
+// Name of a command type, for printing counts
+const char* render_command_name(render_command_type_t type);
+
+// Send recorded commands to a backend. Only what the null backend records is
+// kept, so uploads send no data and transforms are the identity
+void replay_commands(const render_command_t* cmds, int count, render_backend_t& backend);
+
+// A recorded frame is this header followed by the commands. The counts are
+// what the commands produced replayed through a state filter into a null
+// backend when they were saved, replaying them again should match
+#define RECORDING_MAGIC		0x44434552	// "RECD"
+#define RECORDING_VERSION	1
+
+struct recording_header_t {
+	uint	magic;
+	uint	version;
+	int		num_commands;
+	int		counts[NUM_RENDER_COMMANDS];
+	int		redundant;
+	int		tris;
+};
+
+// Replay cmds through a state filter into backend and fill in the counts of
+// header from what the backend received
+void count_replay(const render_command_t* cmds, int count, null_backend_t& backend, recording_header_t& header);
+
+// Write a recording, returns false if the file couldn't be written
+bool save_recording(const char* filename, const render_command_t* cmds, int count);
+
+// Read a recording, the commands are allocated with new []. Returns false if
+// the file couldn't be read or isn't a recording
+bool load_recording(const char* filename, recording_header_t& header, render_command_t*& cmds);
+
+#endif
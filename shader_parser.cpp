@@ -163,6 +163,7 @@ namespace {
 		{ "turb",					SK_TURB						},
 		{ "twosided",				SK_TWOSIDED					},
 		{ "underwater",				SK_UNDERWATER				},
+		{ "vector",					SK_VECTOR					},
 		{ "vertex",					SK_VERTEX					},
 		{ "water",					SK_WATER					},
 		{ "wave",					SK_WAVE						},
@@ -395,6 +396,7 @@ namespace {
 	 			{ SK_BASE, SE_END },
 	 			{ SK_ENVIRONMENT, SE_END },
 	 			{ SK_LIGHTMAP, SE_END },
+	 			{ SK_VECTOR, SE_VECTOR, SE_VECTOR, SE_END },
 				{ SE_END },
 	 		}
 		},
@@ -414,6 +416,11 @@ namespace {
 				{ SE_END },
 	 		}
 		},
+		{ 	"VECTOR", SE_VECTOR, EXPR_COMPONENT, {
+	 			{ SK_LEFT_BRACKET, SL_FLOAT, SL_FLOAT, SL_FLOAT, SK_RIGHT_BRACKET, SE_END },
+				{ SE_END },
+	 		}
+		},
 		{ 	"WAVEFUNC", SE_WAVEFUNC, EXPR_COMPONENT, {
 	 			{ SE_WAVETYPE, SL_FLOAT, SL_FLOAT, SL_FLOAT, SL_FLOAT, SE_END },
 				{ SE_END },
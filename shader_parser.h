@@ -144,6 +144,7 @@ enum token_type_t {
 	SK_TURB,
 	SK_TWOSIDED,
 	SK_UNDERWATER,
+	SK_VECTOR,
 	SK_VERTEX,
 	SK_WATER,
 	SK_WAVE,
@@ -173,6 +174,7 @@ enum token_type_t {
 	SE_TCGEN,
 	SE_TCMOD,
 	SE_TURB,
+	SE_VECTOR,
 	SE_WAVEFUNC,
 	SE_WAVETYPE,
 };
@@ -0,0 +1,17 @@
+//-----------------------------------------------------------------------------
+// File: simd.h
+//
+// Selects the SIMD instruction set used by the vector code paths. SSE2 is
+// used on x86 unless NO_SIMD is defined, every SIMD path has a plain C++
+// version for other builds
+//-----------------------------------------------------------------------------
+
+#ifndef SIMD_H
+#define SIMD_H
+
+#if !defined(NO_SIMD) && (defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__))
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
+
+#endif
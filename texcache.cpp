@@ -0,0 +1,140 @@
+//-----------------------------------------------------------------------------
+// File: texcache.cpp
+//
+// Implementation of the texture cache
+//-----------------------------------------------------------------------------
+
+#include "texcache.h"
+#include "mmfile.h"
+#include "console.h"
+#include "exec.h"
+#include "util.h"
+#include "win.h"
+#include <memory>
+
+#include "mem.h"
+#define new mem_new
+
+using std::auto_ptr;
+
+cvar_int_t texture_cache("texture_cache", 1, CVF_CONST, 0, 1);
+	// 0 = compress textures again every time they are loaded
+	// 1 = save compressed textures in texture_cache_dir and reuse them
+cvar_str_t texture_cache_dir("texture_cache_dir", "texcache", CVF_CONST);
+
+namespace {
+	const uint TEXCACHE_MAGIC = 0x31435451;	// "QTC1", change if the layout changes
+	const int MAX_CACHE_NAME = 260;
+
+	#pragma pack (push, 1)
+	struct texcache_header_t {
+		uint	magic;
+		uint	crc;		// Crc of the pak entry the texture was made from
+		uint	size;		// Uncompressed size of the pak entry
+		uint	flags;
+		int		format;
+		int		width;
+		int		height;
+		int		num_levels;
+		int		has_alpha;
+		int		data_size;	// Bytes of image data after the header
+	};
+	#pragma pack (pop)
+}
+
+texture_cache_t&
+texture_cache_t::get_instance()
+{
+	static auto_ptr<texture_cache_t> instance(new texture_cache_t());
+	return *instance;
+}
+
+result_t
+texture_cache_t::init()
+	// Make sure the cache directory exists, the cache is left off if it can't
+	// be created
+{
+	active = false;
+	if (!*texture_cache)
+		return true;
+	if (!CreateDirectory(texture_cache_dir->c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+		console.printf("Texture cache disabled, unable to create %s\n", texture_cache_dir->c_str());
+		return true;
+	}
+	active = true;
+	console.printf("Texture cache in %s\n", texture_cache_dir->c_str());
+	return true;
+}
+
+void
+texture_cache_t::file_name(char* name, int length, uint crc, uint size, uint flags)
+{
+	u_snprintf(name, length, "%s/%08x%08x%02x.tex", texture_cache_dir->c_str(), crc, size, flags);
+}
+
+bool
+texture_cache_t::load(uint crc, uint size, uint flags, image_t& image)
+	// Read a cached texture into image, returns false if there isn't one or
+	// it doesn't match
+{
+	if (!active)
+		return false;
+
+	char name[MAX_CACHE_NAME];
+	file_name(name, MAX_CACHE_NAME, crc, size, flags);
+	mmfile_t file;
+	if (!file.open(name) || file.size() < sizeof(texcache_header_t))
+		return false;
+
+	const texcache_header_t* header = reinterpret_cast<const texcache_header_t*>(file.data());
+	if (header->magic != TEXCACHE_MAGIC || header->crc != crc || header->size != size || header->flags != flags ||
+		(header->format != IMAGE_DXT1 && header->format != IMAGE_DXT5) ||
+		header->width <= 0 || header->height <= 0 || header->num_levels < 1 || header->num_levels > MAX_IMAGE_LEVELS)
+		return false;
+
+	image.allocate(header->width, header->height, header->num_levels > 1, static_cast<image_format_t>(header->format));
+	if (image.num_levels != header->num_levels || image.size() != header->data_size ||
+		file.size() != sizeof(texcache_header_t) + header->data_size) {
+		image.clear();
+		return false;
+	}
+	u_memcpy(image.levels[0].pixels, header + 1, header->data_size);
+	image.has_alpha = header->has_alpha != 0;
+	return true;
+}
+
+void
+texture_cache_t::store(uint crc, uint size, uint flags, const image_t& image)
+	// Save a compressed texture. It is written under a name unique to this
+	// thread and then renamed, so a reader never sees a partial file
+{
+	if (!active || image.num_levels == 0 || image.format == IMAGE_BGRA)
+		return;
+
+	texcache_header_t header;
+	header.magic = TEXCACHE_MAGIC;
+	header.crc = crc;
+	header.size = size;
+	header.flags = flags;
+	header.format = image.format;
+	header.width = image.levels[0].width;
+	header.height = image.levels[0].height;
+	header.num_levels = image.num_levels;
+	header.has_alpha = image.has_alpha ? 1 : 0;
+	header.data_size = image.size();
+
+	char name[MAX_CACHE_NAME];
+	char temp[MAX_CACHE_NAME];
+	file_name(name, MAX_CACHE_NAME, crc, size, flags);
+	u_snprintf(temp, MAX_CACHE_NAME, "%s.%x", name, GetCurrentThreadId());
+
+	HANDLE file = CreateFile(temp, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return;
+	DWORD written;
+	bool ok = WriteFile(file, &header, sizeof(header), &written, NULL) && written == sizeof(header) &&
+		WriteFile(file, image.levels[0].pixels, header.data_size, &written, NULL) && written == static_cast<DWORD>(header.data_size);
+	CloseHandle(file);
+	if (!ok || !MoveFile(temp, name))
+		DeleteFile(temp);
+}
@@ -0,0 +1,40 @@
+//-----------------------------------------------------------------------------
+// File: texcache.h
+//
+// Texture cache. Compressed textures are saved to disk, one file each, named
+// after the crc and size of the pak entry they came from so a changed image
+// is never mistaken for the cached one. The levels are stored in the order
+// and layout image_t keeps them in, so a cached texture is read with a
+// single copy out of the memory mapped file
+//-----------------------------------------------------------------------------
+
+#ifndef TEXCACHE_H
+#define TEXCACHE_H
+
+#include "image.h"
+#include "util.h"
+
+class texture_cache_t {
+public:
+	result_t init();
+
+	// Both of these may be called from any thread. flags should hold any
+	// options that change the image made from a file, such as mipmapping
+	bool load(uint crc, uint size, uint flags, image_t& image);
+	void store(uint crc, uint size, uint flags, const image_t& image);
+
+	bool enabled() const { return active; }
+
+	static texture_cache_t& get_instance();
+
+private:
+	texture_cache_t() : active(false) {}
+
+	void file_name(char* name, int length, uint crc, uint size, uint flags);
+
+	bool active;
+};
+
+#define texcache (texture_cache_t::get_instance())
+
+#endif
@@ -0,0 +1,211 @@
+//-----------------------------------------------------------------------------
+// File: texload.cpp
+//
+// Implementation of the texture loader
+//-----------------------------------------------------------------------------
+
+#include "texload.h"
+#include "texcache.h"
+#include "dxt.h"
+#include "console.h"
+#include "exec.h"
+#include "util.h"
+#include <memory>
+
+#include "mem.h"
+#define new mem_new
+
+using std::auto_ptr;
+
+cvar_int_t texture_threads("texture_threads", 2, CVF_CONST, 0, MAX_TEXTURE_THREADS);
+	// 0 = decode textures on the render thread
+	// n = decode textures on n worker threads
+cvar_int_t texture_queue("texture_queue", 16, CVF_CONST, 1, 1024);
+	// Most textures requested but not yet collected
+cvar_int_t texture_srgb_mipmaps("texture_srgb_mipmaps", 0, CVF_CONST, 0, 1);
+	// 0 = average texture colours as they are stored
+	// 1 = treat texture colours as sRGB and average them as linear values
+cvar_int_t texture_compression("texture_compression", 1, CVF_CONST, 0, 1);
+	// 0 = keep textures as 32 bit colour
+	// 1 = compress textures to dxt1 or dxt5 if the device supports them
+
+texture_loader_t&
+texture_loader_t::get_instance()
+{
+	static auto_ptr<texture_loader_t> instance(new texture_loader_t());
+	return *instance;
+}
+
+texture_loader_t::texture_loader_t() :
+	num_workers(0),
+	queued(0),
+	quit(false),
+	depth(0),
+	loads(0),
+	head(0),
+	tail(0),
+	next_load(0),
+	compress(false)
+{
+}
+
+result_t
+texture_loader_t::init()
+	// Create the queue and the worker threads
+{
+	depth = *texture_queue;
+	loads = new load_t[depth];
+	for (int i = 0; i < depth; ++i)
+		loads[i].ready = 0;
+	head = 0;
+	tail = 0;
+	next_load = 0;
+
+	queued = CreateSemaphore(NULL, 0, depth + MAX_TEXTURE_THREADS, NULL);
+	if (queued == NULL) {
+		destroy();
+		return "Texture loader failed to create its queue semaphore";
+	}
+
+	quit = false;
+	for (num_workers = 0; num_workers < *texture_threads; ++num_workers) {
+		DWORD id;
+		workers[num_workers] = CreateThread(NULL, 0, worker_proc, this, 0, &id);
+		if (workers[num_workers] == NULL)
+			break;
+		SetThreadPriority(workers[num_workers], THREAD_PRIORITY_BELOW_NORMAL);
+	}
+	console.printf("Texture loader using %d threads, queue depth %d\n", num_workers, depth);
+	return true;
+}
+
+void
+texture_loader_t::destroy()
+	// Tell the workers to quit and wait for them to do so
+{
+	if (num_workers) {
+		quit = true;
+		ReleaseSemaphore(queued, num_workers, NULL);
+		WaitForMultipleObjects(num_workers, workers, TRUE, INFINITE);
+		for (int i = 0; i < num_workers; ++i)
+			CloseHandle(workers[i]);
+		num_workers = 0;
+	}
+	if (queued) {
+		CloseHandle(queued);
+		queued = 0;
+	}
+	delete [] loads;
+	loads = 0;
+	depth = 0;
+	head = 0;
+	tail = 0;
+}
+
+bool
+texture_loader_t::request(int id, const pak_location_t& location, bool mipmaps)
+{
+	if (tail - head == depth)
+		return false;
+
+	load_t& load = loads[tail % depth];
+	load.id = id;
+	load.location = location;
+	load.mipmaps = mipmaps;
+	load.ready = 0;
+	++tail;
+
+	if (num_workers)
+		ReleaseSemaphore(queued, 1, NULL);
+	else
+		decode(load);
+	return true;
+}
+
+bool
+texture_loader_t::collect(int& id, image_t& image)
+{
+	if (head == tail || !loads[head % depth].ready)
+		return false;
+
+	load_t& load = loads[head % depth];
+	id = load.id;
+	image.swap(load.image);
+	load.image.clear();
+	load.ready = 0;
+	++head;
+	return true;
+}
+
+bool
+texture_loader_t::load(const pak_location_t& location, bool mipmaps, image_t& image)
+{
+	decode_file(location, mipmaps, image);
+	return image.num_levels != 0;
+}
+
+void
+texture_loader_t::discard()
+{
+	for (; head != tail; ++head) {
+		load_t& load = loads[head % depth];
+		while (!load.ready)
+			Sleep(1);
+		load.image.clear();
+		load.ready = 0;
+	}
+}
+
+void
+texture_loader_t::set_compression(bool supported)
+{
+	compress = supported && *texture_compression != 0;
+	if (compress)
+		console.print("Texture loader compressing textures to dxt\n");
+}
+
+void
+texture_loader_t::decode(load_t& load)
+{
+	decode_file(load.location, load.mipmaps, load.image);
+	InterlockedExchange(&load.ready, 1);
+}
+
+void
+texture_loader_t::decode_file(const pak_location_t& location, bool mipmaps, image_t& image)
+	// Read and decode a single texture, the image is left empty on failure.
+	// Compressed textures come from the texture cache when they are in it
+{
+	auto_ptr<file_t> file(pak.open_file(location));
+	bool srgb = *texture_srgb_mipmaps != 0;
+	uint flags = (mipmaps ? 1 : 0) | (srgb ? 2 : 0);
+	uint crc = file.get() ? pak.file_crc(location) : 0;
+	if (!file.get()) {
+		image.clear();
+	} else if (compress && texcache.load(crc, file->size(), flags, image)) {
+		// Nothing else to do
+	} else if (!decode_image(pak.file_name(location), file->data(), file->size(), image, mipmaps, srgb)) {
+		image.clear();
+	} else if (compress) {
+		// Images with sides that aren't multiples of 4 stay uncompressed
+		image_t compressed;
+		if (compress_dxt(image, compressed)) {
+			image.swap(compressed);
+			texcache.store(crc, file->size(), flags, image);
+		}
+	}
+}
+
+DWORD WINAPI
+texture_loader_t::worker_proc(void* param)
+	// Worker thread main loop, requests are taken in the order they were made
+{
+	texture_loader_t* loader = static_cast<texture_loader_t*>(param);
+	for (;;) {
+		WaitForSingleObject(loader->queued, INFINITE);
+		if (loader->quit)
+			return 0;
+		int n = InterlockedIncrement(&loader->next_load) - 1;
+		loader->decode(loader->loads[n % loader->depth]);
+	}
+}
@@ -0,0 +1,88 @@
+//-----------------------------------------------------------------------------
+// File: texload.h
+//
+// Texture loader. Texture files are read from the paks and decoded into
+// images with their mipmaps on worker threads, leaving the render thread to
+// copy the finished images into the device. Where the device supports it the
+// images are also compressed to dxt, and the results kept in the texture
+// cache so the compression is only done once
+//-----------------------------------------------------------------------------
+
+#ifndef TEXLOAD_H
+#define TEXLOAD_H
+
+#include "image.h"
+#include "pak.h"
+#include "win.h"
+
+// Most worker threads the loader will create
+#define MAX_TEXTURE_THREADS		8
+
+class texture_loader_t {
+	// Decodes textures in the order they are requested. At most queue depth
+	// requests can be outstanding, which bounds the memory held by decoded
+	// images waiting to be collected
+public:
+	~texture_loader_t() { destroy(); }
+
+	result_t init();
+	void destroy();
+
+	// Ask for a texture to be decoded, id is handed back by collect. Returns
+	// false if the queue is full
+	bool request(int id, const pak_location_t& location, bool mipmaps);
+
+	// Take the oldest request if it has been decoded, returns false if it
+	// hasn't. image is empty if the texture couldn't be decoded
+	bool collect(int& id, image_t& image);
+
+	// Decode a texture on the calling thread, compressing and caching it
+	// the same as a request. Returns false and leaves image empty on failure
+	bool load(const pak_location_t& location, bool mipmaps, image_t& image);
+
+	// Number of requests that haven't been collected
+	int pending() const { return tail - head; }
+
+	// Wait for every outstanding request and throw the results away
+	void discard();
+
+	int num_threads() const { return num_workers; }
+
+	// Whether the device can use dxt textures, set before any request is
+	// made. Textures are only compressed if texture_compression is also set
+	void set_compression(bool supported);
+	bool compressing() const { return compress; }
+
+	static texture_loader_t& get_instance();
+
+private:
+	struct load_t {
+		int				id;
+		pak_location_t	location;
+		bool			mipmaps;
+		image_t			image;
+		volatile LONG	ready;		// Set by the worker once image is done
+	};
+
+	texture_loader_t();
+
+	static DWORD WINAPI worker_proc(void* param);
+	void decode(load_t& load);
+	void decode_file(const pak_location_t& location, bool mipmaps, image_t& image);
+
+	int				num_workers;
+	HANDLE			workers[MAX_TEXTURE_THREADS];
+	HANDLE			queued;			// Released once for each request
+	bool			quit;			// Workers exit when woken if this is set
+
+	int				depth;			// Number of slots
+	load_t*			loads;			// Ring of requests, slot n % depth
+	int				head;			// Oldest uncollected request
+	int				tail;			// Next request number
+	volatile LONG	next_load;		// Next request to be decoded by a worker
+	bool			compress;		// Compress decoded images to dxt
+};
+
+#define texloader (texture_loader_t::get_instance())
+
+#endif
@@ -0,0 +1,74 @@
+//-----------------------------------------------------------------------------
+// File: tools/replay.cpp
+//
+// Regression check for the render backends that runs without a window, a
+// device or a GPU. Frames saved with the recordframe console command are
+// replayed through the state filter into the null backend and the command,
+// redundant state and triangle counts compared with the ones saved alongside
+// them. Build with renderer.cpp, maths.cpp, util.cpp and mem.cpp
+//
+// usage: replay recording...
+// Exits with 0 if every recording still produces the same counts
+//-----------------------------------------------------------------------------
+
+#include "../renderer.h"
+#include <stdio.h>
+
+#include "../mem.h"
+#define new mem_new
+
+namespace {
+	bool
+	check_recording(const char* filename)
+		// Replay one recording, printing any count that has changed
+	{
+		recording_header_t expected;
+		render_command_t* cmds;
+		if (!load_recording(filename, expected, cmds)) {
+			printf("%s: unable to read recording\n", filename);
+			return false;
+		}
+
+		null_backend_t backend;
+		recording_header_t actual;
+		count_replay(cmds, expected.num_commands, backend, actual);
+		delete [] cmds;
+
+		bool match = true;
+		for (int i = 0; i < NUM_RENDER_COMMANDS; ++i) {
+			if (actual.counts[i] != expected.counts[i]) {
+				printf("%s: %d %s, expected %d\n", filename, actual.counts[i],
+					render_command_name(static_cast<render_command_type_t>(i)), expected.counts[i]);
+				match = false;
+			}
+		}
+		if (actual.redundant != expected.redundant) {
+			printf("%s: %d redundant states, expected %d\n", filename, actual.redundant, expected.redundant);
+			match = false;
+		}
+		if (actual.tris != expected.tris) {
+			printf("%s: %d triangles, expected %d\n", filename, actual.tris, expected.tris);
+			match = false;
+		}
+		if (match) {
+			printf("%s: ok, %d commands, %d draws\n", filename, expected.num_commands,
+				expected.counts[RCMD_DRAW]);
+		}
+		return match;
+	}
+}
+
+int
+main(int argc, char** argv)
+{
+	if (argc < 2) {
+		printf("usage: replay recording...\n");
+		return 2;
+	}
+
+	int failed = 0;
+	for (int i = 1; i < argc; ++i)
+		if (!check_recording(argv[i]))
+			++failed;
+	return failed ? 1 : 0;
+}
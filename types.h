@@ -12,6 +12,7 @@ typedef unsigned char	ubyte;
 typedef unsigned short	ushort;
 typedef unsigned int	uint;
 typedef unsigned long	ulong;
+typedef unsigned __int64	uint64;
 
 // Graphics datatypes
 typedef unsigned int	hshader_t;
@@ -325,6 +325,21 @@ u_fnmatch(const char* filename, const char* pattern)
 	return !*filename && !*pattern;	// True if both have reached the ending null
 }
 
+uint
+u_image_name_hash(const char* name, int length)
+	// FNV-1a of the lower case name less its image extension
+{
+	if (length >= 4 && (u_fncmp(name + length - 4, ".tga") == 0 || u_fncmp(name + length - 4, ".jpg") == 0))
+		length -= 4;
+
+	uint hash = 2166136261u;
+	for (int i = 0; i < length; ++i) {
+		hash ^= static_cast<ubyte>(u_tolower(name[i]));
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
 char*
 u_strdup(const char* str)
 	// Duplicate src
@@ -411,6 +426,53 @@ u_strtoi(const char* str, int& i, int def)
 	return true;
 }
 
+void
+u_radix_sort(uint64* keys, int* values, uint64* temp_keys, int* temp_values, int count)
+	// LSD radix sort on 8 bit digits. The histograms for every digit are built
+	// in a single pass over the keys, and any digit that is the same for every
+	// key is skipped, so short or mostly equal keys only cost a pass or two
+{
+	if (count < 2)
+		return;
+
+	int counts[8][256];
+	u_zeromem(counts, sizeof(counts));
+	for (int i = 0; i < count; ++i) {
+		uint64 key = keys[i];
+		for (int digit = 0; digit < 8; ++digit)
+			++counts[digit][static_cast<int>(key >> (digit * 8)) & 0xff];
+	}
+
+	uint64* src_keys = keys;
+	int* src_values = values;
+	uint64* dst_keys = temp_keys;
+	int* dst_values = temp_values;
+	for (int digit = 0; digit < 8; ++digit) {
+		int shift = digit * 8;
+		int* offsets = counts[digit];
+		if (offsets[static_cast<int>(src_keys[0] >> shift) & 0xff] == count)
+			continue;	// Every key has the same value for this digit
+
+		for (int bucket = 0, total = 0; bucket < 256; ++bucket) {
+			int n = offsets[bucket];
+			offsets[bucket] = total;
+			total += n;
+		}
+		for (int j = 0; j < count; ++j) {
+			int pos = offsets[static_cast<int>(src_keys[j] >> shift) & 0xff]++;
+			dst_keys[pos] = src_keys[j];
+			dst_values[pos] = src_values[j];
+		}
+		u_swap(src_keys, dst_keys);
+		u_swap(src_values, dst_values);
+	}
+
+	if (src_keys != keys) {
+		u_memcpy(keys, src_keys, count * sizeof(uint64));
+		u_memcpy(values, src_values, count * sizeof(int));
+	}
+}
+
 int
 u_ppstr_cmp_ppstr(const void* a, const void* b)
 	// Compare contents of string pointers for qsort
@@ -61,6 +61,9 @@ void u_strupr(char* str);
 inline int u_fncmp(const char* a, const char* b) { return u_stricmp(a, b); }
 inline int u_fnncmp(const char* a, const char* b, int size) { return u_strnicmp(a, b, size); }
 bool u_fnmatch(const char* filename, const char* pattern);
+// Hash of the first length chars of an image name, ignoring case and any
+// .tga or .jpg extension so both forms of a name hash the same
+uint u_image_name_hash(const char* name, int length);
 
 char* u_strdup(const char* str);
 char* u_strndup(const char* str, int size);
@@ -102,6 +105,10 @@ inline T u_max(const T& a, const T& b)
 	return a > b ? a : b; 
 }
 
+// Stable radix sort of count keys, values are moved along with their keys.
+// temp_keys and temp_values must be large enough to hold count entries each
+void u_radix_sort(uint64* keys, int* values, uint64* temp_keys, int* temp_values, int count);
+
 // Used for qsorting char* arrays
 int u_ppstr_cmp_ppstr(const void*, const void*);
 // Used for qsorting char* arrays (case insensitive
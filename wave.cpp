@@ -0,0 +1,118 @@
+//-----------------------------------------------------------------------------
+// File: wave.cpp
+//
+// Wave table generation and evaluation
+//-----------------------------------------------------------------------------
+
+#include "wave.h"
+#include "simd.h"
+
+#include "mem.h"
+#define new mem_new
+
+float wave_tables[NUM_WAVE_TYPES][WAVE_TABLE_SIZE];
+
+namespace {
+	const uint NOISE_SEED = 1001;
+
+	int noise_perm[WAVE_NOISE_SIZE];	// Shuffles the noise lattice
+
+	struct wave_table_init_t {
+		// Fills in the tables before anything can use them
+		wave_table_init_t();
+	} wave_table_init;
+
+	wave_table_init_t::wave_table_init_t()
+	{
+		for (int i = 0; i < WAVE_TABLE_SIZE; ++i) {
+			float pos = m_itof(i) / m_itof(WAVE_TABLE_SIZE);
+
+			wave_tables[WAVE_SIN][i] = m_sin(pos * M_2PI);
+			wave_tables[WAVE_SQUARE][i] = pos < 0.5f ? 1.0f : -1.0f;
+			wave_tables[WAVE_SAWTOOTH][i] = pos;
+			wave_tables[WAVE_INVERSESAWTOOTH][i] = 1.0f - pos;
+
+			// 0 up to 1 down to -1 and back up to 0
+			if (pos < 0.25f)
+				wave_tables[WAVE_TRIANGLE][i] = pos * 4.0f;
+			else if (pos < 0.75f)
+				wave_tables[WAVE_TRIANGLE][i] = 2.0f - pos * 4.0f;
+			else
+				wave_tables[WAVE_TRIANGLE][i] = pos * 4.0f - 4.0f;
+		}
+
+		// Noise values and permutation from a simple LCG so they don't depend
+		// on the C library's rand
+		uint seed = NOISE_SEED;
+		for (int n = 0; n < WAVE_NOISE_SIZE; ++n) {
+			seed = seed * 1664525 + 1013904223;
+			wave_tables[WAVE_NOISE][n] = m_itof(static_cast<int>(seed >> 8) & 0xffff) / 32767.5f - 1.0f;
+			noise_perm[n] = n;
+		}
+		for (int p = WAVE_NOISE_SIZE - 1; p > 0; --p) {
+			seed = seed * 1664525 + 1013904223;
+			int swap = static_cast<int>((seed >> 8) % (p + 1));
+			int temp = noise_perm[p];
+			noise_perm[p] = noise_perm[swap];
+			noise_perm[swap] = temp;
+		}
+	}
+
+	inline float
+	noise_at(int i)
+	{
+		return wave_tables[WAVE_NOISE][noise_perm[i & WAVE_NOISE_MASK]];
+	}
+}
+
+float
+wave_noise(float pos)
+{
+	float whole = m_floor(pos);
+	int i = m_ftoi(whole);
+	float f = pos - whole;
+	f = f * f * (3.0f - 2.0f * f);	// Smoothstep between the lattice values
+	float a = noise_at(i);
+	return a + (noise_at(i + 1) - a) * f;
+}
+
+void
+evaluate_waves(const wavefunc_t* waves, int count, float time, float* out)
+	// The table positions for four waves are worked out at a time, then the
+	// samples are fetched one by one as there is no gather, and the base and
+	// amplitude applied four at a time
+{
+	int i = 0;
+#ifdef USE_SSE2
+	const __m128 vtime = _mm_set1_ps(time);
+	const __m128 vsize = _mm_set1_ps(m_itof(WAVE_TABLE_SIZE));
+	const __m128i vmask = _mm_set1_epi32(WAVE_TABLE_MASK);
+	for (; i + 4 <= count; i += 4) {
+		// Load base, amplitude, phase and frequency of four waves and
+		// transpose them so each register holds one field of every wave
+		__m128 base = _mm_loadu_ps(&waves[i].base);
+		__m128 amplitude = _mm_loadu_ps(&waves[i + 1].base);
+		__m128 phase = _mm_loadu_ps(&waves[i + 2].base);
+		__m128 frequency = _mm_loadu_ps(&waves[i + 3].base);
+		_MM_TRANSPOSE4_PS(base, amplitude, phase, frequency);
+
+		__m128 pos = _mm_add_ps(_mm_mul_ps(vtime, frequency), phase);
+		__m128i index = _mm_and_si128(_mm_cvttps_epi32(_mm_mul_ps(pos, vsize)), vmask);
+
+		int indices[4];
+		float samples[4];
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(indices), index);
+		for (int j = 0; j < 4; ++j) {
+			const wavefunc_t& wave = waves[i + j];
+			if (wave.type == WAVE_NOISE)
+				samples[j] = wave_noise((time + wave.phase) * wave.frequency);
+			else
+				samples[j] = wave_tables[wave.type][indices[j]];
+		}
+
+		_mm_storeu_ps(out + i, _mm_add_ps(base, _mm_mul_ps(amplitude, _mm_loadu_ps(samples))));
+	}
+#endif
+	for (; i < count; ++i)
+		out[i] = waves[i].value(time);
+}
@@ -0,0 +1,71 @@
+//-----------------------------------------------------------------------------
+// File: wave.h
+//
+// Wave functions used by shaders, evaluated from precomputed tables
+//-----------------------------------------------------------------------------
+
+#ifndef WAVE_H
+#define WAVE_H
+
+#include "maths.h"
+
+// Each periodic waveform is stored as one period of this many samples, it
+// must be a power of two so positions can be wrapped with a mask
+#define WAVE_TABLE_SIZE		1024
+#define WAVE_TABLE_MASK		(WAVE_TABLE_SIZE - 1)
+
+// Number of random values the noise wave interpolates between
+#define WAVE_NOISE_SIZE		256
+#define WAVE_NOISE_MASK		(WAVE_NOISE_SIZE - 1)
+
+enum wave_type_t {
+	WAVE_INVERSESAWTOOTH,
+	WAVE_NOISE,
+	WAVE_SAWTOOTH,
+	WAVE_SIN,
+	WAVE_SQUARE,
+	WAVE_TRIANGLE,
+	NUM_WAVE_TYPES
+};
+
+// Sample tables, indexed by wave type. The noise entry holds the random values
+// rather than a period, see wave_noise
+extern float wave_tables[NUM_WAVE_TYPES][WAVE_TABLE_SIZE];
+
+// Smoothly interpolated noise in the range -1 to 1, repeating every
+// WAVE_NOISE_SIZE units. The values are generated from a fixed seed so every
+// run sees the same noise
+float wave_noise(float pos);
+
+// Sample one of the periodic waves, pos is measured in periods
+inline float
+wave_sample(wave_type_t type, float pos)
+{
+	return wave_tables[type][m_ftoi(pos * WAVE_TABLE_SIZE) & WAVE_TABLE_MASK];
+}
+
+struct wavefunc_t {
+	// A wave as specified in a shader, kept as plain data as it is used in
+	// unions. base, amplitude, phase and frequency must stay in that order
+	// for evaluate_waves
+	wave_type_t	type;
+	float		base;
+	float		amplitude;
+	float		phase;
+	float		frequency;
+
+	float value(float time) const {
+		if (type == WAVE_NOISE)
+			return base + amplitude * wave_noise((time + phase) * frequency);
+		return base + amplitude * wave_sample(type, time * frequency + phase);
+	}
+
+	float clamp_value(float time) const {
+		return m_clamp(value(time));
+	}
+};
+
+// Evaluate count waves at the same time, out[i] = waves[i].value(time)
+void evaluate_waves(const wavefunc_t* waves, int count, float time, float* out);
+
+#endif
@@ -9,6 +9,7 @@
 #include "util.h"
 #include "console.h"
 #include "input.h"
+#include "pacer.h"
 
 #include "mem.h"
 #define new mem_new
@@ -75,6 +76,7 @@ WinMain(HINSTANCE instance, HINSTANCE prev, LPSTR cmd_line, INT cmd_show)
 			GetCursorPos(&mouse_pos);
 			if (hwnd == GetForegroundWindow() && (mouse_pos.x != centre.x || mouse_pos.y != centre.y)) {
 				mouse.move(mouse_pos.x - centre.x, mouse_pos.y - centre.y);
+				pacer.wake();
 				SetCursorPos((rect.left + rect.right) / 2, (rect.top + rect.bottom) / 2);
 			}
 			if (PeekMessage(&msg, NULL, 0U, 0U, PM_REMOVE))
@@ -106,6 +108,10 @@ WndProc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam)
 	if (create_recieved)
 		created = true;
 
+	// Input or a change of size means the next frame has something new to show
+	if ((msg >= WM_KEYFIRST && msg <= WM_KEYLAST) || (msg >= WM_MOUSEFIRST && msg <= WM_MOUSELAST) || msg == WM_SIZE)
+		pacer.wake();
+
 	switch (msg)
 	{
 	case WM_CHAR:
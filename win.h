@@ -9,6 +9,9 @@
 
 #define STRICT 1
 #define WIN32_LEAN_AND_MEAN
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0403		// For critical section spin counts
+#endif
 #include <windows.h>
 #undef min
 #undef max
@@ -16,4 +19,27 @@
 extern HWND hwnd;
 extern HINSTANCE hinstance;
 
+// Spins before a thread waiting for a critical section blocks. The locks
+// shared with the job threads are only held briefly, so spinning usually
+// gets them without a trip into the kernel
+#define LOCK_SPIN_COUNT		4000
+
+class critical_section_t {
+	// Lock for data shared between threads. Waiting threads block rather
+	// than spinning forever, so a holder at a lower priority still runs
+public:
+	critical_section_t()	{ InitializeCriticalSectionAndSpinCount(&section, LOCK_SPIN_COUNT); }
+	~critical_section_t()	{ DeleteCriticalSection(&section); }
+
+	void enter()	{ EnterCriticalSection(&section); }
+	void leave()	{ LeaveCriticalSection(&section); }
+
+private:
+	// Not copyable
+	critical_section_t(const critical_section_t&);
+	critical_section_t& operator=(const critical_section_t&);
+
+	CRITICAL_SECTION section;
+};
+
 #endif
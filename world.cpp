@@ -10,6 +10,7 @@
 #include "console.h"
 #include "d3d.h"
 #include "entity.h"
+#include "exec.h"
 #include <memory>
 
 #include "mem.h"
@@ -17,6 +18,57 @@
 
 using std::auto_ptr;
 
+cvstr_t
+tessbench_callback(int argc, cvstr_t* argv)
+	// Time the world tesselation of the current view with varying numbers of
+	// threads, usage: tessbench [frames]
+{
+	int frames = 100;
+	if (argc == 1)
+		u_strtoi(argv[0].c_str(), frames, frames);
+	if (!world.is_valid()) {
+		console.print("tessbench: no map loaded\n");
+		return cvstr_t();
+	}
+	world.benchmark_tesselate(u_max(frames, 1));
+	return cvstr_t();
+}
+
+cfunc_t cf_tessbench("tessbench", tessbench_callback, 0, 1);
+
+cvstr_t
+renderbench_callback(int argc, cvstr_t* argv)
+	// Time drawing the current view through the null render backend and show
+	// the commands it generates, usage: renderbench [frames]
+{
+	int frames = 100;
+	if (argc == 1)
+		u_strtoi(argv[0].c_str(), frames, frames);
+	if (!world.is_valid()) {
+		console.print("renderbench: no map loaded\n");
+		return cvstr_t();
+	}
+	world.benchmark_render(u_max(frames, 1));
+	return cvstr_t();
+}
+
+cfunc_t cf_renderbench("renderbench", renderbench_callback, 0, 1);
+
+cvstr_t
+recordframe_callback(int argc, cvstr_t* argv)
+	// Save the render commands for the current view for tools/replay.cpp,
+	// usage: recordframe filename
+{
+	if (!world.is_valid()) {
+		console.print("recordframe: no map loaded\n");
+		return cvstr_t();
+	}
+	world.record_render(argv[0].c_str());
+	return cvstr_t();
+}
+
+cfunc_t cf_recordframe("recordframe", recordframe_callback, 1, 1);
+
 namespace {
 	const int BSPFILE_MAGIC_NUMBER = 0x50534249;	// "IBSP"
 	const int BSPFILE_VERSION = 0x2e;	// Version number to read
@@ -149,8 +201,10 @@ world_t::set_map(const char* name)
 	if (!bsp.load_visdata(file->data() + header->de_visdata.offset, header->de_visdata.length))
 		return;
 
+	if (!d3d.reserve_static(bsp.num_vertices, bsp.num_static_inds))
+		return;
 	d3d.upload_static_verts(bsp.vertices, bsp.num_vertices);
-	d3d.upload_static_inds(bsp.meshverts, bsp.num_meshverts);
+	d3d.upload_static_inds(bsp.static_inds, bsp.num_static_inds);
 
 	// Load the world entities directly into the world
 	if (!parse_entities(reinterpret_cast<const char*>(file->data() + header->de_entities.offset), header->de_entities.length))
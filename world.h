@@ -24,6 +24,16 @@ public:
 
 	void	tesselate(display_list_t &dl, const vec3_t& eye, const frustum_t& frustum) 
 			{ bsp.tesselate(dl, eye, frustum); }
+	bool	view_unchanged(const vec3_t& eye, const frustum_t& frustum) const
+			{ return bsp.view_unchanged(eye, frustum); }
+	void	invalidate_view()
+			{ bsp.invalidate_view(); }
+	void	benchmark_tesselate(int frames)
+			{ bsp.benchmark_tesselate(frames); }
+	void	benchmark_render(int frames)
+			{ bsp.benchmark_render(frames); }
+	void	record_render(const char* filename)
+			{ bsp.record_render(filename); }
 
 	int		resources_to_load();
 	void	load_resource();
@@ -145,23 +145,31 @@ zip_t::open_file(const char* filename)
 	// Opens a single named subfile inside the zip archive. The caller
 	// should delete the returned zip_file_t when finished with it
 {
-	int file_index = find_index(filename);
-	if (file_index == -1)
+	int entry = find_entry(filename);
+	if (entry == -1)
 		return 0;
 	else
-		return new zip_file_t(zip_entries[file_index]);
+		return open_entry(entry);
+}
+
+zip_file_t*
+zip_t::open_entry(int entry)
+	// Opens the subfile with the given entry number, the caller should
+	// delete the returned zip_file_t when finished with it
+{
+	return new zip_file_t(zip_entries[index[entry]]);
 }
 
 bool
 zip_t::file_exists(const char* filename)
 	// Check whether or not the archive has a file with name filename
 {
-	return find_index(filename) != -1;
+	return find_entry(filename) != -1;
 }
 
 int
-zip_t::find_index(const char* filename)
-	// Return the index into the index entries array for filename, -1 if not found
+zip_t::find_entry(const char* filename)
+	// Return the entry number of filename, -1 if not found
 {
 	int left = 0, right = zip_dir->total_entries() - 1;
 
@@ -172,7 +180,7 @@ zip_t::find_index(const char* filename)
 		int middle = (left + right) / 2;
 		int cmp = names[index[middle]].cmpfn(filename);
 		if (cmp == 0)
-			return index[middle];
+			return middle;
 		if (left == right)
 			return -1;
 		if (cmp > 0)
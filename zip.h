@@ -50,9 +50,12 @@ public:
 	bool file_exists(const char* name);
 	zip_file_t* open_file(const char* filename);
 
-private:
-	int find_index(const char* name);
+	// Entries are numbered in sorted name order, as for entry_name
+	int find_entry(const char* name);
+	zip_file_t* open_entry(int entry);
+	uint entry_crc(int entry) const					{ return zip_dir_entries[index[entry]]->crc(); }
 
+private:
 	filename_t* names;	// Names of all the files (unsorted)
 	int*		index;	// Indexes for sorted names
 